@@ -0,0 +1,71 @@
+-- compression ratio and decode throughput of the codecs of compress, on
+-- arrays of random runs. run from the repository root after make, or with
+-- make bench:
+--   lua bench/compress.lua [nbits]
+-- output has the same columns as out/bench_kernels, with compress as suite
+-- and the data and codec as case. ns_per_op is per decompress call and
+-- gb_per_s in bytes of the inflated array, the and_ewah cases time ewah_and
+-- on two compressed arrays. the size and ratio of each blob go to a comment
+-- line before its case
+package.cpath = 'out/?.so'
+local Bitarray = require'bitarray'
+
+local nbits = tonumber(arg and arg[1]) or 2^24
+
+-- runs of 0 and 1 bits with lengths around meanrun, and a share of noisy
+-- words in between
+local function runs(n, meanrun, noise)
+    math.randomseed(n + meanrun)
+    local a = Bitarray.new(n)
+    local i, bit = 1, false
+    while i <= n do
+        local len = math.random(1, 2 * meanrun)
+        if bit then a:from_binarystring(('1'):rep(math.min(len, n - i + 1)), i) end
+        i, bit = i + len, not bit
+    end
+    for _ = 1, math.floor(n / 64 * noise) do
+        a[math.random(1, n)] = true
+    end
+    return a
+end
+
+-- seconds per call of f, doubling the calls until they take a while. the
+-- arrays of earlier rounds are collected outside of the timed calls
+local function timeit(f)
+    f()
+    local reps = 1
+    while true do
+        collectgarbage()
+        local start = os.clock()
+        for _ = 1, reps do f() end
+        local t = os.clock() - start
+        if t >= 0.2 then return t / reps end
+        reps = reps * 2
+    end
+end
+
+local function report(case, t)
+    print(('compress\t%s\t%d\t%.3f\t%.3f'):format(case, nbits, t * 1e9,
+        nbits / 8 / t * 1e-9))
+end
+
+print(('# %s, kernel %s'):format(Bitarray.__version, Bitarray._kernel))
+print('suite\tcase\tnbits\tns_per_op\tgb_per_s')
+local raw = nbits / 8
+for _, case in ipairs{
+    { 'runs4096', 4096, 0 },
+    { 'runs65536', 65536, 0 },
+    { 'runs512', 512, 0 },
+    { 'runs4096_noisy', 4096, 0.05 },
+} do
+    local a = runs(nbits, case[2], case[3])
+    for _, codec in ipairs{ 'raw', 'rle', 'ewah' } do
+        local blob = a:compress(codec, false)
+        assert(Bitarray.decompress(blob) == a)
+        print(('# %s_%s %d bytes, ratio %.1f'):format(case[1], codec, #blob, raw / #blob))
+        report(case[1] .. '_' .. codec, timeit(function() Bitarray.decompress(blob) end))
+    end
+    local b = runs(nbits, case[2] * 2, case[3])
+    local x, y = a:compress(), b:compress()
+    report(case[1] .. '_and_ewah', timeit(function() Bitarray.ewah_and(x, y) end))
+end
@@ -0,0 +1,193 @@
+/* microbenchmarks of the kernels behind the lua methods, built against
+   ext/bitarray_impl.h alone. every case runs on arrays of 64 bits up to
+   maxbits (2^30 unless given) in steps of 8x, repeated until it has run for
+   at least mintime seconds. run from the repository root after make bench,
+   or by hand:
+     out/bench_kernels [maxbits [mintime]]
+   output is tab separated, one line per case and size, after a header line
+   and comment lines starting with #:
+     suite  case  nbits  ns_per_op  gb_per_s
+   bulk cases do one op per call over the whole array and gb_per_s is the
+   array size in bytes over the time of one op. element cases (get, set,
+   get_bitsN, set_bitsN) time single accesses at random positions and print
+   - for gb_per_s */
+#include "../ext/bitarray_impl.h"
+
+#include <time.h>
+
+/* accesses per call of an element case */
+#define NACCESS 4096
+
+static Bitarray a, b, c;
+static size_t positions[NACCESS];
+static volatile size_t sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* xorshift, so that runs are repeatable */
+static uint64_t rnd(void)
+{
+    static uint64_t x = 88172645463325252ull;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/* positions at which k bits can be read */
+static void pick_positions(size_t k)
+{
+    for (size_t i = 0; i < NACCESS; ++i)
+        positions[i] = (size_t)(rnd() % (a.size - k + 1));
+}
+
+static void run_get(void)
+{
+    size_t s = 0;
+    for (size_t i = 0; i < NACCESS; ++i)
+        s += bitarray_get_bit(&a, positions[i]);
+    sink += s;
+}
+
+static void run_set(void)
+{
+    for (size_t i = 0; i < NACCESS; ++i)
+        bitarray_set_bit(&a, positions[i], (int)(i & 1));
+}
+
+#define BENCH_BITS(N) \
+    static void run_get_bits##N(void) \
+    { \
+        uint64_t s = 0; \
+        for (size_t i = 0; i < NACCESS; ++i) \
+            s += bitarray_get_bits(&a, positions[i], N); \
+        sink += (size_t)s; \
+    } \
+    static void run_set_bits##N(void) \
+    { \
+        for (size_t i = 0; i < NACCESS; ++i) \
+            bitarray_set_bits(&a, positions[i], N, (uint64_t)i * 0x9E3779B97F4A7C15ull); \
+    }
+
+BENCH_BITS(8)
+BENCH_BITS(16)
+BENCH_BITS(32)
+BENCH_BITS(64)
+
+#undef BENCH_BITS
+
+static void run_fill(void) { bitarray_fill(&a, 1); }
+static void run_flip(void) { bitarray_flip(&a); }
+static void run_not(void) { bitarray_not(&c, &a); }
+static void run_and(void) { bitarray_and(&c, &a, &b); }
+static void run_or(void) { bitarray_or(&c, &a, &b); }
+static void run_xor(void) { bitarray_xor(&c, &a, &b); }
+static void run_andnot(void) { bitarray_andnot(&c, &a, &b); }
+static void run_lshift(void) { bitarray_be_lshift(&a, 13); }
+static void run_rshift(void) { bitarray_be_rshift(&a, 13); }
+static void run_lshift_word(void) { bitarray_be_lshift2(&a, &c, BITS_PER_WORD); }
+static void run_copyvalues(void) { bitarray_copyvalues(&a, &c); }
+static void run_reverse(void) { bitarray_reverse(&a); }
+static void run_equal(void) { sink += (size_t)bitarray_equal(&a, &b); }
+static void run_count(void) { sink += bitarray_count(&a, 0, a.size); }
+
+/* copies all but 8 bits to a position 3 bits further, so that neither end
+   is word aligned */
+static void run_copyvalues2(void)
+{
+    bitarray_copyvalues2(&a, &c, 0, a.size - 8, 3);
+}
+
+typedef struct Case
+{
+    const char *name;
+    void (*run)(void);
+    size_t bits; /* bits of an element case, 0 for bulk cases */
+} Case;
+
+static const Case cases[] =
+{
+    { "get", run_get, 1 },
+    { "set", run_set, 1 },
+    { "get_bits8", run_get_bits8, 8 },
+    { "get_bits16", run_get_bits16, 16 },
+    { "get_bits32", run_get_bits32, 32 },
+    { "get_bits64", run_get_bits64, 64 },
+    { "set_bits8", run_set_bits8, 8 },
+    { "set_bits16", run_set_bits16, 16 },
+    { "set_bits32", run_set_bits32, 32 },
+    { "set_bits64", run_set_bits64, 64 },
+    { "fill", run_fill, 0 },
+    { "flip", run_flip, 0 },
+    { "not", run_not, 0 },
+    { "and", run_and, 0 },
+    { "or", run_or, 0 },
+    { "xor", run_xor, 0 },
+    { "andnot", run_andnot, 0 },
+    { "shiftleft", run_lshift, 0 },
+    { "shiftright", run_rshift, 0 },
+    { "shiftleft_word", run_lshift_word, 0 },
+    { "copyvalues", run_copyvalues, 0 },
+    { "copyvalues2", run_copyvalues2, 0 },
+    { "reverse", run_reverse, 0 },
+    { "equal", run_equal, 0 },
+    { "count", run_count, 0 },
+    { NULL, NULL, 0 }
+};
+
+/* seconds per call of run, doubling the calls until they take mintime */
+static double timeit(void (*run)(void), double mintime)
+{
+    run();
+    for (size_t reps = 1;; reps *= 2) {
+        double start = now();
+        for (size_t i = 0; i < reps; ++i)
+            run();
+        double t = now() - start;
+        if (t >= mintime)
+            return t / (double)reps;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxbits = argc > 1 ? (size_t)strtoull(argv[1], NULL, 0) : (size_t)1 << 30;
+    double mintime = argc > 2 ? strtod(argv[2], NULL) : 0.1;
+
+    bitarray_select_kernels();
+    printf("# kernel %s, %d bit words\n", bitarray_kernels.name, (int)BITS_PER_WORD);
+    printf("suite\tcase\tnbits\tns_per_op\tgb_per_s\n");
+    for (size_t n = 64; n <= maxbits; n *= 8) {
+        if (!bitarray_validate(&a, n, NULL) || !bitarray_validate(&b, n, NULL)
+            || !bitarray_validate(&c, n, NULL)) {
+            fprintf(stderr, "cannot allocate 3 arrays of %zu bits\n", n);
+            return 1;
+        }
+        for (const Case *k = cases; k->name != NULL; ++k) {
+            /* fresh random contents for every case, b equal to a so that
+               equal has to look at every word */
+            for (size_t i = 0; i < WORDS_FOR_BITS(n); ++i)
+                a.values[i] = (WORD)rnd();
+            bitarray_clear_tail(&a);
+            bitarray_copyvalues(&a, &b);
+            if (k->bits != 0)
+                pick_positions(k->bits);
+            double t = timeit(k->run, mintime);
+            if (k->bits != 0)
+                printf("kernels\t%s\t%zu\t%.3f\t-\n", k->name, n, t / NACCESS * 1e9);
+            else
+                printf("kernels\t%s\t%zu\t%.3f\t%.3f\n", k->name, n, t * 1e9,
+                    (double)(WORDS_FOR_BITS(n) * sizeof(WORD)) / t * 1e-9);
+            fflush(stdout);
+        }
+        bitarray_invalidate(&a);
+        bitarray_invalidate(&b);
+        bitarray_invalidate(&c);
+    }
+    return 0;
+}
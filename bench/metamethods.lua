@@ -0,0 +1,70 @@
+-- cost of the lua side of an access: metamethods against the method calls
+-- they stand for, on arrays of a few sizes. run from the repository root
+-- after make, or with make bench:
+--   lua bench/metamethods.lua [mintime]
+-- output has the same columns as out/bench_kernels, with the lua version as
+-- suite. ns_per_op is per access and includes the loop, the empty_loop case
+-- gives what the loop itself costs. gb_per_s is only printed for concat, as
+-- bytes of the result over the time of one concatenation
+package.cpath = 'out/?.so'
+local Bitarray = require'bitarray'
+
+local mintime = tonumber(arg and arg[1]) or 0.1
+local suite = _VERSION:gsub(' ', '')
+-- accesses per call of a case
+local N = 10000
+
+-- seconds per call of f, doubling the calls until they take mintime
+local function timeit(f)
+    f()
+    local reps = 1
+    while true do
+        local start = os.clock()
+        for _ = 1, reps do f() end
+        local t = os.clock() - start
+        if t >= mintime then return t / reps end
+        reps = reps * 2
+    end
+end
+
+print(('# %s, kernel %s'):format(Bitarray.__version, Bitarray._kernel))
+print('suite\tcase\tnbits\tns_per_op\tgb_per_s')
+for _, n in ipairs{ 64, 4096, 2^20 } do
+    local a = Bitarray.new(n)
+    local b = Bitarray.new(n)
+    local s = 0
+    local cases = {
+        { 'empty_loop', function()
+            for i = 1, N do s = i end
+        end },
+        { 'index', function()
+            for i = 1, N do s = a[i % n + 1] end
+        end },
+        { 'at', function()
+            for i = 1, N do s = a:at(i % n + 1) end
+        end },
+        { 'newindex', function()
+            for i = 1, N do a[i % n + 1] = true end
+        end },
+        { 'set', function()
+            for i = 1, N do a:set(i % n + 1, true) end
+        end },
+        { 'len', function()
+            for _ = 1, N do s = #a end
+        end },
+        { 'len_method', function()
+            for _ = 1, N do s = a:len() end
+        end },
+    }
+    for _, case in ipairs(cases) do
+        local t = timeit(case[2])
+        print(('%s\t%s\t%d\t%.3f\t-'):format(suite, case[1], n, t / N * 1e9))
+    end
+    -- one concatenation per call. the storage of the new array is part of
+    -- its userdata, so the collector keeps memory down on its own
+    local t = timeit(function()
+        s = a .. b
+    end)
+    print(('%s\t%s\t%d\t%.3f\t%.3f'):format(suite, 'concat', n, t * 1e9,
+        2 * n / 8 / t * 1e-9))
+end
@@ -1,7 +1,8 @@
 -- this is a string encryption example
 -- the bitarray simplifies all bitwise tricks into plain array access
 
-local newbitarray = require'bitarray'.new
+local Bitarray = require'bitarray'
+local newbitarray = Bitarray.new
 
 local function swapitem(t, i, j)
     local tmp = t[i]
@@ -11,21 +12,11 @@ end
 
 local function bitarray_fromcharstring(s)
     assert(type(s) == 'string' and s ~= '')
-    local bits = newbitarray(#s * 8)
-    for i = 1, #s do
-        local k = 1 + (i-1) * 8
-        bits:from_uint8(s:byte(i), k)
-    end
-    return bits
+    return Bitarray.from_bytes(s)
 end
 
 local function bitarray_tocharstring(bits)
-    local res = {}
-    for i = 1, #bits, 8 do
-        local num = bits:at_uint8(i)
-        res[#res+1] = string.char(num)
-    end
-    return table.concat(res)
+    return bits:to_bytes()
 end
 
 local function secret(len)
@@ -1,4 +1,8 @@
 #include "bitarray_impl.h"
+#include "bitarray_sparse.h"
+#include "bitarray_codec.h"
+#include "bitarray_bloom.h"
+#include "bitarray_expr.h"
 #include "lualibdefs.h"
 
 
@@ -17,21 +21,122 @@
 #define BITARRAY_INFO "bitarray 1.51 for " LUA_VERSION
 
 /**
- * <code>sizeof(unsigned int)</code>.
+ * Size in bytes of one storage word, 8 by default on 64-bit targets and 4
+ * otherwise. Can be changed at build time with <code>make WORD_BITS=32</code>.
  * @number _blocksize
  */
 #define BITARRAY_BLOCK_SIZE sizeof(WORD)
 
+/**
+ * Name of the bulk kernel set picked for this cpu when the library was
+ * loaded: "avx512", "avx2", "sse2" or "scalar".
+ * @string _kernel
+ */
+
 #define BITARRAY_MT_1 "cleoold.lua.bitarray_mt1"
+#define BITARRAY_MT_SPARSE "cleoold.lua.bitarray_sparse"
+#define BITARRAY_MT_BLOOM "cleoold.lua.bitarray_bloom"
+#define BITARRAY_MT_EXPR "cleoold.lua.bitarray_expr"
+
+/* smallest array copyfrom shares the words of, in bytes. copying less is
+   cheaper than setting up the sharing */
+#define BITARRAY_CLONE_MIN_BYTES 4096
+
+/* whether a lua integer can be the size of an array on this platform */
+#define validsize(n) ((n) > 0 && bitarray_size_fits((uint64_t)(n)))
 
 /* checks whether given argument is bitarray */
 #define checkbitarray(L, i) (Bitarray *)luaL_checkudata(L, (i), BITARRAY_MT_1)
 
-/* create an array and push it to the top of the stack */
+/* every mutator passes its array through here before writing to it, so
+   read-only arrays can be refused, words read by views can be copied and
+   anything derived from the old contents can be dropped */
+static Bitarray *writable(lua_State *L, Bitarray *ba)
+{
+    if (ba->readonly)
+        luaL_error(L, "attempt to modify a read-only array");
+    if (!bitarray_buffer_write(ba))
+        luaL_error(L, "not enough memory");
+    bitarray_drop_directory(ba);
+    return ba;
+}
+
+/* checks whether given argument is bitarray that is about to be modified */
+#define checkbitarray_mut(L, i) writable((L), checkbitarray(L, (i)))
+
+/* io library file handles are FILE** in 5.1 and luaL_Stream later */
+#ifndef LUA_FILEHANDLE
+    #define LUA_FILEHANDLE "FILE*"
+#endif
+
+/* checks whether given argument is an open io library file */
+static FILE *checkfile(lua_State *L, int i)
+{
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream *p = (luaL_Stream *)luaL_checkudata(L, i, LUA_FILEHANDLE);
+    if (p->closef == NULL)
+        luaL_argerror(L, i, "attempt to use a closed file");
+    return p->f;
+#else
+    FILE **p = (FILE **)luaL_checkudata(L, i, LUA_FILEHANDLE);
+    if (*p == NULL)
+        luaL_argerror(L, i, "attempt to use a closed file");
+    return *p;
+#endif
+}
+
+/* length of the table at index i, without metamethods */
+#if LUA_VERSION_NUM >= 502
+    #define rawlen(L, i) lua_rawlen((L), (i))
+#else
+    #define rawlen(L, i) lua_objlen((L), (i))
+#endif
+
+/* the table of the userdata at index i, a function environment in 5.1 */
+#if LUA_VERSION_NUM >= 502
+    #define getuservalue(L, i) lua_getuservalue((L), (i))
+    #define setuservalue(L, i) lua_setuservalue((L), (i))
+#else
+    #define getuservalue(L, i) lua_getfenv((L), (i))
+    #define setuservalue(L, i) lua_setfenv((L), (i))
+#endif
+
+/* pushes a size as a number that prints without a fraction. lua_Integer is
+   a ptrdiff_t before 5.3 and cannot hold every size on 32-bit targets */
+static void pushsize(lua_State *L, size_t n)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, (lua_Integer)n);
+#else
+    lua_pushnumber(L, (lua_Number)n);
+#endif
+}
+
+/* the userdata at index i if it has the metatable tname, else NULL */
+static void *testudata(lua_State *L, int i, const char *tname)
+{
+    void *p = lua_touserdata(L, i);
+    if (p == NULL || !lua_getmetatable(L, i))
+        return NULL;
+    luaL_getmetatable(L, tname);
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same ? p : NULL;
+}
+
+/* checks whether given argument is sparse bitarray */
+#define checksparse(L, i) (BitarraySparse *)luaL_checkudata(L, (i), BITARRAY_MT_SPARSE)
+
+/* checks whether given argument is bloom filter */
+#define checkbloom(L, i) (BitarrayBloom *)luaL_checkudata(L, (i), BITARRAY_MT_BLOOM)
+
+/* create an array and push it to the top of the stack. the words are part
+   of the userdata, so that the collector sees the whole size of the array */
 static int _l_new(lua_State *L, size_t nbits)
 {
-    Bitarray *ba = (Bitarray *)lua_newuserdata(L, sizeof(Bitarray));
-    if (bitarray_validate(ba, nbits) == 0)
+    Bitarray *ba = (Bitarray *)lua_newuserdata(L, BITARRAY_EMBEDDED_SIZE(nbits));
+    if (bitarray_validate(ba, nbits,
+        (WORD *)((unsigned char *)ba + BITARRAY_EMBED_OFFSET)) == 0)
         /* if fails to allocate array */
         return 0;
 
@@ -40,6 +145,60 @@ static int _l_new(lua_State *L, size_t nbits)
     return 1;
 }
 
+/* create an array reading nbits bits of ba from word k on, as bitarray_view
+   does, and push it to the top of the stack. returns 0 if fails to set it up */
+static int _l_view(lua_State *L, Bitarray *ba, size_t k, size_t nbits, int paged)
+{
+    Bitarray *v = (Bitarray *)lua_newuserdata(L, sizeof(Bitarray));
+    if (bitarray_view(v, ba, k, nbits, paged) == 0)
+        return 0;
+
+    luaL_getmetatable(L, BITARRAY_MT_1);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/* push a copy of ba to the top of the stack. it reads the words of ba until
+   one of the two is written, unless ba is small enough to copy right away, or
+   mapped or shared. returns 0 if fails to allocate it */
+static int _l_clone(lua_State *L, Bitarray *ba)
+{
+    if (WORDS_FOR_BITS(ba->size) * sizeof(WORD) >= BITARRAY_CLONE_MIN_BYTES
+        && ba->maplen == 0 && ba->shared == NULL)
+        return _l_view(L, ba, 0, ba->size, 1);
+    if (_l_new(L, ba->size) == 0)
+        return 0;
+    bitarray_copyvalues(ba, (Bitarray *)lua_touserdata(L, -1));
+    return 1;
+}
+
+/* create an empty sparse array and push it to the top of the stack */
+static BitarraySparse *_l_newsparse(lua_State *L, size_t nbits)
+{
+    BitarraySparse *sp = (BitarraySparse *)lua_newuserdata(L, sizeof(BitarraySparse));
+    bitarray_sparse_init(sp, nbits);
+    luaL_getmetatable(L, BITARRAY_MT_SPARSE);
+    lua_setmetatable(L, -2);
+    return sp;
+}
+
+/* create an empty bloom filter and push it to the top of the stack, returns
+   NULL if fails to allocate it. the words are part of the userdata like in
+   _l_new */
+static BitarrayBloom *_l_newbloom(lua_State *L, size_t m, size_t k)
+{
+    size_t nbits = bitarray_bloom_bits(m);
+    /* lua only promises the alignment of a double or so, the words are
+       moved up to a cache line boundary */
+    BitarrayBloom *f = (BitarrayBloom *)lua_newuserdata(L, sizeof(BitarrayBloom)
+        + BITARRAY_BLOOM_ALIGN - 1 + WORDS_FOR_BITS(nbits) * sizeof(WORD));
+    if (bitarray_bloom_init(f, nbits, k, bitarray_bloom_align(f + 1)) == 0)
+        return NULL;
+    luaL_getmetatable(L, BITARRAY_MT_BLOOM);
+    lua_setmetatable(L, -2);
+    return f;
+}
+
 /**
  * Creates a new bit array of n bits. all fields are initialized to 0.
  * @function new
@@ -49,349 +208,2528 @@ static int _l_new(lua_State *L, size_t nbits)
 BITARRAY_API static int l_new(lua_State *L)
 {
     lua_Integer nbits = luaL_checkinteger(L, 1);
-    luaL_argcheck(L, nbits > 0, 1, "invalid size");
+    luaL_argcheck(L, validsize(nbits), 1, "invalid size");
 
     return _l_new(L, (size_t)nbits);
 }
 
 /**
- * Creates a new bit array, identical to src.
+ * Creates a new bit array, identical to src. Arrays of 4 KiB or more are not
+ * copied: the two read the same bits until one of them is written. On
+ * systems with file mappings, arrays of 256 KiB or more are then kept in an
+ * anonymous memory file that each maps privately, so a write only copies the
+ * memory pages it touches, otherwise the first one copies the whole array. Bitarray.memstats
+ * then no longer counts the array, nor the pages written. Mapped and shared
+ * arrays are always copied.
  * @function copyfrom
  * @tparam Bitarray src
  * @treturn Bitarray|nil the newly created bitarray if successful
+ * @usage
+ * local template = Bitarray.new(2^27):fill(true)
+ * local mine = Bitarray.copyfrom(template)  -- nothing copied
+ * mine[42] = false                          -- copies one page
  */
 BITARRAY_API static int l_copyfrom(lua_State *L)
 {
     Bitarray *ba = checkbitarray(L, 1);
 
-    if (_l_new(L, ba->size) == 0)
+    return _l_clone(L, ba);
+}
+
+/* bit order names accepted by the byte conversions */
+static const char *const bitorders[] = { "msb", "lsb", NULL };
+
+/**
+ * Creates a new bit array from the bytes of a string, 8 bits per byte. With
+ * the default "msb" order the first bit of every byte is its most significant
+ * one, same as from_uint8. With "lsb" it is the least significant one.
+ * @function from_bytes
+ * @tparam string src not empty
+ * @tparam[opt] string order "msb" or "lsb", default "msb"
+ * @treturn Bitarray|nil the newly created bitarray if successful
+ * @usage
+ * local a = Bitarray.from_bytes('\45')
+ * print(a) -- Bitarray[0,0,1,0,1,1,0,1]
+ * local b = Bitarray.from_bytes('\45', 'lsb')
+ * print(b) -- Bitarray[1,0,1,1,0,1,0,0]
+ */
+BITARRAY_API static int l_from_bytes(lua_State *L)
+{
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    luaL_argcheck(L, len > 0, 1, "empty string");
+    luaL_argcheck(L, len <= SIZE_MAX / CHAR_BIT, 1, "string too long");
+    int msb = luaL_checkoption(L, 2, "msb", bitorders) == 0;
+
+    if (_l_new(L, len * CHAR_BIT) == 0)
         return 0;
-    bitarray_copyvalues(ba, (Bitarray *)lua_touserdata(L, -1));
+    Bitarray *ba = (Bitarray *)lua_touserdata(L, -1);
+    bitarray_from_bytes(ba->values, (const unsigned char *)s, len, msb);
     return 1;
 }
 
+/* ways to map a file, in the order of BITARRAY_MAP_* */
+static const char *const mapmodes[] = { "shared", "private", "readonly", NULL };
+
 /**
- * @type Bitarray
+ * Creates a bit array whose bits live in a file written by save. The file
+ * is mapped into memory instead of being read, so opening even a huge array
+ * is immediate and processes mapping the same file share its pages. The
+ * file must have been written by a build with the same word size on a host
+ * with the same byte order, see Bitarray.read otherwise, and its checksum is
+ * not verified. Unless the mode is "private", the unused bits of the last
+ * word must be 0. The array cannot be resized. Only available on POSIX
+ * systems.
+ * @function mmap
+ * @tparam string path
+ * @tparam[opt] integer nbits number of bits of the array. Needed to create a
+ * new file, otherwise it must match the file if given.
+ * @tparam[optchain] string mode "shared" (default): changes are written to
+ * the file, which is created with nbits 0 bits if it is empty or does not
+ * exist. Its checksum is dropped. "private": changes stay in this process.
+ * "readonly": mutators raise an error.
+ * @treturn Bitarray|nil the mapped array, or nil and an error message
+ * @see save
+ * @usage
+ * local seen = Bitarray.mmap('/var/lib/app/seen.bits', 2^34)
+ * seen[12345] = true
+ * seen:sync()
  */
-
-static Bitarray *checkbitarray_and_index(lua_State *L, size_t *i)
+BITARRAY_API static int l_mmap(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    lua_Integer i_ = luaL_checkinteger(L, 2) - 1;
-    luaL_argcheck(L, 0 <= i_ && i_ < ba->size, 2, "index out of range");
-    *i = (size_t)i_;
-    return ba;
+    const char *path = luaL_checkstring(L, 1);
+    lua_Integer nbits = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, nbits == 0 || validsize(nbits), 2, "invalid size");
+    int mode = luaL_checkoption(L, 3, "shared", mapmodes);
+
+#ifdef BITARRAY_HAVE_MMAP
+    Bitarray *ba = (Bitarray *)lua_newuserdata(L, sizeof(Bitarray));
+    const char *err = bitarray_mmap(ba, path, (size_t)nbits, mode);
+    if (err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, err);
+        return 2;
+    }
+    luaL_getmetatable(L, BITARRAY_MT_1);
+    lua_setmetatable(L, -2);
+    return 1;
+#else
+    (void)path;
+    (void)mode;
+    return luaL_error(L, "mmap is not supported on this platform");
+#endif
 }
 
-/* default opt chain: [,1 [,array size]] */
-static Bitarray *checkbitarray_and_optrange(lua_State *L, size_t *from, size_t *to)
+/* validates the serialized array of len bytes at s and its checksum. on
+   success fills hd and the size of the payload in n and returns NULL */
+static const char *check_serialized(const unsigned char *s, size_t len,
+    BitarrayHeader *hd, size_t *n)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    lua_Integer from_ = luaL_optinteger(L, 2, 1) - 1;
-    luaL_argcheck(L, 0 <= from_ && from_ < ba->size, 2, "invalid index");
-    lua_Integer to_ = luaL_optinteger(L, 3, ba->size);
-    luaL_argcheck(L, to_ > from_ && to_ <= ba->size, 3, "invalid index");
-    *from = (size_t)from_;
-    *to = (size_t)to_;
-    return ba;
+    if (len < BITARRAY_HEADER_BYTES)
+        return "data is truncated";
+    const char *err = bitarray_header_read(s, hd);
+    if (err != NULL)
+        return err;
+    size_t trailer = hd->crc ? 4 : 0;
+    size_t total = len;
+    if (hd->codec == BITARRAY_CODEC_RAW)
+        total = BITARRAY_HEADER_BYTES + bitarray_payload_bytes(hd) + trailer;
+    if (len < total || len < BITARRAY_HEADER_BYTES + trailer)
+        return "data is truncated";
+    if (len > total)
+        return "trailing data after the array";
+    if (hd->crc && bitarray_get_le32(s + total - 4)
+        != bitarray_kernels.crc32c(0, s, total - 4))
+        return "checksum mismatch";
+    *n = total - BITARRAY_HEADER_BYTES - trailer;
+    return NULL;
 }
 
 /**
- * <i>Mutates the array.</i> <br />
- * Set the ith bit of the array. Any value other than false or nil will be
- * considered a truthy(1) bit. <br />
- * Operator __newindex is overloaded with this method.
- * @function set
- * @tparam integer i the index
- * @tparam any b the value to change to
- * @treturn Bitarray the original bit array reference
+ * Creates a bit array from a string produced by dump or compress. Arrays
+ * dumped by builds with another word size or on hosts with another byte
+ * order are converted.
+ * @function load
+ * @tparam string src
+ * @treturn Bitarray|nil the newly created bitarray, or nil and an error
+ * message if src is not a valid dump or fails its checksum
+ * @see dump
  * @usage
- * local a = Bitarray.new(10)
- * a:set(4, true)
- * a[4] = true -- same
+ * local a = Bitarray.load(Bitarray.new(3):set(2, true):dump())
+ * print(a) -- Bitarray[0,1,0]
  */
-BITARRAY_API static int setbit(lua_State *L)
+BITARRAY_API static int l_load(lua_State *L)
 {
-    size_t i;
-    Bitarray *ba = checkbitarray_and_index(L, &i);
-    luaL_checkany(L, 3);
-
-    bitarray_set_bit(ba, i, lua_toboolean(L, 3));
-    lua_pushvalue(L, 1);
-    return 1;
+    size_t len, n;
+    const unsigned char *s = (const unsigned char *)luaL_checklstring(L, 1, &len);
+    BitarrayHeader hd;
+    const char *err = check_serialized(s, len, &hd, &n);
+    if (err == NULL) {
+        if (_l_new(L, (size_t)hd.nbits) == 0)
+            return 0;
+        Bitarray *ba = (Bitarray *)lua_touserdata(L, -1);
+        err = bitarray_decode(ba, s + BITARRAY_HEADER_BYTES, n, &hd);
+        if (err == NULL)
+            return 1;
+    }
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
 }
 
 /**
- * <i>Does not mutate the array.</i> <br />
- * Get the ith bit of the array. <br />
- * Operator __index is overloaded with this method.
- * @function at
- * @tparam integer i the index
- * @treturn boolean true if bit is 1, false if 0
- * @usage
- * local a = Bitarray.new(10)
- * a:at(7) -- false
- * a[7]    -- false
+ * Creates a bit array from a string produced by compress, same as load.
+ * @function decompress
+ * @tparam string blob
+ * @treturn Bitarray|nil the newly created bitarray, or nil and an error
+ * message if blob is corrupt
+ * @see compress
  */
-BITARRAY_API static int getbit(lua_State *L)
+BITARRAY_API static int l_decompress(lua_State *L)
 {
-    size_t i;
-    Bitarray *ba = checkbitarray_and_index(L, &i);
+    return l_load(L);
+}
 
-    lua_pushboolean(L, bitarray_get_bit(ba, i));
+/* checks that argument i is an ewah compressed array. on success fills hd
+   and the payload and returns NULL */
+static const char *check_ewah(lua_State *L, int i, BitarrayHeader *hd,
+    const unsigned char **p, size_t *n)
+{
+    size_t len;
+    const unsigned char *s = (const unsigned char *)luaL_checklstring(L, i, &len);
+    const char *err = check_serialized(s, len, hd, n);
+    if (err != NULL)
+        return err;
+    if (hd->codec != BITARRAY_CODEC_EWAH)
+        return "not an ewah compressed array";
+    *p = s + BITARRAY_HEADER_BYTES;
+    if (!bitarray_ewah_check(*p, *n, bitarray_words64((size_t)hd->nbits)))
+        return "corrupt data";
+    return NULL;
+}
+
+/* pushes the serialized array of nbits with the payload in body compressed
+   with codec, and frees body */
+static void push_compressed(lua_State *L, size_t nbits, int codec,
+    BitarrayBytes *body, int crc)
+{
+    if (body->failed) {
+        free(body->p);
+        luaL_error(L, "not enough memory");
+    }
+    unsigned char h[BITARRAY_HEADER_BYTES];
+    bitarray_codec_header(h, nbits, codec, crc);
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    luaL_addlstring(&buf, (const char *)h, sizeof(h));
+    luaL_addlstring(&buf, (const char *)body->p, body->n);
+    if (crc) {
+        unsigned char t[4];
+        uint32_t c = bitarray_kernels.crc32c(0, h, sizeof(h));
+        bitarray_put_le32(t, bitarray_kernels.crc32c(c, body->p, body->n));
+        luaL_addlstring(&buf, (const char *)t, sizeof(t));
+    }
+    free(body->p);
+    luaL_pushresult(&buf);
+}
+
+static int ewah_binop(lua_State *L, int op)
+{
+    BitarrayHeader hx, hy;
+    const unsigned char *px, *py;
+    size_t nx, ny;
+    const char *err = check_ewah(L, 1, &hx, &px, &nx);
+    if (err == NULL)
+        err = check_ewah(L, 2, &hy, &py, &ny);
+    if (err == NULL && hx.nbits != hy.nbits)
+        err = "arrays of different sizes";
+    if (err != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+    BitarrayEwahCursor x, y;
+    BitarrayEwahWriter w;
+    bitarray_ewah_cursor(&x, px, nx);
+    bitarray_ewah_cursor(&y, py, ny);
+    bitarray_ewah_op(&w, &x, &y, bitarray_words64((size_t)hx.nbits), op);
+    push_compressed(L, (size_t)hx.nbits, BITARRAY_CODEC_EWAH, &w.out, 1);
     return 1;
 }
 
 /**
- * <i>Does not mutate the array.</i> <br />
- * Get the length of the array. <br />
- * Operator __len is overloaded with this method.
- * @function len
- * @treturn integer the number of bits of the array
+ * Intersects two arrays compressed with the "ewah" codec without inflating
+ * them. Runs of 0 bits in either one skip the other in a single step, so
+ * the cost follows the compressed sizes rather than the length of the
+ * arrays.
+ * @function ewah_and
+ * @tparam string x compressed array
+ * @tparam string y compressed array of the same length
+ * @treturn string|nil x AND y compressed with "ewah", or nil and an error
+ * message if an input is corrupt or the lengths differ
+ * @see compress
  * @usage
- * local a = Bitarray.new(10)
- * a:len(a) -- 10
- * #a       -- 10
+ * local both = Bitarray.decompress(Bitarray.ewah_and(a:compress(), b:compress()))
  */
-BITARRAY_API static int len(lua_State *L)
+BITARRAY_API static int l_ewah_and(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    lua_pushinteger(L, ba->size);
-    return 1;
+    return ewah_binop(L, BITARRAY_EWAH_AND);
 }
 
 /**
- * <i>Mutates the array.</i> <br />
- * Set all bits of the array. Any value other than false or nil will be
- * considered a truthy(1) bit. <br />
- * @function fill
- * @tparam any b the value to change to
- * @treturn Bitarray the original bit array reference
- * @usage
- * local a = Bitarray.new(10)
- * a:fill(true)  -- all bits set to 1
+ * Union of two arrays compressed with the "ewah" codec, see ewah_and.
+ * @function ewah_or
+ * @tparam string x compressed array
+ * @tparam string y compressed array of the same length
+ * @treturn string|nil x OR y compressed with "ewah", or nil and an error
+ * message
  */
-BITARRAY_API static int fill(lua_State *L)
+BITARRAY_API static int l_ewah_or(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    luaL_checkany(L, 2);
+    return ewah_binop(L, BITARRAY_EWAH_OR);
+}
 
-    bitarray_fill(ba, lua_toboolean(L, 2));
-    lua_pushvalue(L, 1);
-    return 1;
+/**
+ * Exclusive or of two arrays compressed with the "ewah" codec, see ewah_and.
+ * @function ewah_xor
+ * @tparam string x compressed array
+ * @tparam string y compressed array of the same length
+ * @treturn string|nil x XOR y compressed with "ewah", or nil and an error
+ * message
+ */
+BITARRAY_API static int l_ewah_xor(lua_State *L)
+{
+    return ewah_binop(L, BITARRAY_EWAH_XOR);
 }
 
 /**
- * <i>Mutates the array.</i> <br />
- * If argument i is present, the bit at that index is flipped, if not or
- * i is 0, all the bits are flipped.
- * @function flip
- * @tparam[opt] integer i the index
- * @treturn Bitarray the original bit array reference
+ * Reads an array written by save from a file, starting at its current
+ * position, which is left right after the array. The bits are streamed
+ * into the new array, so the file may hold several arrays or other data.
+ * Arrays saved by builds with another word size or on hosts with another
+ * byte order are converted.
+ * @function read
+ * @tparam file f a file opened for reading, in binary mode
+ * @treturn Bitarray|nil the newly created bitarray, or nil and an error
+ * message if the file does not hold a valid array or it fails its checksum
+ * @see save
  * @usage
- * local a = Bitarray.new(10)
- * a:flip()    -- all bits set to true
- * a:flip(1)   -- sets first bit to true
+ * local f = assert(io.open('bits.dat', 'rb'))
+ * local a = assert(Bitarray.read(f))
+ * f:close()
  */
-BITARRAY_API static int flip(lua_State *L)
+BITARRAY_API static int l_read(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    lua_Integer i = luaL_optinteger(L, 2, 0);
-    luaL_argcheck(L, 0 <= i && i <= ba->size, 2, "index out of range");
-    if (i == 0)
-        bitarray_flip(ba);
+    FILE *f = checkfile(L, 1);
+    unsigned char h[BITARRAY_HEADER_BYTES];
+    BitarrayHeader hd;
+    const char *err;
+    if (fread(h, 1, sizeof(h), f) != sizeof(h))
+        err = ferror(f) ? strerror(errno) : "data is truncated";
     else
-        bitarray_flip_bit(ba, (size_t)i - 1);
-    lua_pushvalue(L, 1);
-    return 1;
+        err = bitarray_header_read(h, &hd);
+    if (err == NULL && hd.codec != BITARRAY_CODEC_RAW)
+        err = "compressed arrays can only be loaded from strings";
+    if (err == NULL) {
+        if (_l_new(L, (size_t)hd.nbits) == 0)
+            return 0;
+        Bitarray *ba = (Bitarray *)lua_touserdata(L, -1);
+        err = bitarray_read_payload(ba, f, h, &hd);
+        if (err == NULL)
+            return 1;
+    }
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
 }
 
 /**
- * <i>May mutate the array. </i> <br />
- * Resize the array to length n. if new size is greater, the new bits
- * are appended to the right and initialized to 0, otherwise additional
- * rightmost bits are lost.
- * @function resize
- * @tparam integer n >= 1
- * @treturn Bitarray|nil the original bit array reference if successful,
- * otherwise nil
+ * Opens an array shared by share, in this or any other Lua state of the
+ * process. Both arrays use the same bits. The handle stays valid while any
+ * array using them is alive.
+ * @function attach
+ * @tparam integer handle returned by share
+ * @treturn Bitarray|nil an array using the shared bits, or nil and an error
+ * message if the handle is unknown
+ * @see share
+ * @usage
+ * -- in the thread running the state that made the array
+ * local handle = seen:share()
+ * -- in another thread, with its own state
+ * local seen = Bitarray.attach(handle)
+ * if not seen:test_and_set(id) then process(id) end
  */
-BITARRAY_API static int resize(lua_State *L)
+BITARRAY_API static int l_attach(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    lua_Integer i = luaL_checkinteger(L, 2);
-    luaL_argcheck(L, 0 < i, 2, "invalid length");
+    lua_Integer id = luaL_checkinteger(L, 1);
 
-    if (bitarray_resize(ba, (size_t)i) == 0)
-        /* resize failed */
-        return 0;
-    lua_pushvalue(L, 1);
+    Bitarray *ba = (Bitarray *)lua_newuserdata(L, sizeof(Bitarray));
+    if (id <= 0 || !bitarray_attach(ba, (uint64_t)id)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no shared array with this handle");
+        return 2;
+    }
+    luaL_getmetatable(L, BITARRAY_MT_1);
+    lua_setmetatable(L, -2);
     return 1;
 }
 
 /**
- * <i>Mutates the array.</i> <br />
- * Reverse the contents of the array.
- * @function reverse
- * @treturn Bitarray the original bit array reference
+ * Creates a new sparse bit array of n bits, all initialized to 0. Only the
+ * 1 bits take memory: the array is cut into chunks of 65536 bits, chunks
+ * without any 1 bit are not stored and every other one is kept as a sorted
+ * list of its 1 bits, a plain bitmap or a list of ranges, whichever is the
+ * smallest.
+ * @see Sparse
+ * @function sparse
+ * @tparam integer nbits number of bits of the array
+ * @treturn Sparse
+ * @usage
+ * local ids = Bitarray.sparse(2^32)  -- takes no memory yet
+ * ids[4000000000] = true
  */
-BITARRAY_API static int reverse(lua_State *L)
+BITARRAY_API static int l_sparse(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    bitarray_reverse(ba);
+    lua_Integer nbits = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, validsize(nbits), 1, "invalid size");
+
+    _l_newsparse(L, (size_t)nbits);
     return 1;
 }
 
 /**
- * <i>Does not mutate the array.</i> <br />
- * Creates a new array with bits obtained from those at index i to n in the
- * original array, inclusive. Resultant length is n - i + 1.
- * @function slice
- * @tparam[opt] integer i the starting index, default 1
- * @tparam[optchain] integer n the ending index, default the length of the array.
- * @treturn Bitarray|nil the newly created bit array reference if successful
+ * Creates an empty Bloom filter of at least m bits using k hash functions.
+ * m is rounded up to a multiple of 512: every key sets or tests its k bits
+ * inside a single 512 bit block, so an add or a lookup touches one cache
+ * line. For n keys and a false positive rate p, m = -n * ln(p) / ln(2)^2
+ * and k = m / n * ln(2) are the usual choices; blocking costs a little
+ * accuracy, which a few percent more bits win back.
+ * @see Bloom
+ * @function bloom
+ * @tparam integer m number of bits of the filter
+ * @tparam integer k number of hash functions, from 1 to 64
+ * @treturn Bloom|nil the newly created filter if successful
  * @usage
- * local a = Bitarray.new(8):set(3, true):set(5, true)
- * local b = a:slice(1, 4)
- * print(a) -- Bitarray[0,0,1,0,1,0,0,0]
- * print(b) -- Bitarray[0,0,1,0]
+ * local seen = Bitarray.bloom(10 * 2^20, 7)  -- about 1M keys at 1%
+ * seen:add('alice'):add(42)
+ * print(seen:contains('alice'), seen:contains('bob'))  -- true false
  */
-BITARRAY_API static int slice(lua_State *L)
+BITARRAY_API static int l_bloom(lua_State *L)
 {
-    size_t from, to;
-    Bitarray *ba = checkbitarray_and_optrange(L, &from, &to);
+    lua_Integer m = luaL_checkinteger(L, 1);
+    lua_Integer k = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, validsize(m) && (uint64_t)m <= SIZE_MAX - BITARRAY_BLOOM_BLOCK_BITS,
+        1, "invalid size");
+    luaL_argcheck(L, k >= 1 && k <= BITARRAY_BLOOM_MAX_K, 2, "out of range");
 
-    if (_l_new(L, to - from) == 0)
+    if (_l_newbloom(L, (size_t)m, (size_t)k) == NULL)
         return 0;
-    bitarray_copyvalues2(ba, (Bitarray *)lua_touserdata(L, -1), from, to, 0);
     return 1;
 }
 
 /**
- * <i>Does not mutate the array.</i> <br />
- * Repeat the array n times and return the new array. <br />
- * @function rep
- * @tparam integer n >= 1
- * @treturn Bitarray|nil the newly created bit array reference if successful
- * @usage
- * local a = Bitarray.new(3):set(3, true)
- * print(a:rep(4))  -- Bitarray[0,0,1,0,0,1,0,0,1,0,0,1]
+ * Store the bitwise NOT of a into dst. Both arrays have to be of same size
+ * and they may be the same array. Nothing is allocated.
+ * @function bnot_into
+ * @tparam Bitarray dst
+ * @tparam Bitarray a
+ * @treturn Bitarray dst
  */
-BITARRAY_API static int rep(lua_State *L)
+BITARRAY_API static int bnot_into(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    lua_Integer n = luaL_checkinteger(L, 2);
-    luaL_argcheck(L, n > 0, 2, "number of repetition must be positive integer");
+    Bitarray *dst = checkbitarray_mut(L, 1);
+    Bitarray *ba = checkbitarray(L, 2);
+    luaL_argcheck(L, dst->size == ba->size, 1,
+        "destination must be of same size");
 
-    if (_l_new(L, ba->size * n) == 0)
-        return 0;
-    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
-    bitarray_copyvalues(ba, r);
-    for (size_t i = 1; i < (size_t)n; ++i)
-        bitarray_copyvalues2(ba, r, 0, ba->size, i * ba->size);
+    bitarray_not(dst, ba);
+    lua_pushvalue(L, 1);
     return 1;
 }
 
-/**
+#define BITARRAY_BIT_BIOP_INTO(NAME, KERNEL) \
+    static int NAME(lua_State *L) \
+    { \
+        Bitarray *dst = checkbitarray_mut(L, 1); \
+        Bitarray *ba = checkbitarray(L, 2); \
+        Bitarray *o = checkbitarray(L, 3); \
+        luaL_argcheck(L, ba->size == o->size, 3, \
+            "two operands must be of same size"); \
+        luaL_argcheck(L, dst->size == ba->size, 1, \
+            "destination must be of same size"); \
+        \
+        KERNEL(dst, ba, o); \
+        lua_pushvalue(L, 1); \
+        return 1; \
+    }
+
+/**
+ * Store the bitwise AND of a and b into dst. All three arrays have to be of
+ * same size, dst may be a or b. Nothing is allocated, so this is the form to
+ * use in loops.
+ * @function band_into
+ * @tparam Bitarray dst
+ * @tparam Bitarray a
+ * @tparam Bitarray b
+ * @treturn Bitarray dst
+ * @usage
+ * local r = Bitarray.new(#a)
+ * for _, b in ipairs(filters) do
+ *     Bitarray.band_into(r, a, b)
+ *     -- use r
+ * end
+ */
+BITARRAY_API BITARRAY_BIT_BIOP_INTO(band_into, bitarray_and)
+
+/**
+ * Store the bitwise OR of a and b into dst.
+ * @see band_into
+ * @function bor_into
+ * @tparam Bitarray dst
+ * @tparam Bitarray a
+ * @tparam Bitarray b
+ * @treturn Bitarray dst
+ */
+BITARRAY_API BITARRAY_BIT_BIOP_INTO(bor_into, bitarray_or)
+
+/**
+ * Store the bitwise XOR of a and b into dst.
+ * @see band_into
+ * @function bxor_into
+ * @tparam Bitarray dst
+ * @tparam Bitarray a
+ * @tparam Bitarray b
+ * @treturn Bitarray dst
+ */
+BITARRAY_API BITARRAY_BIT_BIOP_INTO(bxor_into, bitarray_xor)
+
+/**
+ * Store a AND (NOT b) into dst.
+ * @see band_into
+ * @function bandnot_into
+ * @tparam Bitarray dst
+ * @tparam Bitarray a
+ * @tparam Bitarray b
+ * @treturn Bitarray dst
+ */
+BITARRAY_API BITARRAY_BIT_BIOP_INTO(bandnot_into, bitarray_andnot)
+
+#undef BITARRAY_BIT_BIOP_INTO
+
+/* checks the list of arrays at index i: a non-empty sequence of arrays of
+   the same size. pushes a userdata with room for their words, which
+   listwords fills in, and returns it along with their number in *n and their
+   size in *nbits */
+static const WORD **checklist(lua_State *L, int i, size_t *n, size_t *nbits)
+{
+    luaL_checktype(L, i, LUA_TTABLE);
+    *n = rawlen(L, i);
+    luaL_argcheck(L, *n >= 1, i, "empty list");
+    const WORD **in = (const WORD **)lua_newuserdata(L, *n * sizeof(WORD *));
+    for (size_t k = 0; k < *n; ++k) {
+        lua_rawgeti(L, i, (int)k + 1);
+        Bitarray *ba = (Bitarray *)testudata(L, -1, BITARRAY_MT_1);
+        if (ba == NULL)
+            luaL_error(L, "bad element #%d in list (Bitarray expected)", (int)k + 1);
+        if (k == 0)
+            *nbits = ba->size;
+        else if (ba->size != *nbits)
+            luaL_error(L, "bad element #%d in list (arrays are of different sizes)",
+                (int)k + 1);
+        lua_pop(L, 1);
+    }
+    return in;
+}
+
+/* fills in the words of the n arrays of the list at index i. only done once
+   the destination is writable, which can move the words of the arrays that
+   share them with it */
+static void listwords(lua_State *L, int i, const WORD **in, size_t n)
+{
+    for (size_t k = 0; k < n; ++k) {
+        lua_rawgeti(L, i, (int)k + 1);
+        in[k] = ((Bitarray *)lua_touserdata(L, -1))->values;
+        lua_pop(L, 1);
+    }
+}
+
+/* the array to store a result of nbits bits in: the one at index i, or a
+   new one if there is none. it ends up on the top of the stack */
+static Bitarray *checkdst(lua_State *L, int i, size_t nbits)
+{
+    if (lua_isnoneornil(L, i)) {
+        if (_l_new(L, nbits) == 0)
+            return NULL;
+        return (Bitarray *)lua_touserdata(L, -1);
+    }
+    Bitarray *d = checkbitarray_mut(L, i);
+    luaL_argcheck(L, d->size == nbits, i, "destination must be of same size");
+    lua_pushvalue(L, i);
+    return d;
+}
+
+static int reduce_all(lua_State *L, int op)
+{
+    size_t n, nbits;
+    lua_settop(L, 2);
+    const WORD **in = checklist(L, 1, &n, &nbits);
+    Bitarray *d = checkdst(L, 2, nbits);
+    if (d == NULL)
+        return 0;
+    listwords(L, 1, in, n);
+    if (!bitarray_reduce(in, n, WORDS_FOR_BITS(nbits), d->values, op, 0))
+        return 0;
+    return 1;
+}
+
+/**
+ * Computes the bitwise AND of all arrays of a list in a single pass. Every
+ * array is read once, block by block, and the result written once, without
+ * any intermediate array.
+ * @function and_all
+ * @tparam {Bitarray,...} list arrays of the same size, at least one
+ * @tparam[opt] Bitarray dst array to store the result in, may be one of the
+ * list, a new one if not given
+ * @treturn Bitarray|nil dst or the newly created array if successful
+ * @usage
+ * local common = Bitarray.and_all({ a, b, c, d })
+ */
+BITARRAY_API static int l_and_all(lua_State *L)
+{
+    return reduce_all(L, BITARRAY_REDUCE_AND);
+}
+
+/**
+ * Computes the bitwise OR of all arrays of a list in a single pass.
+ * @see and_all
+ * @function or_all
+ * @tparam {Bitarray,...} list
+ * @tparam[opt] Bitarray dst
+ * @treturn Bitarray|nil
+ */
+BITARRAY_API static int l_or_all(lua_State *L)
+{
+    return reduce_all(L, BITARRAY_REDUCE_OR);
+}
+
+/**
+ * Computes the bitwise XOR of all arrays of a list in a single pass.
+ * @see and_all
+ * @function xor_all
+ * @tparam {Bitarray,...} list
+ * @tparam[opt] Bitarray dst
+ * @treturn Bitarray|nil
+ */
+BITARRAY_API static int l_xor_all(lua_State *L)
+{
+    return reduce_all(L, BITARRAY_REDUCE_XOR);
+}
+
+/**
+ * Sets every bit that is set in at least k arrays of a list. The counts are
+ * kept bit-sliced with carry save adders, every array is read once and the
+ * result written once. k = 1 gives or_all and k = #list and_all.
+ * @function at_least
+ * @tparam {Bitarray,...} list arrays of the same size, at least one
+ * @tparam integer k all bits are set if it is 0 or less, none if it is more
+ * than #list
+ * @tparam[opt] Bitarray dst array to store the result in, may be one of the
+ * list, a new one if not given
+ * @treturn Bitarray|nil dst or the newly created array if successful
+ * @usage
+ * -- documents tagged with at least 3 of the wanted tags
+ * local matches = Bitarray.at_least({ tag1, tag2, tag3, tag4, tag5 }, 3)
+ */
+BITARRAY_API static int l_at_least(lua_State *L)
+{
+    size_t n, nbits;
+    lua_settop(L, 3);
+    const WORD **in = checklist(L, 1, &n, &nbits);
+    lua_Integer k = luaL_checkinteger(L, 2);
+    Bitarray *d = checkdst(L, 3, nbits);
+    if (d == NULL)
+        return 0;
+    if (k <= 0 || (uint64_t)k > n) {
+        bitarray_fill(d, k <= 0);
+        return 1;
+    }
+    listwords(L, 1, in, n);
+    if (!bitarray_reduce(in, n, WORDS_FOR_BITS(nbits), d->values,
+        BITARRAY_REDUCE_AT_LEAST, (size_t)k))
+        return 0;
+    return 1;
+}
+
+/**
+ * Sets the number of threads the bulk operations (fill, flip, the bitwise
+ * operators and their _into and in place forms, count, equality and copies)
+ * may run on. Operations over arrays smaller than the parallel threshold
+ * always run on the calling thread alone. The pool is shared by every Lua
+ * state of the process, a state finding it busy runs on its own thread.
+ * Threads are not available on every platform, the pool keeps 1 thread there.
+ * @function set_threads
+ * @tparam integer n number of threads including the calling one, 1 (the
+ * default) to turn the pool off, 0 for one per online cpu
+ * @treturn integer the number of threads the pool has now
+ * @see set_parallel_threshold
+ * @usage
+ * Bitarray.set_threads(0)
+ * local a = Bitarray.new(2^35):fill(true) -- 4 GiB, filled by all cpus
+ */
+BITARRAY_API static int l_set_threads(lua_State *L)
+{
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 0, 1, "invalid number of threads");
+    lua_pushinteger(L, (lua_Integer)bitarray_pool_resize(
+        n > BITARRAY_MAX_THREADS ? BITARRAY_MAX_THREADS : (size_t)n));
+    return 1;
+}
+
+/**
+ * Sets the size from which bulk operations are split over the threads set
+ * by set_threads. Below it waking up the threads costs more than it saves.
+ * @function set_parallel_threshold
+ * @tparam integer bytes size of the arrays involved, default 4 MiB
+ * @treturn integer the previous threshold
+ * @see set_threads
+ */
+BITARRAY_API static int l_set_parallel_threshold(lua_State *L)
+{
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n >= 0, 1, "invalid threshold");
+    lua_pushinteger(L, (lua_Integer)bitarray_pool_swap(threshold,
+        (uint64_t)n > SIZE_MAX ? SIZE_MAX : (size_t)n));
+    return 1;
+}
+
+/**
+ * Returns storage statistics of all arrays and Bloom filters of the process,
+ * in every Lua state. The words of arrays created by the library are part of
+ * their userdata and count towards the memory the collector sees; resize and
+ * share move them to memory of their own. Bytes are those of storage words
+ * on the heap: words copyfrom moved to a file, and the pages arrays wrote
+ * of them, are not counted, and words shared by several arrays are counted
+ * once.
+ * @function memstats
+ * @treturn table with fields arrays (live arrays), bytes (live bytes), peak
+ * (most bytes live at once) and allocations (storage allocations so far)
+ * @usage
+ * local a = Bitarray.new(2^20)
+ * print(Bitarray.memstats().bytes) -- 131072 or more
+ */
+BITARRAY_API static int l_memstats(lua_State *L)
+{
+    bitarray_stats_lock();
+    size_t arrays = bitarray_stats.arrays, bytes = bitarray_stats.bytes;
+    size_t peak = bitarray_stats.peak, allocations = bitarray_stats.allocations;
+    bitarray_stats_unlock();
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, (lua_Integer)arrays);
+    lua_setfield(L, -2, "arrays");
+    lua_pushinteger(L, (lua_Integer)bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)peak);
+    lua_setfield(L, -2, "peak");
+    lua_pushinteger(L, (lua_Integer)allocations);
+    lua_setfield(L, -2, "allocations");
+    return 1;
+}
+
+/* finalizer of the registry entry marking that a state uses the pool */
+static int pool_release(lua_State *L)
+{
+    (void)L;
+    bitarray_pool_use(-1);
+    return 0;
+}
+
+/**
+ * @type Bitarray
+ */
+
+static Bitarray *checkbitarray_and_index(lua_State *L, size_t *i)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer i_ = luaL_checkinteger(L, 2) - 1;
+    luaL_argcheck(L, 0 <= i_ && (uint64_t)i_ < ba->size, 2, "index out of range");
+    *i = (size_t)i_;
+    return ba;
+}
+
+/* default opt chain: [,1 [,array size]] */
+static Bitarray *checkbitarray_and_optrange(lua_State *L, size_t *from, size_t *to)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer from_ = luaL_optinteger(L, 2, 1) - 1;
+    luaL_argcheck(L, 0 <= from_ && (uint64_t)from_ < ba->size, 2, "invalid index");
+    lua_Integer to_ = luaL_optinteger(L, 3, ba->size);
+    luaL_argcheck(L, to_ > from_ && (uint64_t)to_ <= ba->size, 3, "invalid index");
+    *from = (size_t)from_;
+    *to = (size_t)to_;
+    return ba;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Set the ith bit of the array. Any value other than false or nil will be
+ * considered a truthy(1) bit. <br />
+ * Operator __newindex is overloaded with this method.
+ * @function set
+ * @tparam integer i the index
+ * @tparam any b the value to change to
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(10)
+ * a:set(4, true)
+ * a[4] = true -- same
+ */
+BITARRAY_API static int setbit(lua_State *L)
+{
+    size_t i;
+    Bitarray *ba = writable(L, checkbitarray_and_index(L, &i));
+    luaL_checkany(L, 3);
+
+    bitarray_set_bit(ba, i, lua_toboolean(L, 3));
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
  * <i>Does not mutate the array.</i> <br />
- * Compares whether two arrays are identical (same value and length). <br />
- * Operator __eq is overloaded with this method.
- * @function equal
- * @tparam Bitarray other
- * @treturn boolean
+ * Get the ith bit of the array. <br />
+ * Operator __index is overloaded with this method.
+ * @function at
+ * @tparam integer i the index
+ * @treturn boolean true if bit is 1, false if 0
  * @usage
  * local a = Bitarray.new(10)
- * local b = Bitarray.copyfrom(a)
- * a:equal(b)          -- true
- * a == b:resize(1)    -- false
+ * a:at(7) -- false
+ * a[7]    -- false
  */
-BITARRAY_API static int equal(lua_State *L)
+BITARRAY_API static int getbit(lua_State *L)
+{
+    size_t i;
+    Bitarray *ba = checkbitarray_and_index(L, &i);
+
+    lua_pushboolean(L, bitarray_get_bit(ba, i));
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Get the length of the array. <br />
+ * Operator __len is overloaded with this method.
+ * @function len
+ * @treturn integer the number of bits of the array
+ * @usage
+ * local a = Bitarray.new(10)
+ * a:len(a) -- 10
+ * #a       -- 10
+ */
+BITARRAY_API static int len(lua_State *L)
 {
     Bitarray *ba = checkbitarray(L, 1);
-    Bitarray *o = checkbitarray(L, 2);
+    lua_pushinteger(L, ba->size);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Count the bits set to 1 from index i to n, inclusive.
+ * @function count
+ * @tparam[opt] integer i the starting index, default 1
+ * @tparam[optchain] integer n the ending index, default the length of the array.
+ * @treturn integer
+ * @usage
+ * local a = Bitarray.new(8):from_uint8(0x2D)
+ * a:count()      -- 4
+ * a:count(1, 4)  -- 1
+ */
+BITARRAY_API static int count(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = checkbitarray_and_optrange(L, &from, &to);
+
+    lua_pushinteger(L, (lua_Integer)bitarray_count(ba, from, to));
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Count the bits set to 1 from index 1 to i, inclusive. The first call
+ * builds a small directory (about 1.5% of the array size) so later calls
+ * take constant time, any mutation discards it. Use count(1, i) for a one-off
+ * query.
+ * @function rank
+ * @tparam integer i 0 to the length of the array
+ * @treturn integer
+ * @usage
+ * local a = Bitarray.new(8):from_uint8(0x2D)
+ * a:rank(5)  -- 2
+ */
+BITARRAY_API static int rank(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 0 <= i && (uint64_t)i <= ba->size, 2, "index out of range");
+
+    lua_pushinteger(L, (lua_Integer)bitarray_rank(ba, (size_t)i));
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Find the index of the kth bit that is set to 1. Shares the directory with
+ * rank.
+ * @see rank
+ * @function select
+ * @tparam integer k >= 1
+ * @treturn integer|nil the index, or nil if fewer than k bits are set
+ * @usage
+ * local a = Bitarray.new(8):from_uint8(0x2D)
+ * a:select(2)  -- 5
+ * a:select(5)  -- nil
+ */
+BITARRAY_API static int selectbit(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer k = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, k > 0, 2, "k must be positive");
+
+    size_t i;
+    if ((uint64_t)k > ba->size || !bitarray_select(ba, (size_t)k, &i))
+        return 0;
+    lua_pushinteger(L, (lua_Integer)i + 1);
+    return 1;
+}
+
+/* optional bit value to search for at nArg, default 1 */
+static int checkopt_bitvalue(lua_State *L, int nArg)
+{
+    return lua_isnoneornil(L, nArg) ? 1 : lua_toboolean(L, nArg);
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Find the first index whose bit is b. Words that cannot match are skipped
+ * as a whole.
+ * @function find_first
+ * @tparam[opt] boolean b the value to look for, default true
+ * @treturn integer|nil the index, or nil if there is none
+ * @usage
+ * local a = Bitarray.new(100):set(42, true)
+ * a:find_first()       -- 42
+ * a:find_first(false)  -- 1
+ */
+BITARRAY_API static int find_first(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    int b = checkopt_bitvalue(L, 2);
+
+    size_t i;
+    if (!bitarray_find_next(ba, 0, b, &i))
+        return 0;
+    lua_pushinteger(L, (lua_Integer)i + 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Find the first index after i whose bit is b.
+ * @function find_next
+ * @tparam integer i 0 to the length of the array, 0 searches from the start
+ * @tparam[opt] boolean b the value to look for, default true
+ * @treturn integer|nil the index, or nil if there is none
+ * @usage
+ * local a = Bitarray.new(100):set(3, true):set(50, true)
+ * a:find_next(3)  -- 50
+ */
+BITARRAY_API static int find_next(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 0 <= i && (uint64_t)i <= ba->size, 2, "index out of range");
+    int b = checkopt_bitvalue(L, 3);
+
+    size_t found;
+    if (!bitarray_find_next(ba, (size_t)i, b, &found))
+        return 0;
+    lua_pushinteger(L, (lua_Integer)found + 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Find the last index before i whose bit is b.
+ * @function find_prev
+ * @tparam integer i 1 to the length of the array + 1, which searches from the
+ * end
+ * @tparam[opt] boolean b the value to look for, default true
+ * @treturn integer|nil the index, or nil if there is none
+ * @usage
+ * local a = Bitarray.new(100):set(3, true):set(50, true)
+ * a:find_prev(50)   -- 3
+ * a:find_prev(101)  -- 50
+ */
+BITARRAY_API static int find_prev(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 1 <= i && (uint64_t)i <= ba->size + 1, 2, "index out of range");
+    int b = checkopt_bitvalue(L, 3);
+
+    size_t found;
+    if (!bitarray_find_prev(ba, (size_t)i - 1, b, &found))
+        return 0;
+    lua_pushinteger(L, (lua_Integer)found + 1);
+    return 1;
+}
+
+/* iterator function for ones(), (array, last index) -> next index */
+static int ones_next(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+
+    size_t found;
+    if (i < 0 || !bitarray_find_next(ba, (size_t)i, 1, &found))
+        return 0;
+    lua_pushinteger(L, (lua_Integer)found + 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Returns an iterator over the indices whose bit is 1, for use in a generic
+ * for. The array should not be resized while iterating.
+ * @function ones
+ * @return iterator
+ * @usage
+ * local a = Bitarray.new(100):set(3, true):set(50, true)
+ * for i in a:ones() do print(i) end  -- 3 50
+ */
+BITARRAY_API static int ones(lua_State *L)
+{
+    checkbitarray(L, 1);
+    lua_pushcfunction(L, ones_next);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Set all bits of the array. Any value other than false or nil will be
+ * considered a truthy(1) bit. <br />
+ * @function fill
+ * @tparam any b the value to change to
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(10)
+ * a:fill(true)  -- all bits set to 1
+ */
+BITARRAY_API static int fill(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    luaL_checkany(L, 2);
+
+    bitarray_fill(ba, lua_toboolean(L, 2));
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * If argument i is present, the bit at that index is flipped, if not or
+ * i is 0, all the bits are flipped.
+ * @function flip
+ * @tparam[opt] integer i the index
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(10)
+ * a:flip()    -- all bits set to true
+ * a:flip(1)   -- sets first bit to true
+ */
+BITARRAY_API static int flip(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    lua_Integer i = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, 0 <= i && (uint64_t)i <= ba->size, 2, "index out of range");
+    if (i == 0)
+        bitarray_flip(ba);
+    else
+        bitarray_flip_bit(ba, (size_t)i - 1);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/* 1-based inclusive range i, j of the arguments 2 and 3, turned into
+   [from, to) */
+static Bitarray *checkbitarray_and_range(lua_State *L, size_t *from, size_t *to)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer from_ = luaL_checkinteger(L, 2) - 1;
+    luaL_argcheck(L, 0 <= from_ && (uint64_t)from_ < ba->size, 2, "invalid index");
+    lua_Integer to_ = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, to_ > from_ && (uint64_t)to_ <= ba->size, 3, "invalid index");
+    *from = (size_t)from_;
+    *to = (size_t)to_;
+    return ba;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Set the bits from index i to j, inclusive. Any value other than false or
+ * nil will be considered a truthy(1) bit. Only the words at both ends of the
+ * range are masked, so this is much faster than setting the bits one by one.
+ * @function fill_range
+ * @tparam integer i the starting index
+ * @tparam integer j the ending index, >= i
+ * @tparam any b the value to change to
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(10)
+ * a:fill_range(3, 6, true)  -- 0011110000
+ */
+BITARRAY_API static int fill_range(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = writable(L, checkbitarray_and_range(L, &from, &to));
+    luaL_checkany(L, 4);
+
+    bitarray_fill_range(ba, from, to, lua_toboolean(L, 4));
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Flip the bits from index i to j, inclusive.
+ * @function flip_range
+ * @tparam integer i the starting index
+ * @tparam integer j the ending index, >= i
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(10)
+ * a:flip_range(1, 5)  -- 1111100000
+ */
+BITARRAY_API static int flip_range(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = writable(L, checkbitarray_and_range(L, &from, &to));
+
+    bitarray_flip_range(ba, from, to);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Count the bits set to 1 from index i to j, inclusive. Same as count(i, j)
+ * but both indices are required.
+ * @function count_range
+ * @tparam integer i the starting index
+ * @tparam integer j the ending index, >= i
+ * @treturn integer
+ * @see count
+ * @usage
+ * local a = Bitarray.new(8):from_uint8(0x2D)
+ * a:count_range(5, 8)  -- 3
+ */
+BITARRAY_API static int count_range(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = checkbitarray_and_range(L, &from, &to);
+
+    lua_pushinteger(L, (lua_Integer)bitarray_count(ba, from, to));
+    return 1;
+}
+
+/* element k of the sequence at index t as a 0-based index into ba */
+static size_t checkelement_index(lua_State *L, int t, size_t k, Bitarray *ba)
+{
+    lua_rawgeti(L, t, (int)k);
+    if (lua_type(L, -1) != LUA_TNUMBER)
+        luaL_error(L, "bad element #%d in table (number expected, got %s)",
+            (int)k, luaL_typename(L, -1));
+    lua_Integer i = lua_tointeger(L, -1) - 1;
+    if (i < 0 || (uint64_t)i >= ba->size)
+        luaL_error(L, "bad element #%d in table (index out of range)", (int)k);
+    lua_pop(L, 1);
+    return (size_t)i;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Set the bits at all the indices in the sequence tbl, in one call. Any value
+ * other than false or nil will be considered a truthy(1) bit. The array is
+ * checked once for the whole batch instead of once per index. If an index is
+ * out of range an error is raised and the bits before it are already set.
+ * @function set_many
+ * @tparam {integer,...} tbl the indices
+ * @tparam[opt] any b the value to change to, default true
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(10)
+ * a:set_many({ 1, 4, 9 })      -- 1001000010
+ * a:set_many({ 4, 9 }, false)  -- 1000000000
+ */
+BITARRAY_API static int set_many(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int b = lua_isnoneornil(L, 3) ? 1 : lua_toboolean(L, 3);
+    size_t n = rawlen(L, 2);
+
+    for (size_t k = 1; k <= n; ++k) {
+        size_t i = checkelement_index(L, 2, k, ba);
+        bitarray_set_bit(ba, i, b);
+    }
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Get the bits at all the indices in the sequence tbl, in one call.
+ * @function get_many
+ * @tparam {integer,...} tbl the indices
+ * @treturn {boolean,...} the bits, in the order of tbl
+ * @usage
+ * local a = Bitarray.new(10):set_many({ 2, 3 })
+ * a:get_many({ 1, 2, 3 })  -- { false, true, true }
+ */
+BITARRAY_API static int get_many(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    size_t n = rawlen(L, 2);
+
+    lua_createtable(L, n <= INT_MAX ? (int)n : 0, 0);
+    for (size_t k = 1; k <= n; ++k) {
+        size_t i = checkelement_index(L, 2, k, ba);
+        lua_pushboolean(L, bitarray_get_bit(ba, i));
+        lua_rawseti(L, -2, (int)k);
+    }
+    return 1;
+}
+
+/**
+ * <i>May mutate the array. </i> <br />
+ * Resize the array to length n. if new size is greater, the new bits
+ * are appended to the right and initialized to 0, otherwise additional
+ * rightmost bits are lost.
+ * @function resize
+ * @tparam integer n >= 1
+ * @treturn Bitarray|nil the original bit array reference if successful,
+ * otherwise nil
+ */
+BITARRAY_API static int resize(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, validsize(i), 2, "invalid length");
+    luaL_argcheck(L, ba->maplen == 0, 1, "cannot resize a mapped array");
+    luaL_argcheck(L, ba->shared == NULL, 1, "cannot resize a shared array");
+
+    if (bitarray_resize(ba, (size_t)i) == 0)
+        /* resize failed */
+        return 0;
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Writes the changes made to an array created by mmap in "shared" mode back
+ * to its file and waits for that to finish. Does nothing for other arrays.
+ * @function sync
+ * @treturn Bitarray|nil the original bit array reference, or nil and an
+ * error message
+ */
+BITARRAY_API static int syncmap(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+#ifdef BITARRAY_HAVE_MMAP
+    if (!bitarray_sync(ba)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+#endif
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Moves the bits of the array to storage that can be shared with other Lua
+ * states through Bitarray.attach, possibly running on other threads. Every
+ * method keeps working, but only test_and_set, test_and_clear,
+ * fetch_or_word and count_relaxed are safe while another thread writes to
+ * the array. Shared arrays cannot be resized, and rank and select rebuild
+ * their directory on every call. Mapped arrays cannot be shared.
+ * @function share
+ * @treturn integer a handle for Bitarray.attach, the same on every call
+ * @see attach
+ */
+BITARRAY_API static int share(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    luaL_argcheck(L, ba->maplen == 0, 1, "cannot share a mapped array");
+
+    uint64_t id = bitarray_share(ba);
+    if (id == 0)
+        return luaL_error(L, "not enough memory");
+    lua_pushinteger(L, (lua_Integer)id);
+    return 1;
+}
+
+#ifdef BITARRAY_HAVE_ATOMICS
+    #define checkatomics(L) ((void)0)
+#else
+    #define checkatomics(L) \
+        luaL_error(L, "atomic operations are not supported by this build")
+#endif
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Atomically sets the ith bit to 1 and returns its previous value. Safe
+ * while other threads write to a shared array.
+ * @function test_and_set
+ * @tparam integer i the index
+ * @treturn boolean whether the bit was already 1
+ * @see share
+ */
+BITARRAY_API static int test_and_set(lua_State *L)
+{
+    size_t i;
+    Bitarray *ba = writable(L, checkbitarray_and_index(L, &i));
+    checkatomics(L);
+
+#ifdef BITARRAY_HAVE_ATOMICS
+    lua_pushboolean(L, bitarray_test_and_set(ba, i));
+#else
+    (void)ba;
+#endif
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Atomically sets the ith bit to 0 and returns its previous value.
+ * @function test_and_clear
+ * @tparam integer i the index
+ * @treturn boolean whether the bit was 1
+ * @see test_and_set
+ */
+BITARRAY_API static int test_and_clear(lua_State *L)
+{
+    size_t i;
+    Bitarray *ba = writable(L, checkbitarray_and_index(L, &i));
+    checkatomics(L);
+
+#ifdef BITARRAY_HAVE_ATOMICS
+    lua_pushboolean(L, bitarray_test_and_clear(ba, i));
+#else
+    (void)ba;
+#endif
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Atomically ors v into the kth storage word, the bits from index
+ * (k - 1) * w + 1 to k * w where w is 8 * _blocksize, and returns the word as
+ * it was. Like from_uint64, the most significant bit of v goes to the lowest
+ * index. Bits past the end of the array are ignored.
+ * @function fetch_or_word
+ * @tparam integer k the word index, from 1
+ * @tparam integer v
+ * @treturn integer the previous word
+ * @see test_and_set
+ * @usage
+ * local a = Bitarray.new(64)
+ * a:fetch_or_word(1, 0x8000000000000001)  -- 0
+ * a[1], a[64]                              -- true, true
+ */
+BITARRAY_API static int fetch_or_word(lua_State *L)
+{
+    Bitarray *ba = writable(L, checkbitarray(L, 1));
+    lua_Integer k = luaL_checkinteger(L, 2) - 1;
+    luaL_argcheck(L, 0 <= k && (uint64_t)k < WORDS_FOR_BITS(ba->size), 2,
+        "index out of range");
+    uint64_t v = (uint64_t)luaL_checkinteger(L, 3);
+    checkatomics(L);
+
+#ifdef BITARRAY_HAVE_ATOMICS
+    /* bit j of the word is index k * w + j, which v holds in bit w - 1 - j */
+    WORD old = bitarray_fetch_or_word(ba, (size_t)k,
+        (WORD)(bitarray_bitrev64(v) >> (64 - BITS_PER_WORD)));
+    lua_pushinteger(L, (lua_Integer)(bitarray_bitrev64(old) >> (64 - BITS_PER_WORD)));
+#else
+    (void)ba;
+    (void)v;
+#endif
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Same as count, reading every word atomically so it can run while other
+ * threads write to a shared array. The result is not a snapshot, bits
+ * changing during the call may or may not be counted.
+ * @function count_relaxed
+ * @tparam[opt] integer i the starting index, default 1
+ * @tparam[optchain] integer n the ending index, default the length of the array.
+ * @treturn integer
+ * @see count
+ */
+BITARRAY_API static int count_relaxed(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = checkbitarray_and_optrange(L, &from, &to);
+    checkatomics(L);
+
+#ifdef BITARRAY_HAVE_ATOMICS
+    lua_pushinteger(L, (lua_Integer)bitarray_count_relaxed(ba, from, to));
+#else
+    (void)ba;
+#endif
+    return 1;
+}
+
+#undef checkatomics
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Reverse the contents of the array, or only of the bits from index i to j,
+ * inclusive.
+ * @function reverse
+ * @tparam[opt=1] integer i the first index of the range
+ * @tparam[opt=#self] integer j the last index of the range
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(6):from_binarystring('110000')
+ * a:reverse()     -- 000011
+ * a:reverse(4, 6) -- 000110
+ */
+BITARRAY_API static int reverse(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = writable(L, checkbitarray_and_optrange(L, &from, &to));
+    bitarray_reverse_range(ba, from, to);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Creates a new array with bits obtained from those at index i to n in the
+ * original array, inclusive. Resultant length is n - i + 1.
+ * @function slice
+ * @tparam[opt] integer i the starting index, default 1
+ * @tparam[optchain] integer n the ending index, default the length of the array.
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @usage
+ * local a = Bitarray.new(8):set(3, true):set(5, true)
+ * local b = a:slice(1, 4)
+ * print(a) -- Bitarray[0,0,1,0,1,0,0,0]
+ * print(b) -- Bitarray[0,0,1,0]
+ */
+BITARRAY_API static int slice(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = checkbitarray_and_optrange(L, &from, &to);
+
+    if (_l_new(L, to - from) == 0)
+        return 0;
+    bitarray_copyvalues2(ba, (Bitarray *)lua_touserdata(L, -1), from, to, 0);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Same as slice, but the new array reads the bits of the original one instead
+ * of copying them, as long as neither of them is modified: the first to be
+ * gets a copy of its own. This needs i - 1 to be a multiple of the word size,
+ * 64 bits (32 in builds with 32-bit words), and n to be one too or the length
+ * of the array; other ranges, and mapped or shared arrays, are copied like
+ * slice does. The first view of an array moves its bits out of the userdata.
+ * @function view
+ * @tparam[opt] integer i the starting index, default 1
+ * @tparam[optchain] integer n the ending index, default the length of the array.
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @see slice
+ * @usage
+ * local a = Bitarray.new(1024)
+ * local shard = a:view(257, 512)  -- bits 257 to 512 of a, not copied
+ * shard[1] = true                 -- shard gets a copy, a is unchanged
+ */
+BITARRAY_API static int view(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = checkbitarray_and_optrange(L, &from, &to);
+    if (from % BITS_PER_WORD != 0 || (to % BITS_PER_WORD != 0 && to != ba->size)
+        || ba->maplen != 0 || ba->shared != NULL)
+        return slice(L);
+
+    return _l_view(L, ba, I_WORD(from), to - from, 0);
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Copy bits from index i to n, inclusive, to the position starting at index t
+ * inside the same array. The source and the destination may overlap. The
+ * array needs to be big enough to hold the data.
+ * @function move
+ * @tparam integer i the starting index
+ * @tparam integer n the ending index
+ * @tparam integer t the index where the first bit gets copied to
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(8):from_binarystring('11010000')
+ * a:move(1, 4, 3)
+ * print(a) -- Bitarray[1,1,1,1,0,1,0,0]
+ */
+BITARRAY_API static int move(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = writable(L, checkbitarray_and_optrange(L, &from, &to));
+    lua_Integer t = luaL_checkinteger(L, 4) - 1;
+    luaL_argcheck(L, 0 <= t && (uint64_t)t + (to - from) <= ba->size, 4,
+        "not enough space");
+
+    bitarray_copyvalues2(ba, ba, from, to, (size_t)t);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Repeat the array n times and return the new array. <br />
+ * @function rep
+ * @tparam integer n >= 1
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @usage
+ * local a = Bitarray.new(3):set(3, true)
+ * print(a:rep(4))  -- Bitarray[0,0,1,0,0,1,0,0,1,0,0,1]
+ */
+BITARRAY_API static int rep(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n > 0, 2, "number of repetition must be positive integer");
+    luaL_argcheck(L, (uint64_t)n <= SIZE_MAX / ba->size, 2, "resulting array too big");
+
+    if (_l_new(L, ba->size * n) == 0)
+        return 0;
+    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
+    bitarray_copyvalues(ba, r);
+    /* double the filled prefix each round */
+    for (size_t done = 1; done < (size_t)n; ) {
+        size_t k = done <= (size_t)n - done ? done : (size_t)n - done;
+        bitarray_copyvalues2(r, r, 0, k * ba->size, done * ba->size);
+        done += k;
+    }
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Compares whether two arrays are identical (same value and length). <br />
+ * Operator __eq is overloaded with this method.
+ * @function equal
+ * @tparam Bitarray other
+ * @treturn boolean
+ * @usage
+ * local a = Bitarray.new(10)
+ * local b = Bitarray.copyfrom(a)
+ * a:equal(b)          -- true
+ * a == b:resize(1)    -- false
+ */
+BITARRAY_API static int equal(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    Bitarray *o = checkbitarray(L, 2);
+
+    lua_pushboolean(L, bitarray_equal(ba, o));
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Concatenate two arrays and return the new array. <br />
+ * Operator __concat is overloaded with this method.
+ * @function concat
+ * @tparam Bitarray other
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @usage
+ * local a = Bitarray.new(1)
+ * local b = Bitarray.new(4):fill(true)
+ * print(a..b)  -- Bitarray[0,1,1,1,1]
+ */
+BITARRAY_API static int concat(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    Bitarray *o = checkbitarray(L, 2);
+
+    luaL_argcheck(L, o->size <= SIZE_MAX - ba->size, 2, "resulting array too big");
+    if (_l_new(L, ba->size + o->size) == 0)
+        return 0;
+    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
+    bitarray_copyvalues(ba, r);
+    bitarray_copyvalues2(o, r, 0, o->size, ba->size);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Flip all bits of the array and return the new array. <br />
+ * Operator __bnot is overloaded with this method. (5.3+)
+ * @function bnot
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @usage
+ * local a = Bitarray.new(2):set(1, true)
+ * print(~a)  -- Bitarray[0,1]
+ */
+BITARRAY_API static int bnot(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+
+    if (_l_new(L, ba->size) == 0)
+        return 0;
+    bitarray_not((Bitarray *)lua_touserdata(L, -1), ba);
+    return 1;
+}
+
+#define BITARRAY_BIT_BIOP(NAME, KERNEL) \
+    static int NAME(lua_State *L) \
+    { \
+        Bitarray *ba = checkbitarray(L, 1); \
+        Bitarray *o = checkbitarray(L, 2); \
+        luaL_argcheck(L, ba->size == o->size, 2, \
+            "two operands must be of same size"); \
+        \
+        if (_l_new(L, ba->size) == 0) \
+            return 0; \
+        KERNEL((Bitarray *)lua_touserdata(L, -1), ba, o); \
+        return 1; \
+    }
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Perform a bitwise AND and return the new array. Two arrays have to be of
+ * same size. <br />
+ * Operator __band is overloaded with this method. (5.3+)
+ * @function band
+ * @tparam Bitarray other
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @usage
+ * local a = Bitarray.new(4):set(1, true):set(3, true)
+ * local b = Bitarray.new(4):set(1, true)
+ * print(a & b)  -- Bitarray[1,0,0,0]
+ */
+BITARRAY_API BITARRAY_BIT_BIOP(band, bitarray_and)
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Perform a bitwise OR and return the new array. Two arrays have to be of
+ * same size. <br />
+ * Operator __bor is overloaded with this method. (5.3+)
+ * @see band
+ * @function bor
+ * @tparam Bitarray other
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ */
+BITARRAY_API BITARRAY_BIT_BIOP(bor, bitarray_or)
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Perform a bitwise XOR and return the new array. Two arrays have to be of
+ * same size. <br />
+ * Operator __bxor is overloaded with this method. (5.3+)
+ * @see band
+ * @function bxor
+ * @tparam Bitarray other
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ */
+BITARRAY_API BITARRAY_BIT_BIOP(bxor, bitarray_xor)
+
+#undef BITARRAY_BIT_BIOP
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Flip all bits of the array in place. Same as flip() without argument.
+ * @see bnot
+ * @function inot
+ * @treturn Bitarray the original bit array reference
+ */
+BITARRAY_API static int inot(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+
+    bitarray_not(ba, ba);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+#define BITARRAY_BIT_IBIOP(NAME, KERNEL) \
+    static int NAME(lua_State *L) \
+    { \
+        Bitarray *ba = checkbitarray_mut(L, 1); \
+        Bitarray *o = checkbitarray(L, 2); \
+        luaL_argcheck(L, ba->size == o->size, 2, \
+            "two operands must be of same size"); \
+        \
+        KERNEL(ba, ba, o); \
+        lua_pushvalue(L, 1); \
+        return 1; \
+    }
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Perform a bitwise AND with other and store the result in the array. Two
+ * arrays have to be of same size. Nothing is allocated.
+ * @see band
+ * @function iand
+ * @tparam Bitarray other
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(4):set(1, true):set(3, true)
+ * a:iand(Bitarray.new(4):set(1, true))
+ * print(a)  -- Bitarray[1,0,0,0]
+ */
+BITARRAY_API BITARRAY_BIT_IBIOP(iand, bitarray_and)
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Perform a bitwise OR with other and store the result in the array.
+ * @see iand
+ * @function ior
+ * @tparam Bitarray other
+ * @treturn Bitarray the original bit array reference
+ */
+BITARRAY_API BITARRAY_BIT_IBIOP(ior, bitarray_or)
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Perform a bitwise XOR with other and store the result in the array.
+ * @see iand
+ * @function ixor
+ * @tparam Bitarray other
+ * @treturn Bitarray the original bit array reference
+ */
+BITARRAY_API BITARRAY_BIT_IBIOP(ixor, bitarray_xor)
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Clear the bits that are set in other, that is, a = a AND (NOT other).
+ * @see iand
+ * @function iandnot
+ * @tparam Bitarray other
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(4):fill(true)
+ * a:iandnot(Bitarray.new(4):set(2, true))
+ * print(a)  -- Bitarray[1,0,1,1]
+ */
+BITARRAY_API BITARRAY_BIT_IBIOP(iandnot, bitarray_andnot)
+
+#undef BITARRAY_BIT_IBIOP
+
+/* magnitude of a shift amount, saturated to SIZE_MAX */
+static size_t shiftamount(lua_Integer s)
+{
+    /* -(s + 1) does not overflow on the most negative integer */
+    uint64_t m = s >= 0 ? (uint64_t)s : (uint64_t)-(s + 1) + 1;
+    return m > SIZE_MAX ? SIZE_MAX : (size_t)m;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Shift all content left n bits and return the new array. Extra bits are
+ * discarded and empty bits are filled with 0. <br />
+ * Operator __shl is overloaded with this method. (5.3+)
+ * @function shiftleft
+ * @tparam integer n
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @usage
+ * local a = Bitarray.new(8):from_uint8(15)
+ * print(a)      -- Bitarray[0,0,0,0,1,1,1,1]
+ * print(a << 2) -- Bitarray[0,0,1,1,1,1,0,0]
+ */
+BITARRAY_API static int shl(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer s = luaL_checkinteger(L, 2);
+
+    if (s == 0)
+        return _l_clone(L, ba);
+    if (_l_new(L, ba->size) == 0)
+        return 0;
+    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
+    if (s >= 0)
+        bitarray_be_lshift2(ba, r, shiftamount(s));
+    else
+        bitarray_be_rshift2(ba, r, shiftamount(s));
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Shift all content right n bits and return the new array. Extra bits are
+ * discarded and empty bits are filled with 0. The shift is unsigned. <br />
+ * Operator __shr is overloaded with this method. (5.3+)
+ * @see shiftleft
+ * @function shiftright
+ * @tparam integer n
+ * @treturn Bitarray|nil the newly created bit array reference if successful
+ */
+BITARRAY_API static int shr(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    lua_Integer s = luaL_checkinteger(L, 2);
+
+    if (s == 0)
+        return _l_clone(L, ba);
+    if (_l_new(L, ba->size) == 0)
+        return 0;
+    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
+    if (s >= 0)
+        bitarray_be_rshift2(ba, r, shiftamount(s));
+    else
+        bitarray_be_lshift2(ba, r, shiftamount(s));
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Shift all content left n bits in place. Extra bits are discarded and empty
+ * bits are filled with 0.
+ * @see shiftleft
+ * @function shiftleft_inplace
+ * @tparam integer n
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(8):from_uint8(15)
+ * a:shiftleft_inplace(2)
+ * print(a) -- Bitarray[0,0,1,1,1,1,0,0]
+ */
+BITARRAY_API static int shl_inplace(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    lua_Integer s = luaL_checkinteger(L, 2);
+
+    if (s >= 0)
+        bitarray_be_lshift(ba, shiftamount(s));
+    else
+        bitarray_be_rshift(ba, shiftamount(s));
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Shift all content right n bits in place. Extra bits are discarded and empty
+ * bits are filled with 0. The shift is unsigned.
+ * @see shiftright
+ * @function shiftright_inplace
+ * @tparam integer n
+ * @treturn Bitarray the original bit array reference
+ */
+BITARRAY_API static int shr_inplace(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    lua_Integer s = luaL_checkinteger(L, 2);
+
+    if (s >= 0)
+        bitarray_be_rshift(ba, shiftamount(s));
+    else
+        bitarray_be_lshift(ba, shiftamount(s));
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+static size_t checkopt_index(lua_State *L, Bitarray *ba, int nArg)
+{
+    lua_Integer i = luaL_optinteger(L, nArg, 1) - 1;
+    luaL_argcheck(L, 0 <= i && (uint64_t)i < ba->size, nArg, "index out of range");
+    return (size_t)i;
+}
+
+#define BITARRAY_AT_TYPE(TYPE) \
+    static int at_ ## TYPE(lua_State *L) \
+    { \
+        Bitarray *ba = checkbitarray(L, 1); \
+        size_t i = checkopt_index(L, ba, 2); \
+        size_t tgt = sizeof(TYPE) * CHAR_BIT; \
+        luaL_argcheck(L, ba->size - i + 1 > tgt, 2, \
+            "too few bits to construct this type"); \
+        \
+        TYPE res = (TYPE)bitarray_get_bits(ba, i, tgt); \
+        lua_pushinteger(L, (lua_Integer)res); \
+        return 1; \
+    }
+
+/** 
+ * <i>Does not mutate the array.</i> <br />
+ * Converts the contents starting at index i to an uint8 (uchar) integer.
+ * The array should be big enough to hold bits required to construct the
+ * type.
+ * The leftmost bit corresponds to the most significant digit of the number
+ * and the last bit corresponds to the least significant digit (big endian).
+ * @function at_uint8
+ * @tparam[opt] integer i default to 1
+ * @treturn integer
+ * @usage
+ * local a = Bitarray.new(10):set(2, 1):set(3, 1):set(4, 1):set(5, 1):set(7, 1)
+ * print(a) -- Bitarray[0,1,1,1,1,0,1,0,0,0]
+ * a:at_uint8(2)   -- intepreted as 11110100, which is 244
+ */
+BITARRAY_API BITARRAY_AT_TYPE(uint8_t)
+
+/** 
+ * <i>Does not mutate the array.</i> <br />
+ * Converts the contents starting at index i to an uint16 integer.
+ * @see at_uint8
+ * @function at_uint16
+ * @tparam[opt] integer i
+ * @treturn integer
+ */
+BITARRAY_API BITARRAY_AT_TYPE(uint16_t)
+
+/** 
+ * <i>Does not mutate the array.</i> <br />
+ * Converts the contents starting at index i to an uint32 integer.
+ * @see at_uint8
+ * @function at_uint32
+ * @tparam[opt] integer i
+ * @treturn integer
+ */
+BITARRAY_API BITARRAY_AT_TYPE(uint32_t)
+
+/** 
+ * <i>Does not mutate the array.</i> <br />
+ * Converts the contents starting at index i to an uint64 integer.
+ * @see at_uint8
+ * @function at_uint64
+ * @tparam[opt] integer i
+ * @treturn integer
+ * @usage
+ * -- lua5.3 added support for displaying and manipulating unsigned integers,
+ * -- prior to that this function may not work as intended always
+ * local a = Bitarray.new(64):fill(true)
+ * string.format('%u', a:at_uint64()) -- 18446744073709551615
+ */
+BITARRAY_API BITARRAY_AT_TYPE(uint64_t)
+
+#undef BITARRAY_AT_TYPE
+
+#define BITARRAY_FROM_TYPE(TYPE) \
+    static int from_ ## TYPE(lua_State *L) \
+    { \
+        Bitarray *ba = checkbitarray_mut(L, 1); \
+        TYPE src = (TYPE)luaL_checkinteger(L, 2); \
+        size_t i = checkopt_index(L, ba, 3); \
+        size_t tgt = sizeof(TYPE) * CHAR_BIT; \
+        luaL_argcheck(L, ba->size - i + 1 > tgt, 3, \
+            "too few bits to contain this type"); \
+        \
+        bitarray_set_bits(ba, i, tgt, src); \
+        lua_pushvalue(L, 1); \
+        return 1; \
+    }
+
+/** 
+ * <i>Mutates the array.</i> <br />
+ * Assign the array from index i from an uint8 (uchar) integer. The array should
+ * be big enough to store the representation.
+ * The leftmost bit corresponds to the most significant digit of the number
+ * and the last bit corresponds to the least significant digit (big endian).
+ * @function from_uint8
+ * @tparam integer src the source integer to convert from
+ * @tparam[opt] integer i the index in this array where the first bit gets
+ * copied from src. default 1
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(8):from_uint8(253)
+ * print(a) -- Bitarray[1,1,1,1,1,1,0,1]
+ * local b = Bitarray.new(16):from_uint8(255, 9)
+ * print(b) -- Bitarray[0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1]
+ */
+BITARRAY_API BITARRAY_FROM_TYPE(uint8_t)
+
+/** 
+ * <i>Mutates the array.</i> <br />
+ * Assign the array from index i from an uint16 integer. The array should
+ * be big enough to store the representation.
+ * @see from_uint8
+ * @function from_uint16
+ * @tparam integer src
+ * @tparam[opt] integer i
+ * @treturn Bitarray the original bit array reference
+ */
+BITARRAY_API BITARRAY_FROM_TYPE(uint16_t)
+
+/** 
+ * <i>Mutates the array.</i> <br />
+ * Assign the array from index i from an uint32 integer. The array should
+ * be big enough to store the representation.
+ * @see from_uint8
+ * @function from_uint32
+ * @tparam integer src
+ * @tparam[opt] integer i
+ * @treturn Bitarray the original bit array reference
+ */
+BITARRAY_API BITARRAY_FROM_TYPE(uint32_t)
+
+/** 
+ * <i>Mutates the array.</i> <br />
+ * Assign the array from index i from an uint64 integer. The array should
+ * be big enough to store the representation.
+ * @see from_uint8
+ * @see at_uint64
+ * @function from_uint64
+ * @tparam integer src
+ * @tparam[opt] integer i
+ * @treturn Bitarray the original bit array reference
+ */
+BITARRAY_API BITARRAY_FROM_TYPE(uint64_t)
+
+#undef BITARRAY_FROM_TYPE
+
+/* checks a bit field of width w at i, returns the 0 based index */
+static size_t checkbitfield(lua_State *L, Bitarray *ba, size_t *width)
+{
+    size_t i = checkopt_index(L, ba, 2);
+    lua_Integer w = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, 1 <= w && w <= 64, 3, "width must be between 1 and 64");
+    luaL_argcheck(L, ba->size - i >= (size_t)w, 3, "too few bits for this width");
+    *width = (size_t)w;
+    return i;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Reads width bits starting at index i as an unsigned integer. The bit at i
+ * is the most significant digit, like at_uint8 and friends but for any width
+ * from 1 to 64.
+ * @function get_bits
+ * @tparam integer i the index of the first bit
+ * @tparam integer width 1 to 64
+ * @treturn integer
+ * @usage
+ * local a = Bitarray.new(16):from_uint16(0xABCD)
+ * a:get_bits(5, 7)  -- 1011110 in binary, 94
+ */
+BITARRAY_API static int get_bits(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    size_t width;
+    size_t i = checkbitfield(L, ba, &width);
+
+    lua_pushinteger(L, (lua_Integer)bitarray_get_bits(ba, i, width));
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Writes the lowest width bits of value starting at index i, the most
+ * significant one first.
+ * @see get_bits
+ * @function set_bits
+ * @tparam integer i the index of the first bit
+ * @tparam integer width 1 to 64
+ * @tparam integer value
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(8):set_bits(2, 3, 5)
+ * print(a) -- Bitarray[0,1,0,1,0,0,0,0]
+ */
+BITARRAY_API static int set_bits(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    size_t width;
+    size_t i = checkbitfield(L, ba, &width);
+    uint64_t v = (uint64_t)luaL_checkinteger(L, 4);
+
+    bitarray_set_bits(ba, i, width, v);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Copy the content from bitarray src to the operand. The array's ith, i+1th,
+ * ... bit will be the bits from src starting from 1st to the last. The array
+ * needs to be big enough to hold the data.
+ * @function from_bitarray
+ * @tparam Bitarray src
+ * @tparam[opt] integer i the index in this array where the first bit gets
+ * copied from src. default 1
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(10)
+ *  :from_bitarray(Bitarray.new(5):fill(true):set(3, false), 6)
+ * print(a) -- Bitarray[0,0,0,0,0,1,1,0,1,1]
+ */
+BITARRAY_API static int from_bitarray(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    Bitarray *src = checkbitarray(L, 2);
+    size_t i = checkopt_index(L, ba, 3);
+    luaL_argcheck(L, ba->size - i + 1 > src->size, 3, "not enough space");
+
+    bitarray_copyvalues2(src, ba, 0, src->size, i);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Copy the content from a binary string to the operand. Given the string
+ * consisting of only 0 and 1's, the array's ith, i+1th, ... bit will be
+ * the false/true values represented by chars in this string. The array
+ * needs to be big enough to hold the data.
+ * @function from_binarystring
+ * @tparam string src
+ * @tparam[opt] integer i the index in this array where the first bit gets
+ * copied from src. default 1
+ * @treturn Bitarray the original bit array reference
+ * @usage
+ * local a = Bitarray.new(12)
+ *  :from_binarystring('001100'):from_binarystring('111111', 7)
+ * print(a) -- Bitarray[0,0,1,1,0,0,1,1,1,1,1,1]
+ * -- a:from_binarystring('10x0') error! invalid string
+ */
+BITARRAY_API static int from_binarystring(lua_State *L)
+{
+    Bitarray *ba = checkbitarray_mut(L, 1);
+    size_t slen;
+    const char *s = luaL_checklstring(L, 2, &slen);
+    size_t i = checkopt_index(L, ba, 3);
+
+    /* validated and packed in one pass, into a scratch buffer so that the
+       array is left alone if the string is invalid */
+    WORD *tmp = (WORD *)lua_newuserdata(L, WORDS_FOR_BITS(slen) * sizeof(WORD));
+    if (!bitarray_parse_binary(tmp, s, slen))
+        luaL_argerror(L, 2, "invalid binary string");
+    luaL_argcheck(L, ba->size - i + 1 > slen, 3, "not enough space");
+
+    bitarray_copybits(ba->values, i, tmp, 0, slen);
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/* to_binarystring formats this many bits per luaL_Buffer request. lua 5.1
+   hands out at most LUAL_BUFFERSIZE bytes at a time */
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+    #define BITARRAY_TEXT_CHUNK ((size_t)1 << 15)
+    #define bitarray_prepbuffer(B, n) luaL_prepbuffsize((B), (n))
+#else
+    #define BITARRAY_TEXT_CHUNK \
+        ((size_t)LUAL_BUFFERSIZE / BITS_PER_WORD * BITS_PER_WORD)
+    #define bitarray_prepbuffer(B, n) luaL_prepbuffer(B)
+#endif
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Returns the bits from index i to j, inclusive, as a string of 0 and 1's.
+ * Unlike tostring, the whole range is always written out.
+ * @see from_binarystring
+ * @function to_binarystring
+ * @tparam[opt] integer i the starting index, default 1
+ * @tparam[optchain] integer j the ending index, default the length of the array.
+ * @treturn string
+ * @usage
+ * local a = Bitarray.new(12):from_binarystring('001011011111')
+ * a:to_binarystring()      -- '001011011111'
+ * a:to_binarystring(3, 10) -- '10110111'
+ */
+BITARRAY_API static int to_binarystring(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = checkbitarray_and_optrange(L, &from, &to);
+    WORD tmp[BITARRAY_TEXT_CHUNK / BITS_PER_WORD];
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    for (size_t p = from; p < to; p += BITARRAY_TEXT_CHUNK) {
+        size_t k = to - p < BITARRAY_TEXT_CHUNK ? to - p : BITARRAY_TEXT_CHUNK;
+        const WORD *src = ba->values + I_WORD(p);
+        if (p % BITS_PER_WORD != 0) {
+            bitarray_copybits(tmp, 0, ba->values, p, k);
+            src = tmp;
+        }
+        char *out = bitarray_prepbuffer(&buf, k);
+        bitarray_format_binary(out, src, k);
+        luaL_addsize(&buf, k);
+    }
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+#undef BITARRAY_TEXT_CHUNK
+#undef bitarray_prepbuffer
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Creates a sparse array of the same length holding the same bits.
+ * @see Bitarray.sparse
+ * @function to_sparse
+ * @treturn Sparse|nil the newly created sparse array if successful
+ */
+BITARRAY_API static int to_sparse(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    BitarraySparse *sp = _l_newsparse(L, ba->size);
+    if (bitarray_sparse_from_dense(sp, ba) == 0)
+        return 0;
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Packs the bits from index i to n, inclusive, into a string, 8 bits per
+ * byte. If the number of bits is not a multiple of 8 the last byte is padded
+ * with 0.
+ * @see from_bytes
+ * @function to_bytes
+ * @tparam[opt] integer i the starting index, default 1
+ * @tparam[optchain] integer n the ending index, default the length of the array.
+ * @tparam[optchain] string order "msb" or "lsb", default "msb"
+ * @treturn string
+ * @usage
+ * local a = Bitarray.new(12):from_binarystring('001011011111')
+ * a:to_bytes()         -- '\45\240'
+ * a:to_bytes(3, 10)    -- '\183'
+ */
+BITARRAY_API static int to_bytes(lua_State *L)
+{
+    size_t from, to;
+    Bitarray *ba = checkbitarray_and_optrange(L, &from, &to);
+    int msb = luaL_checkoption(L, 4, "msb", bitorders) == 0;
+
+    size_t nbits = to - from;
+    size_t nbytes = (nbits + CHAR_BIT - 1) / CHAR_BIT;
+    const WORD *src = ba->values + I_WORD(from);
+    if (from % BITS_PER_WORD != 0) {
+        /* realign the range to bit 0 of a scratch buffer first */
+        size_t nwords = WORDS_FOR_BITS(nbits);
+        WORD *tmp = (WORD *)lua_newuserdata(L, nwords * sizeof(WORD));
+        tmp[nwords - 1] = 0;
+        bitarray_copybits(tmp, 0, ba->values, from, nbits);
+        src = tmp;
+    }
+    unsigned char *out = (unsigned char *)lua_newuserdata(L, nbytes);
+    bitarray_to_bytes(src, out, nbytes, msb);
+    if (nbits % CHAR_BIT != 0) {
+        /* the last byte may hold bits past the range */
+        unsigned char keep = (unsigned char)((1u << (nbits % CHAR_BIT)) - 1);
+        out[nbytes - 1] &= msb ?
+            (unsigned char)(keep << (CHAR_BIT - nbits % CHAR_BIT)) : keep;
+    }
+    lua_pushlstring(L, (const char *)out, nbytes);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Serializes the array into a string that Bitarray.load turns back into an
+ * equal array, on any host. The string holds a small header, the storage
+ * words as they are in memory and a CRC32C checksum.
+ * @see load
+ * @see save
+ * @function dump
+ * @tparam[opt] boolean crc whether to append the checksum, default true
+ * @treturn string
+ */
+BITARRAY_API static int dump(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    int crc = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+
+    unsigned char h[BITARRAY_HEADER_BYTES];
+    size_t n = WORDS_FOR_BITS(ba->size) * sizeof(WORD);
+    bitarray_header_write(h, ba->size, crc);
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    luaL_addlstring(&buf, (const char *)h, sizeof(h));
+    luaL_addlstring(&buf, (const char *)ba->values, n);
+    if (crc) {
+        unsigned char t[4];
+        uint32_t c = bitarray_kernels.crc32c(0, h, sizeof(h));
+        bitarray_put_le32(t, bitarray_kernels.crc32c(c,
+            (const unsigned char *)ba->values, n));
+        luaL_addlstring(&buf, (const char *)t, sizeof(t));
+    }
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Writes the array to a file at its current position, in the format of dump.
+ * The words are streamed from the array without an intermediate string. The
+ * file can be read back with Bitarray.read, or mapped with Bitarray.mmap if
+ * it holds nothing else.
+ * @see read
+ * @function save
+ * @tparam file f a file opened for writing, in binary mode
+ * @tparam[opt] boolean crc whether to append the checksum, default true
+ * @treturn Bitarray|nil the original bit array reference, or nil and an
+ * error message
+ * @usage
+ * local f = assert(io.open('bits.dat', 'wb'))
+ * assert(a:save(f))
+ * f:close()
+ */
+BITARRAY_API static int save(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    FILE *f = checkfile(L, 2);
+    int crc = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+
+    if (!bitarray_save(ba, f, crc)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    lua_pushvalue(L, 1);
+    return 1;
+}
+
+/* payload codecs, in the order of BITARRAY_CODEC_* */
+static const char *const codecs[] = { "raw", "rle", "ewah", NULL };
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Serializes the array like dump, with the words compressed. Suits arrays
+ * made of long runs of 0 or 1 bits, the result can be turned back into an
+ * array with Bitarray.decompress on any host.
+ * @see decompress
+ * @see ewah_and
+ * @function compress
+ * @tparam[opt] string codec "ewah" (default): the word-aligned hybrid
+ * encoding, which ewah_and, ewah_or and ewah_xor work on. "rle": runs of
+ * 0 or 1 words and of other words, slightly smaller. "raw": same as dump.
+ * @tparam[optchain] boolean crc whether to append the checksum, default true
+ * @treturn string
+ * @usage
+ * local a = Bitarray.new(1000000):set(5, true)
+ * print(#a:dump(), #a:compress()) -- 125020  44
+ */
+BITARRAY_API static int compress(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    int codec = luaL_checkoption(L, 2, "ewah", codecs);
+    int crc = lua_isnoneornil(L, 3) || lua_toboolean(L, 3);
+
+    if (codec == BITARRAY_CODEC_RAW) {
+        lua_remove(L, 2);
+        return dump(L);
+    }
+    if (codec == BITARRAY_CODEC_RLE) {
+        BitarrayBytes out = { NULL, 0, 0, 0 };
+        bitarray_rle_encode(ba, &out);
+        push_compressed(L, ba->size, codec, &out, crc);
+    } else {
+        BitarrayEwahWriter w;
+        bitarray_ewah_encode(ba, &w);
+        push_compressed(L, ba->size, codec, &w.out, crc);
+    }
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Returns the string representation for the array. <br />
+ * Metamethod __tostring is overloaded with this method so it can be implicitly
+ * called if string is needed. The full array is not displayed if it is too long.
+ * @see to_binarystring
+ * @function tostring
+ * @treturn string
+ * @usage
+ * local a = Bitarray.new(8):set(8, true)
+ * print(a)
+ * -- Bitarray[0,0,0,0,0,0,0,1]
+ * a:resize(65)
+ * print(a)
+ * -- Bitarray[...]
+ */
+BITARRAY_API static int tostring(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    luaL_addstring(&buf, "Bitarray[");
+    if (ba->size > (size_t)64) {
+        luaL_addstring(&buf, "...]");
+        goto push;
+    }
+    for (size_t i = 0; i < ba->size-1; ++i) {
+        luaL_addstring(&buf, bitarray_get_bit(ba, i) ? "1," : "0,");
+    }
+    /* size cannot be 0 in this context */
+    luaL_addstring(&buf, bitarray_get_bit(ba, ba->size-1) ? "1]" : "0]");
+push:
+    luaL_addvalue(&buf);
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+/* finalizer for bitarray */
+BITARRAY_API static int gc(lua_State *L)
+{
+    Bitarray *ba = checkbitarray(L, 1);
+    bitarray_invalidate(ba);
+    return 0;
+}
+
+/* actual __index, if param if number it returns result of get(), otherwise
+   looks up for fields */
+BITARRAY_API static int get(lua_State *L)
+{
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, 2))
+#else
+    if (lua_isnumber(L, 2))
+#endif
+        return getbit(L);
+    luaL_getmetatable(L, BITARRAY_MT_1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+/**
+ * Compressed bit array created by Bitarray.sparse or to_sparse. Indexing,
+ * length, counting, bitwise operators and equality work like they do on a
+ * Bitarray.
+ * @type Sparse
+ */
+
+static BitarraySparse *checksparse_and_index(lua_State *L, size_t *i)
+{
+    BitarraySparse *sp = checksparse(L, 1);
+    lua_Integer i_ = luaL_checkinteger(L, 2) - 1;
+    luaL_argcheck(L, 0 <= i_ && (uint64_t)i_ < sp->size, 2, "index out of range");
+    *i = (size_t)i_;
+    return sp;
+}
+
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Get the ith bit of the array. <br />
+ * Operator __index is overloaded with this method.
+ * @function at
+ * @tparam integer i the index
+ * @treturn boolean true if bit is 1, false if 0
+ */
+BITARRAY_API static int sparse_getbit(lua_State *L)
+{
+    size_t i;
+    BitarraySparse *sp = checksparse_and_index(L, &i);
+
+    lua_pushboolean(L, bitarray_sparse_get(sp, i));
+    return 1;
+}
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Set the ith bit of the array. Any value other than false or nil will be
+ * considered a truthy(1) bit. <br />
+ * Operator __newindex is overloaded with this method.
+ * @function set
+ * @tparam integer i the index
+ * @tparam any b the value to change to
+ * @treturn Sparse|nil the original array reference, nil if the memory for
+ * the bit could not be allocated
+ */
+BITARRAY_API static int sparse_setbit(lua_State *L)
+{
+    size_t i;
+    BitarraySparse *sp = checksparse_and_index(L, &i);
+    luaL_checkany(L, 3);
 
-    lua_pushboolean(L, bitarray_equal(ba, o));
+    if (bitarray_sparse_set(sp, i, lua_toboolean(L, 3)) == 0)
+        return 0;
+    lua_pushvalue(L, 1);
     return 1;
 }
 
 /**
  * <i>Does not mutate the array.</i> <br />
- * Concatenate two arrays and return the new array. <br />
- * Operator __concat is overloaded with this method.
- * @function concat
- * @tparam Bitarray other
- * @treturn Bitarray|nil the newly created bit array reference if successful
- * @usage
- * local a = Bitarray.new(1)
- * local b = Bitarray.new(4):fill(true)
- * print(a..b)  -- Bitarray[0,1,1,1,1]
+ * Get the length of the array. <br />
+ * Operator __len is overloaded with this method.
+ * @function len
+ * @treturn integer the number of bits of the array
  */
-BITARRAY_API static int concat(lua_State *L)
+BITARRAY_API static int sparse_len(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    Bitarray *o = checkbitarray(L, 2);
+    BitarraySparse *sp = checksparse(L, 1);
+    lua_pushinteger(L, sp->size);
+    return 1;
+}
 
-    if (_l_new(L, ba->size + o->size) == 0)
-        return 0;
-    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
-    bitarray_copyvalues(ba, r);
-    bitarray_copyvalues2(o, r, 0, o->size, ba->size);
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Count the bits set to 1. This is a sum over the chunks, the bits are not
+ * visited.
+ * @function count
+ * @treturn integer
+ */
+BITARRAY_API static int sparse_count(lua_State *L)
+{
+    BitarraySparse *sp = checksparse(L, 1);
+    lua_pushinteger(L, (lua_Integer)bitarray_sparse_count(sp));
     return 1;
 }
 
 /**
  * <i>Does not mutate the array.</i> <br />
- * Flip all bits of the array and return the new array. <br />
- * Operator __bnot is overloaded with this method. (5.3+)
- * @function bnot
- * @treturn Bitarray|nil the newly created bit array reference if successful
- * @usage
- * local a = Bitarray.new(2):set(1, true)
- * print(~a)  -- Bitarray[0,1]
+ * Compares whether two arrays are identical (same value and length). <br />
+ * Operator __eq is overloaded with this method.
+ * @function equal
+ * @tparam Sparse other
+ * @treturn boolean
  */
-BITARRAY_API static int bnot(lua_State *L)
+BITARRAY_API static int sparse_equal(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
+    BitarraySparse *sp = checksparse(L, 1);
+    BitarraySparse *o = checksparse(L, 2);
 
-    if (_l_new(L, ba->size) == 0)
-        return 0;
-    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
-    bitarray_copyvalues(ba, r);
-    bitarray_flip(r);
+    int eq = bitarray_sparse_equal(sp, o);
+    if (eq < 0)
+        return luaL_error(L, "not enough memory");
+    lua_pushboolean(L, eq);
     return 1;
 }
 
-#define BITARRAY_BIT_BIOP(NAME, OP) \
+#define BITARRAY_SPARSE_BIOP(NAME, OP) \
     static int NAME(lua_State *L) \
     { \
-        Bitarray *ba = checkbitarray(L, 1); \
-        Bitarray *o = checkbitarray(L, 2); \
-        luaL_argcheck(L, ba->size == o->size, 2, \
+        BitarraySparse *sp = checksparse(L, 1); \
+        BitarraySparse *o = checksparse(L, 2); \
+        luaL_argcheck(L, sp->size == o->size, 2, \
             "two operands must be of same size"); \
         \
-        if (_l_new(L, ba->size) == 0) \
+        BitarraySparse *r = _l_newsparse(L, sp->size); \
+        if (bitarray_sparse_op(r, sp, o, OP) == 0) \
             return 0; \
-        Bitarray *r = (Bitarray *)lua_touserdata(L, -1); \
-        BITARRAY_WORD_ITER(r, i, \
-            r->values[i] = ba->values[i] OP o->values[i]; \
-        ); \
         return 1; \
     }
 
 /**
  * <i>Does not mutate the array.</i> <br />
  * Perform a bitwise AND and return the new array. Two arrays have to be of
- * same size. <br />
+ * same size. Chunks present in only one of them are skipped. <br />
  * Operator __band is overloaded with this method. (5.3+)
  * @function band
- * @tparam Bitarray other
- * @treturn Bitarray|nil the newly created bit array reference if successful
- * @usage
- * local a = Bitarray.new(4):set(1, true):set(3, true)
- * local b = Bitarray.new(4):set(1, true)
- * print(a & b)  -- Bitarray[1,0,0,0]
+ * @tparam Sparse other
+ * @treturn Sparse|nil the newly created sparse array if successful
  */
-BITARRAY_API BITARRAY_BIT_BIOP(band, &)
+BITARRAY_API BITARRAY_SPARSE_BIOP(sparse_band, BITARRAY_SPARSE_AND)
 
 /**
  * <i>Does not mutate the array.</i> <br />
@@ -400,10 +2738,10 @@ BITARRAY_API BITARRAY_BIT_BIOP(band, &)
  * Operator __bor is overloaded with this method. (5.3+)
  * @see band
  * @function bor
- * @tparam Bitarray other
- * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @tparam Sparse other
+ * @treturn Sparse|nil the newly created sparse array if successful
  */
-BITARRAY_API BITARRAY_BIT_BIOP(bor, |)
+BITARRAY_API BITARRAY_SPARSE_BIOP(sparse_bor, BITARRAY_SPARSE_OR)
 
 /**
  * <i>Does not mutate the array.</i> <br />
@@ -412,353 +2750,694 @@ BITARRAY_API BITARRAY_BIT_BIOP(bor, |)
  * Operator __bxor is overloaded with this method. (5.3+)
  * @see band
  * @function bxor
- * @tparam Bitarray other
- * @treturn Bitarray|nil the newly created bit array reference if successful
+ * @tparam Sparse other
+ * @treturn Sparse|nil the newly created sparse array if successful
  */
-BITARRAY_API BITARRAY_BIT_BIOP(bxor, ^)
+BITARRAY_API BITARRAY_SPARSE_BIOP(sparse_bxor, BITARRAY_SPARSE_XOR)
 
-#undef BITARRAY_BIT_BIOP
+#undef BITARRAY_SPARSE_BIOP
+
+/**
+ * <i>Mutates the array.</i> <br />
+ * Moves every chunk to its smallest container. Setting bits one at a time
+ * only switches containers when an array fills up or a bitmap empties, so
+ * an array built that way may get smaller, for example when its bits turned
+ * out to form long ranges.
+ * @function optimize
+ * @treturn Sparse the original array reference
+ */
+BITARRAY_API static int sparse_optimize(lua_State *L)
+{
+    BitarraySparse *sp = checksparse(L, 1);
+    bitarray_sparse_optimize(sp);
+    lua_pushvalue(L, 1);
+    return 1;
+}
 
 /**
  * <i>Does not mutate the array.</i> <br />
- * Shift all content left n bits and return the new array. Extra bits are
- * discarded and empty bits are filled with 0. <br />
- * Operator __shl is overloaded with this method. (5.3+)
- * @function shiftleft
- * @tparam integer n
- * @treturn Bitarray|nil the newly created bit array reference if successful
+ * Tells how the stored chunks are kept.
+ * @function containers
+ * @treturn integer the number of chunks stored as lists of 1 bits
+ * @treturn integer the number of chunks stored as bitmaps
+ * @treturn integer the number of chunks stored as lists of ranges
  * @usage
- * local a = Bitarray.new(8):from_uint8(15)
- * print(a)      -- Bitarray[0,0,0,0,1,1,1,1]
- * print(a << 2) -- Bitarray[0,0,1,1,1,1,0,0]
+ * local a = Bitarray.sparse(2^20)
+ * a[1] = true
+ * a:containers() -- 1 0 0
  */
-BITARRAY_API static int shl(lua_State *L)
+BITARRAY_API static int sparse_containers(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    long s = (long)luaL_checkinteger(L, 2);
+    BitarraySparse *sp = checksparse(L, 1);
+    lua_Integer n[3] = { 0, 0, 0 };
+    for (size_t k = 0; k < sp->n; ++k)
+        ++n[sp->chunks[k].type];
+    lua_pushinteger(L, n[BITARRAY_ARRAY]);
+    lua_pushinteger(L, n[BITARRAY_BITMAP]);
+    lua_pushinteger(L, n[BITARRAY_RUN]);
+    return 3;
+}
 
-    if (_l_new(L, ba->size) == 0)
+/**
+ * <i>Does not mutate the array.</i> <br />
+ * Creates a plain Bitarray of the same length holding the same bits.
+ * @function to_bitarray
+ * @treturn Bitarray|nil the newly created bit array if successful
+ */
+BITARRAY_API static int sparse_to_bitarray(lua_State *L)
+{
+    BitarraySparse *sp = checksparse(L, 1);
+    if (_l_new(L, sp->size) == 0)
         return 0;
-    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
-    bitarray_copyvalues(ba, r);
-    if (s >= 0)
-        bitarray_be_lshift(r, (size_t)s);
-    else
-        bitarray_be_rshift(r, (size_t)-s);
+    bitarray_sparse_to_dense(sp, (Bitarray *)lua_touserdata(L, -1));
     return 1;
 }
 
 /**
  * <i>Does not mutate the array.</i> <br />
- * Shift all content right n bits and return the new array. Extra bits are
- * discarded and empty bits are filled with 0. The shift is unsigned. <br />
- * Operator __shr is overloaded with this method. (5.3+)
- * @see shiftleft
- * @function shiftright
- * @tparam integer n
- * @treturn Bitarray|nil the newly created bit array reference if successful
+ * Returns the string representation for the array, in the same format as
+ * Bitarray's tostring. <br />
+ * Metamethod __tostring is overloaded with this method.
+ * @function tostring
+ * @treturn string
  */
-BITARRAY_API static int shr(lua_State *L)
+BITARRAY_API static int sparse_tostring(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    long s = (long)luaL_checkinteger(L, 2);
+    BitarraySparse *sp = checksparse(L, 1);
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    luaL_addstring(&buf, "Sparse[");
+    if (sp->size > (size_t)64) {
+        luaL_addstring(&buf, "...]");
+    } else {
+        for (size_t i = 0; i < sp->size; ++i) {
+            luaL_addchar(&buf, bitarray_sparse_get(sp, i) ? '1' : '0');
+            luaL_addchar(&buf, i + 1 < sp->size ? ',' : ']');
+        }
+    }
+    luaL_pushresult(&buf);
+    return 1;
+}
 
-    if (_l_new(L, ba->size) == 0)
+/* finalizer for sparse bitarray */
+BITARRAY_API static int sparse_gc(lua_State *L)
+{
+    BitarraySparse *sp = checksparse(L, 1);
+    bitarray_sparse_free(sp);
+    return 0;
+}
+
+/* actual __index for sparse arrays, see get() */
+BITARRAY_API static int sparse_get(lua_State *L)
+{
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, 2))
+#else
+    if (lua_isnumber(L, 2))
+#endif
+        return sparse_getbit(L);
+    luaL_getmetatable(L, BITARRAY_MT_SPARSE);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+/**
+ * Blocked Bloom filter created by Bitarray.bloom. Keys are strings or
+ * numbers; a number is the same key as any other number of the same value,
+ * so 1 and 1.0 match, and a string is never the same key as a number.
+ * Metamethod __len returns the number of bits.
+ * @type Bloom
+ */
+
+/* hash of the key at index i, raises an error at argument arg for keys of
+   other types */
+static uint64_t bloom_hash(lua_State *L, int i, int arg)
+{
+    unsigned char b[8];
+    uint64_t v;
+    switch (lua_type(L, i)) {
+    case LUA_TSTRING: {
+        size_t n;
+        const char *s = lua_tolstring(L, i, &n);
+        return bitarray_wyhash(s, n, 0);
+    }
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, i)) {
+            v = (uint64_t)lua_tointeger(L, i);
+        } else
+#endif
+        {
+            double x = (double)lua_tonumber(L, i);
+            if (x >= -9223372036854775808.0 && x < 9223372036854775808.0
+                && (double)(int64_t)x == x) {
+                v = (uint64_t)(int64_t)x;
+            } else {
+                /* not integral, hashed by its bits */
+                memcpy(&v, &x, sizeof(v));
+                bitarray_put_le64(b, v);
+                return bitarray_wyhash(b, sizeof(b), 2);
+            }
+        }
+        bitarray_put_le64(b, v);
+        return bitarray_wyhash(b, sizeof(b), 1);
+    default:
+        luaL_argerror(L, arg, "string or number expected");
         return 0;
-    Bitarray *r = (Bitarray *)lua_touserdata(L, -1);
-    bitarray_copyvalues(ba, r);
-    if (s >= 0)
-        bitarray_be_rshift(r, (size_t)s);
-    else
-        bitarray_be_lshift(r, (size_t)-s);
+    }
+}
+
+/* keys of a batch are hashed and their blocks prefetched before any of them
+   is looked at */
+#define BLOOM_BATCH 16
+
+/* calls visit for every key of the table at index 2, in order. visit gets
+   the 1-based position of the key */
+static void bloom_each(lua_State *L, BitarrayBloom *f,
+    void (*visit)(lua_State *L, BitarrayBloom *f, uint64_t h, size_t pos))
+{
+    luaL_checktype(L, 2, LUA_TTABLE);
+    size_t n = (size_t)rawlen(L, 2);
+    uint64_t hs[BLOOM_BATCH];
+    for (size_t from = 1; from <= n; from += BLOOM_BATCH) {
+        size_t m = n - from + 1 < BLOOM_BATCH ? n - from + 1 : BLOOM_BATCH;
+        for (size_t j = 0; j < m; ++j) {
+            lua_rawgeti(L, 2, (int)(from + j));
+            int t = lua_type(L, -1);
+            if (t != LUA_TSTRING && t != LUA_TNUMBER)
+                luaL_error(L, "bad key #%d in table (string or number expected, got %s)",
+                    (int)(from + j), lua_typename(L, t));
+            hs[j] = bloom_hash(L, -1, 2);
+            lua_pop(L, 1);
+            bitarray_bloom_prefetch(f, hs[j]);
+        }
+        for (size_t j = 0; j < m; ++j)
+            visit(L, f, hs[j], from + j);
+    }
+}
+
+/**
+ * <i>Mutates the filter.</i> <br />
+ * Adds a key.
+ * @function add
+ * @tparam string|number key
+ * @treturn Bloom the original filter reference
+ */
+BITARRAY_API static int bloom_add(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    bitarray_bloom_add(f, bloom_hash(L, 2, 2));
+    lua_settop(L, 1);
     return 1;
 }
 
-static size_t checkopt_index(lua_State *L, Bitarray *ba, int nArg)
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Tests whether a key may have been added. A key that was added is always
+ * found, a key that was not is found with the false positive rate of the
+ * filter.
+ * @function contains
+ * @tparam string|number key
+ * @treturn boolean
+ */
+BITARRAY_API static int bloom_contains(lua_State *L)
 {
-    lua_Integer i = luaL_optinteger(L, nArg, 1) - 1;
-    luaL_argcheck(L, 0 <= i && i < ba->size, nArg, "index out of range");
-    return (size_t)i;
+    BitarrayBloom *f = checkbloom(L, 1);
+    lua_pushboolean(L, bitarray_bloom_contains(f, bloom_hash(L, 2, 2)));
+    return 1;
 }
 
-#define BITARRAY_AT_TYPE(TYPE) \
-    static int at_ ## TYPE(lua_State *L) \
+static void bloom_visit_add(lua_State *L, BitarrayBloom *f, uint64_t h, size_t pos)
+{
+    (void)L;
+    (void)pos;
+    bitarray_bloom_add(f, h);
+}
+
+static void bloom_visit_contains(lua_State *L, BitarrayBloom *f, uint64_t h, size_t pos)
+{
+    lua_pushboolean(L, bitarray_bloom_contains(f, h));
+    lua_rawseti(L, 3, (int)pos);
+}
+
+/**
+ * <i>Mutates the filter.</i> <br />
+ * Adds every key of the sequence tbl, in one call.
+ * @function add_many
+ * @tparam table tbl sequence of strings or numbers
+ * @treturn Bloom the original filter reference
+ */
+BITARRAY_API static int bloom_add_many(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    lua_settop(L, 2);
+    bloom_each(L, f, bloom_visit_add);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Tests every key of the sequence tbl, in one call.
+ * @function contains_many
+ * @tparam table tbl sequence of strings or numbers
+ * @treturn {boolean,...} contains() of every key, in the same order
+ * @usage
+ * local found = seen:contains_many({ 'alice', 'bob' })  -- { true, false }
+ */
+BITARRAY_API static int bloom_contains_many(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    lua_settop(L, 2);
+    lua_createtable(L, (int)rawlen(L, 2), 0);
+    bloom_each(L, f, bloom_visit_contains);
+    return 1;
+}
+
+/* binary operations of filters, like band and bor of Bitarray */
+#define BITARRAY_BLOOM_BIOP(NAME, KERNEL) \
+    static int NAME(lua_State *L) \
     { \
-        Bitarray *ba = checkbitarray(L, 1); \
-        size_t i = checkopt_index(L, ba, 2); \
-        size_t tgt = sizeof(TYPE) * CHAR_BIT; \
-        luaL_argcheck(L, ba->size - i + 1 > tgt, 2, \
-            "too few bits to construct this type"); \
-        \
-        TYPE res = 0; \
-        for (size_t j = i, k = 0; k < tgt; ++j, ++k) { \
-            WORD mask; \
-            WORD *word = bitarray_get_bit_access(ba, j, &mask); \
-            TYPE maskt = (TYPE)1 << (TYPE)(tgt-k-1); \
-            res = (*word & mask) ? (res | maskt) : (res & ~maskt); \
-        } \
-        lua_pushinteger(L, (lua_Integer)res); \
+        BitarrayBloom *f = checkbloom(L, 1); \
+        BitarrayBloom *o = checkbloom(L, 2); \
+        luaL_argcheck(L, f->nblocks == o->nblocks && f->k == o->k, 2, \
+            "filters differ in size or hash functions"); \
+        BitarrayBloom *r = _l_newbloom(L, f->bits.size, f->k); \
+        if (r == NULL) \
+            return 0; \
+        bitarray_par_binary(bitarray_kernels.KERNEL, r->bits.values, \
+            f->bits.values, o->bits.values, WORDS_FOR_BITS(f->bits.size)); \
         return 1; \
     }
 
-/** 
- * <i>Does not mutate the array.</i> <br />
- * Converts the contents starting at index i to an uint8 (uchar) integer.
- * The array should be big enough to hold bits required to construct the
- * type.
- * The leftmost bit corresponds to the most significant digit of the number
- * and the last bit corresponds to the least significant digit (big endian).
- * @function at_uint8
- * @tparam[opt] integer i default to 1
- * @treturn integer
- * @usage
- * local a = Bitarray.new(10):set(2, 1):set(3, 1):set(4, 1):set(5, 1):set(7, 1)
- * print(a) -- Bitarray[0,1,1,1,1,0,1,0,0,0]
- * a:at_uint8(2)   -- intepreted as 11110100, which is 244
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Creates the union of two filters of the same size and number of hash
+ * functions: it contains every key either of them contains. <br />
+ * Metamethod __bor is overloaded with this method (Lua 5.3+).
+ * @function bor
+ * @tparam Bloom other
+ * @treturn Bloom|nil the newly created filter if successful
  */
-BITARRAY_API BITARRAY_AT_TYPE(uint8_t)
+BITARRAY_API BITARRAY_BLOOM_BIOP(bloom_bor, or_)
 
-/** 
- * <i>Does not mutate the array.</i> <br />
- * Converts the contents starting at index i to an uint16 integer.
- * @see at_uint8
- * @function at_uint16
- * @tparam[opt] integer i
- * @treturn integer
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Creates the intersection of two filters of the same size and number of
+ * hash functions. It contains every key both of them contain, and may report
+ * more false positives than a filter built from the common keys alone. <br />
+ * Metamethod __band is overloaded with this method (Lua 5.3+).
+ * @function band
+ * @tparam Bloom other
+ * @treturn Bloom|nil the newly created filter if successful
  */
-BITARRAY_API BITARRAY_AT_TYPE(uint16_t)
+BITARRAY_API BITARRAY_BLOOM_BIOP(bloom_band, and_)
 
-/** 
- * <i>Does not mutate the array.</i> <br />
- * Converts the contents starting at index i to an uint32 integer.
- * @see at_uint8
- * @function at_uint32
- * @tparam[opt] integer i
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Returns the fraction of bits set, and from it an estimate of the number of
+ * distinct keys added, -m / k * ln(1 - ratio). The false positive rate is
+ * about ratio ^ k.
+ * @function fill_ratio
+ * @treturn number the fraction of bits set
+ * @treturn number estimated number of keys, inf if every bit is set
+ */
+BITARRAY_API static int bloom_fill_ratio(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    double m = (double)f->bits.size;
+    double ratio = (double)bitarray_par_popcount(f->bits.values,
+        WORDS_FOR_BITS(f->bits.size)) / m;
+    lua_pushnumber(L, (lua_Number)ratio);
+    lua_pushnumber(L, (lua_Number)(-m / (double)f->k * log(1.0 - ratio)));
+    return 2;
+}
+
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Returns the number of bits of the filter, m rounded up to a multiple of
+ * 512. <br />
+ * Metamethod __len is overloaded with this method.
+ * @function len
  * @treturn integer
  */
-BITARRAY_API BITARRAY_AT_TYPE(uint32_t)
+BITARRAY_API static int bloom_len(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    lua_pushinteger(L, (lua_Integer)f->bits.size);
+    return 1;
+}
 
-/** 
- * <i>Does not mutate the array.</i> <br />
- * Converts the contents starting at index i to an uint64 integer.
- * @see at_uint8
- * @function at_uint64
- * @tparam[opt] integer i
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Returns the number of hash functions.
+ * @function hashes
  * @treturn integer
- * @usage
- * -- lua5.3 added support for displaying and manipulating unsigned integers,
- * -- prior to that this function may not work as intended always
- * local a = Bitarray.new(64):fill(true)
- * string.format('%u', a:at_uint64()) -- 18446744073709551615
  */
-BITARRAY_API BITARRAY_AT_TYPE(uint64_t)
+BITARRAY_API static int bloom_hashes(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    lua_pushinteger(L, (lua_Integer)f->k);
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Creates a Bitarray holding a copy of the bits of the filter.
+ * @function to_bitarray
+ * @treturn Bitarray|nil the newly created bit array if successful
+ */
+BITARRAY_API static int bloom_to_bitarray(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    if (_l_new(L, f->bits.size) == 0)
+        return 0;
+    Bitarray *ba = (Bitarray *)lua_touserdata(L, -1);
+    bitarray_par_copy(ba->values, f->bits.values, WORDS_FOR_BITS(f->bits.size));
+    return 1;
+}
+
+/**
+ * <i>Does not mutate the filter.</i> <br />
+ * Returns the string representation for the filter. <br />
+ * Metamethod __tostring is overloaded with this method.
+ * @function tostring
+ * @treturn string
+ * @usage
+ * print(Bitarray.bloom(1000, 3))  -- Bloom[m=1024,k=3]
+ */
+BITARRAY_API static int bloom_tostring(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    lua_pushliteral(L, "Bloom[m=");
+    pushsize(L, f->bits.size);
+    lua_pushfstring(L, ",k=%d]", (int)f->k);
+    lua_concat(L, 3);
+    return 1;
+}
 
-#undef BITARRAY_AT_TYPE
+/* finalizer for bloom filter */
+BITARRAY_API static int bloom_gc(lua_State *L)
+{
+    BitarrayBloom *f = checkbloom(L, 1);
+    bitarray_invalidate(&f->bits);
+    return 0;
+}
 
-#define BITARRAY_FROM_TYPE(TYPE) \
-    static int from_ ## TYPE(lua_State *L) \
-    { \
-        Bitarray *ba = checkbitarray(L, 1); \
-        TYPE src = (TYPE)luaL_checkinteger(L, 2); \
-        size_t i = checkopt_index(L, ba, 3); \
-        size_t tgt = sizeof(TYPE) * CHAR_BIT; \
-        luaL_argcheck(L, ba->size - i + 1 > tgt, 3, \
-            "too few bits to contain this type"); \
-        \
-        for (size_t j = i, k = 0; k < tgt; ++j, ++k) { \
-            TYPE maskt = (TYPE)1 << (TYPE)(tgt-k-1); \
-            int b = !!(src & maskt); \
-            bitarray_set_bit(ba, j, b); \
-        } \
-        lua_pushvalue(L, 1); \
-        return 1; \
+/**
+ * Lazy bitwise expression over arrays of the same size, created by
+ * Bitarray.expr. Combining expressions only records the operators, nothing
+ * is computed until eval or count, which go over the arrays once, in cache
+ * sized blocks, without allocating any intermediate array. Expressions keep
+ * their arrays alive and read their contents when evaluated. Operands of the
+ * methods may be arrays or expressions. <br />
+ * Metamethods __band, __bor, __bxor and __bnot are overloaded (Lua 5.3+), the
+ * expression has to be the left operand.
+ * @type Expr
+ */
+
+/* appends the leaves of the operand at index i to the table on the top */
+static void expr_append_leaves(lua_State *L, int i)
+{
+    size_t n = rawlen(L, -1);
+    if (testudata(L, i, BITARRAY_MT_EXPR) == NULL) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, (int)n + 1);
+        return;
     }
+    getuservalue(L, i);
+    size_t m = rawlen(L, -1);
+    for (size_t k = 1; k <= m; ++k) {
+        lua_rawgeti(L, -1, (int)k);
+        lua_rawseti(L, -3, (int)(n + k));
+    }
+    lua_pop(L, 1);
+}
 
-/** 
- * <i>Mutates the array.</i> <br />
- * Assign the array from index i from an uint8 (uchar) integer. The array should
- * be big enough to store the representation.
- * The leftmost bit corresponds to the most significant digit of the number
- * and the last bit corresponds to the least significant digit (big endian).
- * @function from_uint8
- * @tparam integer src the source integer to convert from
- * @tparam[opt] integer i the index in this array where the first bit gets
- * copied from src. default 1
- * @treturn Bitarray the original bit array reference
+/* pushes a new expression with the operators of a and b, the operands at
+   index ia and ib (0 for none), combined by op */
+static int expr_push(lua_State *L, const BitarrayExpr *a, int ia,
+    const BitarrayExpr *b, int ib, int op)
+{
+    BitarrayExpr *e = (BitarrayExpr *)lua_newuserdata(L, sizeof(BitarrayExpr));
+    e->ops = NULL;
+    luaL_getmetatable(L, BITARRAY_MT_EXPR);
+    lua_setmetatable(L, -2);
+    if (!(a == NULL ? bitarray_expr_leaf(e, ((Bitarray *)lua_touserdata(L, ia))->size)
+        : bitarray_expr_combine(e, a, b, op)))
+        return 0;
+    lua_newtable(L);
+    expr_append_leaves(L, ia);
+    if (ib != 0)
+        expr_append_leaves(L, ib);
+    setuservalue(L, -2);
+    return 1;
+}
+
+/* checks whether given argument is an expression */
+#define checkexpr(L, i) (BitarrayExpr *)luaL_checkudata(L, (i), BITARRAY_MT_EXPR)
+
+/* the expression or array at index i as an expression. a leaf for an array
+   is made in leaf and op */
+static const BitarrayExpr *checkoperand(lua_State *L, int i, BitarrayExpr *leaf,
+    BitarrayExprOp *op)
+{
+    BitarrayExpr *e = (BitarrayExpr *)testudata(L, i, BITARRAY_MT_EXPR);
+    if (e != NULL)
+        return e;
+    Bitarray *ba = (Bitarray *)testudata(L, i, BITARRAY_MT_1);
+    if (ba == NULL)
+        luaL_argerror(L, i, "Bitarray or Expr expected");
+    op->op = BITARRAY_EXPR_LEAF;
+    op->leaf = 0;
+    leaf->size = ba->size;
+    leaf->nleaves = 1;
+    leaf->depth = 1;
+    leaf->nops = 1;
+    leaf->ops = op;
+    return leaf;
+}
+
+/**
+ * Starts an expression with the array a. Both a and the arrays combined
+ * with it later are only read once the expression is evaluated.
+ * @function expr
+ * @tparam Bitarray a
+ * @treturn Expr
+ * @see Expr
  * @usage
- * local a = Bitarray.new(8):from_uint8(253)
- * print(a) -- Bitarray[1,1,1,1,1,1,0,1]
- * local b = Bitarray.new(16):from_uint8(255, 9)
- * print(b) -- Bitarray[0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1]
+ * local hits = Bitarray.expr(a):band(b):bor(Bitarray.expr(c):bxor(d):bandnot(e))
+ * print(hits:count())  -- ((a & b) | ((c ~ d) & ~e)):count(), in one pass
+ * local r = hits:eval()
  */
-BITARRAY_API BITARRAY_FROM_TYPE(uint8_t)
+BITARRAY_API static int l_expr(lua_State *L)
+{
+    checkbitarray(L, 1);
+    return expr_push(L, NULL, 1, NULL, 0, BITARRAY_EXPR_LEAF);
+}
 
-/** 
- * <i>Mutates the array.</i> <br />
- * Assign the array from index i from an uint16 integer. The array should
- * be big enough to store the representation.
- * @see from_uint8
- * @function from_uint16
- * @tparam integer src
- * @tparam[opt] integer i
- * @treturn Bitarray the original bit array reference
+static int expr_binop(lua_State *L, int op)
+{
+    BitarrayExpr *e = checkexpr(L, 1);
+    BitarrayExpr leaf;
+    BitarrayExprOp leafop;
+    const BitarrayExpr *o = checkoperand(L, 2, &leaf, &leafop);
+    luaL_argcheck(L, o->size == e->size, 2, "arrays are of different sizes");
+    return expr_push(L, e, 1, o, 2, op);
+}
+
+/**
+ * <i>Does not evaluate anything.</i> <br />
+ * Returns the expression self AND other.
+ * @function band
+ * @tparam Bitarray|Expr other
+ * @treturn Expr|nil the new expression if successful
  */
-BITARRAY_API BITARRAY_FROM_TYPE(uint16_t)
+BITARRAY_API static int expr_band(lua_State *L)
+{
+    return expr_binop(L, BITARRAY_EXPR_AND);
+}
 
-/** 
- * <i>Mutates the array.</i> <br />
- * Assign the array from index i from an uint32 integer. The array should
- * be big enough to store the representation.
- * @see from_uint8
- * @function from_uint32
- * @tparam integer src
- * @tparam[opt] integer i
- * @treturn Bitarray the original bit array reference
+/**
+ * <i>Does not evaluate anything.</i> <br />
+ * Returns the expression self OR other.
+ * @function bor
+ * @tparam Bitarray|Expr other
+ * @treturn Expr|nil the new expression if successful
  */
-BITARRAY_API BITARRAY_FROM_TYPE(uint32_t)
+BITARRAY_API static int expr_bor(lua_State *L)
+{
+    return expr_binop(L, BITARRAY_EXPR_OR);
+}
 
-/** 
- * <i>Mutates the array.</i> <br />
- * Assign the array from index i from an uint64 integer. The array should
- * be big enough to store the representation.
- * @see from_uint8
- * @see at_uint64
- * @function from_uint64
- * @tparam integer src
- * @tparam[opt] integer i
- * @treturn Bitarray the original bit array reference
+/**
+ * <i>Does not evaluate anything.</i> <br />
+ * Returns the expression self XOR other.
+ * @function bxor
+ * @tparam Bitarray|Expr other
+ * @treturn Expr|nil the new expression if successful
  */
-BITARRAY_API BITARRAY_FROM_TYPE(uint64_t)
+BITARRAY_API static int expr_bxor(lua_State *L)
+{
+    return expr_binop(L, BITARRAY_EXPR_XOR);
+}
 
-#undef BITARRAY_FROM_TYPE
+/**
+ * <i>Does not evaluate anything.</i> <br />
+ * Returns the expression self AND NOT other.
+ * @function bandnot
+ * @tparam Bitarray|Expr other
+ * @treturn Expr|nil the new expression if successful
+ */
+BITARRAY_API static int expr_bandnot(lua_State *L)
+{
+    return expr_binop(L, BITARRAY_EXPR_ANDNOT);
+}
 
 /**
- * <i>Mutates the array.</i> <br />
- * Copy the content from bitarray src to the operand. The array's ith, i+1th,
- * ... bit will be the bits from src starting from 1st to the last. The array
- * needs to be big enough to hold the data.
- * @function from_bitarray
- * @tparam Bitarray src
- * @tparam[opt] integer i the index in this array where the first bit gets
- * copied from src. default 1
- * @treturn Bitarray the original bit array reference
- * @usage
- * local a = Bitarray.new(10)
- *  :from_bitarray(Bitarray.new(5):fill(true):set(3, false), 6)
- * print(a) -- Bitarray[0,0,0,0,0,1,1,0,1,1]
+ * <i>Does not evaluate anything.</i> <br />
+ * Returns the expression NOT self.
+ * @function bnot
+ * @treturn Expr|nil the new expression if successful
  */
-BITARRAY_API static int from_bitarray(lua_State *L)
+BITARRAY_API static int expr_bnot(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    Bitarray *src = checkbitarray(L, 2);
-    size_t i = checkopt_index(L, ba, 3);
-    luaL_argcheck(L, ba->size - i + 1 > src->size, 3, "not enough space");
+    BitarrayExpr *e = checkexpr(L, 1);
+    return expr_push(L, e, 1, NULL, 0, BITARRAY_EXPR_NOT);
+}
 
-    bitarray_copyvalues2(src, ba, 0, src->size, i);
-    lua_pushvalue(L, 1);
-    return 1;
+/* evaluates the expression at index 1 into d, or counts it if d is NULL.
+   returns 0 if there is no memory for it */
+static int expr_run(lua_State *L, WORD *d, size_t *count)
+{
+    BitarrayExpr *e = checkexpr(L, 1);
+    const WORD **leaves = (const WORD **)lua_newuserdata(L,
+        e->nleaves * sizeof(WORD *));
+    getuservalue(L, 1);
+    for (size_t i = 0; i < e->nleaves; ++i) {
+        lua_rawgeti(L, -1, (int)i + 1);
+        Bitarray *ba = (Bitarray *)lua_touserdata(L, -1);
+        if (ba->size != e->size)
+            luaL_error(L, "an array of the expression was resized");
+        leaves[i] = ba->values;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return bitarray_expr_eval(e, leaves, d, count);
 }
 
 /**
- * <i>Mutates the array.</i> <br />
- * Copy the content from a binary string to the operand. Given the string
- * consisting of only 0 and 1's, the array's ith, i+1th, ... bit will be
- * the false/true values represented by chars in this string. The array
- * needs to be big enough to hold the data.
- * @function from_binarystring
- * @tparam string src
- * @tparam[opt] integer i the index in this array where the first bit gets
- * copied from src. default 1
- * @treturn Bitarray the original bit array reference
- * @usage
- * local a = Bitarray.new(12)
- *  :from_binarystring('001100'):from_binarystring('111111', 7)
- * print(a) -- Bitarray[0,0,1,1,0,0,1,1,1,1,1,1]
- * -- a:from_binarystring('10x0') error! invalid string
+ * Evaluates the expression into dst, or into a new array. dst may be one of
+ * the arrays of the expression.
+ * @function eval
+ * @tparam[opt] Bitarray dst array of the same size to store the result in
+ * @treturn Bitarray|nil dst or the newly created array if successful
  */
-BITARRAY_API static int from_binarystring(lua_State *L)
+BITARRAY_API static int expr_eval(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    size_t slen;
-    const char *s = luaL_checklstring(L, 2, &slen);
-    size_t i = checkopt_index(L, ba, 3);
-
-    for (size_t j = 0; j < slen; ++j) {
-        if (s[j] != '1' && s[j] != '0')
-            luaL_argerror(L, 2, "invalid binary string");
+    BitarrayExpr *e = checkexpr(L, 1);
+    Bitarray *d;
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        if (_l_new(L, e->size) == 0)
+            return 0;
+        d = (Bitarray *)lua_touserdata(L, 2);
+    } else {
+        d = checkbitarray_mut(L, 2);
+        luaL_argcheck(L, d->size == e->size, 2, "arrays are of different sizes");
+        lua_settop(L, 2);
     }
-    luaL_argcheck(L, ba->size - i + 1 > slen, 3, "not enough space");
+    if (expr_run(L, d->values, NULL) == 0)
+        return 0;
+    bitarray_clear_tail(d);
+    return 1;
+}
 
-    for (size_t j = 0; j < slen; ++j)
-        bitarray_set_bit(ba, i + j, s[j] == '1');
-    lua_pushvalue(L, 1);
+/**
+ * Counts the 1 bits of the result of the expression, without storing it.
+ * @function count
+ * @treturn integer|nil the count if successful
+ */
+BITARRAY_API static int expr_count(lua_State *L)
+{
+    size_t c;
+    if (expr_run(L, NULL, &c) == 0)
+        return 0;
+    lua_pushinteger(L, (lua_Integer)c);
     return 1;
 }
 
 /**
- * <i>Does not mutate the array.</i> <br />
- * Returns the string representation for the array. <br />
- * Metamethod __tostring is overloaded with this method so it can be implicitly
- * called if string is needed. The full array is not displayed if it is too long.
+ * Returns the size of the arrays of the expression. <br />
+ * Metamethod __len is overloaded with this method.
+ * @function len
+ * @treturn integer
+ */
+BITARRAY_API static int expr_len(lua_State *L)
+{
+    BitarrayExpr *e = checkexpr(L, 1);
+    lua_pushinteger(L, (lua_Integer)e->size);
+    return 1;
+}
+
+/**
+ * Returns the string representation for the expression, its size and the
+ * number of arrays it reads. <br />
+ * Metamethod __tostring is overloaded with this method.
  * @function tostring
  * @treturn string
  * @usage
- * local a = Bitarray.new(8):set(8, true)
- * print(a)
- * -- Bitarray[0,0,0,0,0,0,0,1]
- * a:resize(65)
- * print(a)
- * -- Bitarray[...]
+ * print(Bitarray.expr(a):band(b))  -- Expr[m=100,arrays=2]
  */
-BITARRAY_API static int tostring(lua_State *L)
+BITARRAY_API static int expr_tostring(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    luaL_Buffer buf;
-    luaL_buffinit(L, &buf);
-    luaL_addstring(&buf, "Bitarray[");
-    if (ba->size > (size_t)64) {
-        luaL_addstring(&buf, "...]");
-        goto push;
-    }
-    for (size_t i = 0; i < ba->size-1; ++i) {
-        luaL_addstring(&buf, bitarray_get_bit(ba, i) ? "1," : "0,");
-    }
-    /* size cannot be 0 in this context */
-    luaL_addstring(&buf, bitarray_get_bit(ba, ba->size-1) ? "1]" : "0]");
-push:
-    luaL_addvalue(&buf);
-    luaL_pushresult(&buf);
+    BitarrayExpr *e = checkexpr(L, 1);
+    lua_pushliteral(L, "Expr[m=");
+    pushsize(L, e->size);
+    lua_pushliteral(L, ",arrays=");
+    pushsize(L, e->nleaves);
+    lua_pushliteral(L, "]");
+    lua_concat(L, 5);
     return 1;
 }
 
-/* finalizer for bitarray */
-BITARRAY_API static int gc(lua_State *L)
+/* finalizer for expression */
+BITARRAY_API static int expr_gc(lua_State *L)
 {
-    Bitarray *ba = checkbitarray(L, 1);
-    bitarray_invalidate(ba);
+    BitarrayExpr *e = checkexpr(L, 1);
+    bitarray_expr_free(e);
     return 0;
 }
 
-/* actual __index, if param if number it returns result of get(), otherwise
-   looks up for fields */
-BITARRAY_API static int get(lua_State *L)
-{
-#if LUA_VERSION_NUM >= 503
-    if (lua_isinteger(L, 2))
-#else
-    if (lua_isnumber(L, 2))
-#endif
-        return getbit(L);
-    luaL_getmetatable(L, BITARRAY_MT_1);
-    lua_pushvalue(L, 2);
-    lua_rawget(L, -2);
-    return 1;
-}
-
 static const struct luaL_Reg bitarraylib_f[] =
 {
     { "new", l_new },
     { "copyfrom", l_copyfrom },
+    { "from_bytes", l_from_bytes },
+    { "load", l_load },
+    { "read", l_read },
+    { "decompress", l_decompress },
+    { "ewah_and", l_ewah_and },
+    { "ewah_or", l_ewah_or },
+    { "ewah_xor", l_ewah_xor },
+    { "set_threads", l_set_threads },
+    { "set_parallel_threshold", l_set_parallel_threshold },
+    { "memstats", l_memstats },
+    { "mmap", l_mmap },
+    { "attach", l_attach },
+    { "sparse", l_sparse },
+    { "bloom", l_bloom },
+    { "expr", l_expr },
+    { "bnot_into", bnot_into },
+    { "band_into", band_into },
+    { "bor_into", bor_into },
+    { "bxor_into", bxor_into },
+    { "bandnot_into", bandnot_into },
+    { "and_all", l_and_all },
+    { "or_all", l_or_all },
+    { "xor_all", l_xor_all },
+    { "at_least", l_at_least },
     { NULL, NULL }
 };
 
@@ -767,30 +3446,65 @@ static const struct luaL_Reg bitarraylib_m1[] =
     { "at", getbit },
     { "set", setbit },
     { "len", len },
+    { "count", count },
+    { "rank", rank },
+    { "select", selectbit },
+    { "find_first", find_first },
+    { "find_next", find_next },
+    { "find_prev", find_prev },
+    { "ones", ones },
     { "fill", fill },
     { "flip", flip },
+    { "fill_range", fill_range },
+    { "flip_range", flip_range },
+    { "count_range", count_range },
+    { "set_many", set_many },
+    { "get_many", get_many },
     { "equal", equal },
     { "concat", concat },
     { "bnot", bnot },
     { "band", band },
     { "bor", bor },
     { "bxor", bxor },
+    { "inot", inot },
+    { "iand", iand },
+    { "ior", ior },
+    { "ixor", ixor },
+    { "iandnot", iandnot },
     { "shiftleft", shl },
     { "shiftright", shr },
+    { "shiftleft_inplace", shl_inplace },
+    { "shiftright_inplace", shr_inplace },
     { "resize", resize },
+    { "sync", syncmap },
+    { "share", share },
+    { "test_and_set", test_and_set },
+    { "test_and_clear", test_and_clear },
+    { "fetch_or_word", fetch_or_word },
+    { "count_relaxed", count_relaxed },
     { "reverse", reverse },
     { "slice", slice },
+    { "view", view },
+    { "move", move },
     { "rep", rep },
     { "at_uint8", at_uint8_t },
     { "at_uint16", at_uint16_t },
     { "at_uint32", at_uint32_t },
     { "at_uint64", at_uint64_t },
+    { "get_bits", get_bits },
+    { "set_bits", set_bits },
     { "from_bitarray", from_bitarray },
     { "from_binarystring", from_binarystring },
+    { "to_binarystring", to_binarystring },
     { "from_uint8", from_uint8_t },
     { "from_uint16", from_uint16_t },
     { "from_uint32", from_uint32_t },
     { "from_uint64", from_uint64_t },
+    { "to_bytes", to_bytes },
+    { "to_sparse", to_sparse },
+    { "dump", dump },
+    { "save", save },
+    { "compress", compress },
     { "tostring", tostring },
     { "__index", get },
     { "__newindex", setbit },
@@ -810,8 +3524,141 @@ static const struct luaL_Reg bitarraylib_m1[] =
     { NULL, NULL }
 };
 
+static const struct luaL_Reg bitarraylib_sparse[] =
+{
+    { "at", sparse_getbit },
+    { "set", sparse_setbit },
+    { "len", sparse_len },
+    { "count", sparse_count },
+    { "equal", sparse_equal },
+    { "band", sparse_band },
+    { "bor", sparse_bor },
+    { "bxor", sparse_bxor },
+    { "optimize", sparse_optimize },
+    { "containers", sparse_containers },
+    { "to_bitarray", sparse_to_bitarray },
+    { "tostring", sparse_tostring },
+    { "__index", sparse_get },
+    { "__newindex", sparse_setbit },
+    { "__len", sparse_len },
+    { "__eq", sparse_equal },
+#if (defined(LUA_VERSION_NUM) && (LUA_VERSION_NUM >= 503))
+    { "__band", sparse_band },
+    { "__bor", sparse_bor },
+    { "__bxor", sparse_bxor },
+#endif
+    { "__gc", sparse_gc },
+    { "__tostring", sparse_tostring },
+    { NULL, NULL }
+};
+
+static const struct luaL_Reg bitarraylib_bloom[] =
+{
+    { "add", bloom_add },
+    { "contains", bloom_contains },
+    { "add_many", bloom_add_many },
+    { "contains_many", bloom_contains_many },
+    { "bor", bloom_bor },
+    { "band", bloom_band },
+    { "fill_ratio", bloom_fill_ratio },
+    { "len", bloom_len },
+    { "hashes", bloom_hashes },
+    { "to_bitarray", bloom_to_bitarray },
+    { "tostring", bloom_tostring },
+    { "__len", bloom_len },
+#if (defined(LUA_VERSION_NUM) && (LUA_VERSION_NUM >= 503))
+    { "__bor", bloom_bor },
+    { "__band", bloom_band },
+#endif
+    { "__gc", bloom_gc },
+    { "__tostring", bloom_tostring },
+    { NULL, NULL }
+};
+
+static const struct luaL_Reg bitarraylib_expr[] =
+{
+    { "band", expr_band },
+    { "bor", expr_bor },
+    { "bxor", expr_bxor },
+    { "bandnot", expr_bandnot },
+    { "bnot", expr_bnot },
+    { "eval", expr_eval },
+    { "count", expr_count },
+    { "len", expr_len },
+    { "tostring", expr_tostring },
+    { "__len", expr_len },
+#if (defined(LUA_VERSION_NUM) && (LUA_VERSION_NUM >= 503))
+    { "__band", expr_band },
+    { "__bor", expr_bor },
+    { "__bxor", expr_bxor },
+    { "__bnot", expr_bnot },
+#endif
+    { "__gc", expr_gc },
+    { "__tostring", expr_tostring },
+    { NULL, NULL }
+};
+
+/* bitarray_kernels and the tables behind them are filled in by the first
+   state to load the library. states on other threads may be running the
+   kernels already, so later loads must not write them again */
+#ifdef BITARRAY_HAVE_THREADS
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void)
+{
+    pthread_once(&kernels_once, bitarray_select_kernels);
+}
+#else
+static void select_kernels(void)
+{
+    static int selected = 0;
+    if (!selected) {
+        bitarray_select_kernels();
+        selected = 1;
+    }
+}
+#endif
+
 BITARRAY_MAIN int luaopen_bitarray(lua_State *L)
 {
+    /* released when the state closes, which stops the pool with the last
+       state so that it does not outlive the library */
+    lua_newuserdata(L, 1);
+    lua_newtable(L);
+    lua_pushcfunction(L, pool_release);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "cleoold.lua.bitarray_pool");
+    bitarray_pool_use(1);
+
+    luaL_newmetatable(L, BITARRAY_MT_SPARSE);
+#if LUA_VERSION_NUM <= 501
+    luaL_register(L, NULL, bitarraylib_sparse);
+#else
+    luaL_setfuncs(L, bitarraylib_sparse, 0);
+#endif
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, BITARRAY_MT_BLOOM);
+#if LUA_VERSION_NUM <= 501
+    luaL_register(L, NULL, bitarraylib_bloom);
+#else
+    luaL_setfuncs(L, bitarraylib_bloom, 0);
+#endif
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, BITARRAY_MT_EXPR);
+#if LUA_VERSION_NUM <= 501
+    luaL_register(L, NULL, bitarraylib_expr);
+#else
+    luaL_setfuncs(L, bitarraylib_expr, 0);
+#endif
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
     luaL_newmetatable(L, BITARRAY_MT_1);
 
 #ifndef LUA_VERSION_NUM
@@ -828,6 +3675,9 @@ BITARRAY_MAIN int luaopen_bitarray(lua_State *L)
     lua_setfield(L, -2, "__version");
     lua_pushinteger(L, BITARRAY_BLOCK_SIZE);
     lua_setfield(L, -2, "_blocksize");
+    select_kernels();
+    lua_pushstring(L, bitarray_kernels.name);
+    lua_setfield(L, -2, "_kernel");
 
     return 1;
 }
@@ -0,0 +1,192 @@
+/* blocked bloom filter on Bitarray storage. the m bits are cut into blocks
+   of 512 bits, one cache line, and a key only ever touches the k bits it
+   picks inside a single block: one hash of the key chooses the block and
+   gives the two halves x and y of a double hashing sequence x + i * y,
+   i < k, taken mod 512. y is odd, so the k positions are distinct. keys are
+   hashed with wyhash (Wang Yi, public domain), reading bytes in little endian
+   order so that filters come out the same on every host
+   note all indices start with 0 in this file */
+#pragma once
+
+#include <math.h>
+
+#include "bitarray_impl.h"
+
+#define BITARRAY_BLOOM_BLOCK_BITS  512
+#define BITARRAY_BLOOM_BLOCK_WORDS (BITARRAY_BLOOM_BLOCK_BITS / BITS_PER_WORD)
+/* alignment of the words, so that every block is exactly one cache line */
+#define BITARRAY_BLOOM_ALIGN       64
+/* most hash functions a filter can use */
+#define BITARRAY_BLOOM_MAX_K       64
+
+typedef struct BitarrayBloom
+{
+    Bitarray bits; /* a whole number of blocks */
+    size_t nblocks;
+    size_t k;
+} BitarrayBloom;
+
+static const uint64_t bitarray_wyp[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+/* 64 x 64 -> 128 bit multiplication, low half to *a and high half to *b */
+static void bitarray_wymum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t bitarray_wymix(uint64_t a, uint64_t b)
+{
+    bitarray_wymum(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t bitarray_wyr8(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int k = 7; k >= 0; --k)
+        v = v << 8 | p[k];
+    return v;
+}
+
+static uint64_t bitarray_wyr4(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+        | (uint64_t)p[3] << 24;
+}
+
+static uint64_t bitarray_wyhash(const void *key, size_t len, uint64_t seed)
+{
+    const uint64_t *s = bitarray_wyp;
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t a, b;
+    seed ^= bitarray_wymix(seed ^ s[0], s[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = bitarray_wyr4(p) << 32 | bitarray_wyr4(p + ((len >> 3) << 2));
+            b = bitarray_wyr4(p + len - 4) << 32
+                | bitarray_wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = bitarray_wymix(bitarray_wyr8(p) ^ s[1], bitarray_wyr8(p + 8) ^ seed);
+                see1 = bitarray_wymix(bitarray_wyr8(p + 16) ^ s[2], bitarray_wyr8(p + 24) ^ see1);
+                see2 = bitarray_wymix(bitarray_wyr8(p + 32) ^ s[3], bitarray_wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = bitarray_wymix(bitarray_wyr8(p) ^ s[1], bitarray_wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = bitarray_wyr8(p + i - 16);
+        b = bitarray_wyr8(p + i - 8);
+    }
+    a ^= s[1];
+    b ^= seed;
+    bitarray_wymum(&a, &b);
+    return bitarray_wymix(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+/* bits of a filter of at least m bits, rounded up to whole blocks */
+static size_t bitarray_bloom_bits(size_t m)
+{
+    return (m / BITARRAY_BLOOM_BLOCK_BITS + (m % BITARRAY_BLOOM_BLOCK_BITS != 0))
+        * BITARRAY_BLOOM_BLOCK_BITS;
+}
+
+/* first BITARRAY_BLOOM_ALIGN aligned address at or after p. room for the
+   words of a filter needs BITARRAY_BLOOM_ALIGN - 1 bytes more to fit it */
+static WORD *bitarray_bloom_align(void *p)
+{
+    uintptr_t a = (uintptr_t)p;
+    return (WORD *)(a + (BITARRAY_BLOOM_ALIGN - a % BITARRAY_BLOOM_ALIGN)
+        % BITARRAY_BLOOM_ALIGN);
+}
+
+/* an empty filter of nbits bits, from bitarray_bloom_bits, using k hash
+   functions. words as for bitarray_validate, and BITARRAY_BLOOM_ALIGN
+   aligned. returns 0 if there is no memory, or if the words are not
+   aligned */
+static int bitarray_bloom_init(BitarrayBloom *f, size_t nbits, size_t k, WORD *words)
+{
+    f->nblocks = nbits / BITARRAY_BLOOM_BLOCK_BITS;
+    f->k = k;
+    if (bitarray_validate(&f->bits, nbits, words) == 0)
+        return 0;
+    if ((uintptr_t)f->bits.values % BITARRAY_BLOOM_ALIGN != 0) {
+        bitarray_invalidate(&f->bits);
+        return 0;
+    }
+    return 1;
+}
+
+/* first word of the block hash h goes to */
+static WORD *bitarray_bloom_block(const BitarrayBloom *f, uint64_t h)
+{
+    /* the high half of h scaled to the block count, the low half is left
+       for the positions */
+    uint64_t hi = h >> 32, n = f->nblocks;
+    size_t b = n <= 0xFFFFFFFFu ? (size_t)(hi * n >> 32) : (size_t)(h % n);
+    return f->bits.values + b * BITARRAY_BLOOM_BLOCK_WORDS;
+}
+
+static void bitarray_bloom_add(BitarrayBloom *f, uint64_t h)
+{
+    WORD *w = bitarray_bloom_block(f, h);
+    uint64_t g = bitarray_wymix(h, bitarray_wyp[2]);
+    uint32_t x = (uint32_t)g, y = (uint32_t)(g >> 32) | 1;
+    for (size_t i = 0; i < f->k; ++i, x += y) {
+        size_t p = x % BITARRAY_BLOOM_BLOCK_BITS;
+        w[I_WORD(p)] |= I_BIT(p);
+    }
+}
+
+static int bitarray_bloom_contains(const BitarrayBloom *f, uint64_t h)
+{
+    const WORD *w = bitarray_bloom_block(f, h);
+    uint64_t g = bitarray_wymix(h, bitarray_wyp[2]);
+    uint32_t x = (uint32_t)g, y = (uint32_t)(g >> 32) | 1;
+    for (size_t i = 0; i < f->k; ++i, x += y) {
+        size_t p = x % BITARRAY_BLOOM_BLOCK_BITS;
+        if (!(w[I_WORD(p)] & I_BIT(p)))
+            return 0;
+    }
+    return 1;
+}
+
+/* brings the block of h towards the cache ahead of an add or a lookup */
+static void bitarray_bloom_prefetch(const BitarrayBloom *f, uint64_t h)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(bitarray_bloom_block(f, h));
+#else
+    (void)f;
+    (void)h;
+#endif
+}
@@ -0,0 +1,452 @@
+/* compressed payloads for serialized arrays. both codecs work on the 64-bit
+   words of the bit stream, word k holding bits 64k to 64k + 63 from its least
+   significant bit up whatever the storage word size, stored little endian:
+   - rle: a sequence of tokens, each a LEB128 varint count << 2 | kind. kind 0
+     stands for count words of 0 bits, kind 1 for count words of 1 bits and
+     kind 2 for count literal words following the token
+   - ewah: the word-aligned hybrid of Lemire, Kaser and Aouiche. a marker word
+     holds the bit of a run of clean words in bit 0, the length of the run in
+     bits 1 to 32 and the number of literal words following it in bits 33 to
+     63. logical operations run on two such streams directly, a clean run
+     skipping as many words of the other stream in one step
+   note all indices start with 0 in this file */
+#pragma once
+
+#include "bitarray_impl.h"
+
+#define BITARRAY_EWAH_MAX_RUN  0xFFFFFFFFu
+#define BITARRAY_EWAH_MAX_LITS 0x7FFFFFFFu
+
+/* binary operations on ewah streams */
+enum { BITARRAY_EWAH_AND, BITARRAY_EWAH_OR, BITARRAY_EWAH_XOR };
+
+/* number of 64-bit words of the bit stream of n bits */
+static size_t bitarray_words64(size_t nbits)
+{
+    return nbits / 64 + (nbits % 64 != 0);
+}
+
+/* whether the 64-bit words of the bit stream of ba fit the storage it was
+   given. the decoders write that many, whatever a header claims */
+static int bitarray_words64_fit(const Bitarray *ba)
+{
+    return bitarray_size_fits(ba->size) && bitarray_words64(ba->size)
+        <= (WORDS_FOR_BITS(ba->size) * sizeof(WORD) + 7) / 8;
+}
+
+/* 64-bit word k of the bit stream of ba */
+static uint64_t bitarray_get_word64(const Bitarray *ba, size_t k)
+{
+#if BITARRAY_WORD_BITS == 64
+    return ba->values[k];
+#else
+    uint64_t v = ba->values[2 * k];
+    if (2 * k + 1 < WORDS_FOR_BITS(ba->size))
+        v |= (uint64_t)ba->values[2 * k + 1] << 32;
+    return v;
+#endif
+}
+
+static void bitarray_put_word64(Bitarray *ba, size_t k, uint64_t v)
+{
+#if BITARRAY_WORD_BITS == 64
+    ba->values[k] = v;
+#else
+    ba->values[2 * k] = (WORD)v;
+    if (2 * k + 1 < WORDS_FOR_BITS(ba->size))
+        ba->values[2 * k + 1] = (WORD)(v >> 32);
+#endif
+}
+
+/* sets count 64-bit words of the bit stream of ba from word k to bit */
+static void bitarray_fill_word64(Bitarray *ba, size_t k, size_t count, int bit)
+{
+    size_t per = 64 / BITS_PER_WORD, nwords = WORDS_FOR_BITS(ba->size);
+    size_t from = k * per, to = (k + count) * per;
+    if (to > nwords)
+        to = nwords;
+    memset(ba->values + from, bit ? 0xFF : 0, (to - from) * sizeof(WORD));
+}
+
+static uint64_t bitarray_get_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+#ifdef BITARRAY_LITTLE_ENDIAN
+    memcpy(&v, p, sizeof(v));
+#else
+    for (int k = 7; k >= 0; --k)
+        v = v << 8 | p[k];
+#endif
+    return v;
+}
+
+static void bitarray_put_le64(unsigned char *p, uint64_t v)
+{
+#ifdef BITARRAY_LITTLE_ENDIAN
+    memcpy(p, &v, sizeof(v));
+#else
+    for (int k = 0; k < 8; ++k)
+        p[k] = (unsigned char)(v >> (8 * k));
+#endif
+}
+
+/* growing output of an encoder. failed is set once it runs out of memory,
+   later writes are dropped */
+typedef struct BitarrayBytes
+{
+    unsigned char *p;
+    size_t n, cap;
+    int failed;
+} BitarrayBytes;
+
+/* room for extra more bytes at the end of b, NULL on failure */
+static unsigned char *bitarray_bytes_grow(BitarrayBytes *b, size_t extra)
+{
+    if (b->failed)
+        return NULL;
+    if (b->cap - b->n < extra) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap - b->n < extra)
+            cap *= 2;
+        unsigned char *p = (unsigned char *)realloc(b->p, cap);
+        if (p == NULL) {
+            b->failed = 1;
+            return NULL;
+        }
+        b->p = p;
+        b->cap = cap;
+    }
+    unsigned char *at = b->p + b->n;
+    b->n += extra;
+    return at;
+}
+
+static void bitarray_bytes_word64(BitarrayBytes *b, uint64_t v)
+{
+    unsigned char *at = bitarray_bytes_grow(b, 8);
+    if (at != NULL)
+        bitarray_put_le64(at, v);
+}
+
+static void bitarray_bytes_varint(BitarrayBytes *b, uint64_t v)
+{
+    unsigned char tmp[10];
+    size_t n = 0;
+    do {
+        tmp[n++] = (unsigned char)((v & 0x7F) | (v >= 0x80 ? 0x80 : 0));
+        v >>= 7;
+    } while (v != 0);
+    unsigned char *at = bitarray_bytes_grow(b, n);
+    if (at != NULL)
+        memcpy(at, tmp, n);
+}
+
+/* reads a varint from p[*pos] onwards, which must end before end. returns 0
+   if it does not */
+static int bitarray_read_varint(const unsigned char *p, size_t *pos, size_t end,
+    uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+        unsigned char c = p[(*pos)++];
+        *v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+/* appends the rle encoding of ba to out */
+static void bitarray_rle_encode(const Bitarray *ba, BitarrayBytes *out)
+{
+    size_t n = bitarray_words64(ba->size);
+    for (size_t k = 0; k < n; ) {
+        uint64_t v = bitarray_get_word64(ba, k);
+        size_t j = k + 1;
+        if (v == 0 || v == ~(uint64_t)0) {
+            while (j < n && bitarray_get_word64(ba, j) == v)
+                ++j;
+            bitarray_bytes_varint(out, (uint64_t)(j - k) << 2 | (v != 0));
+        } else {
+            for (; j < n; ++j) {
+                uint64_t w = bitarray_get_word64(ba, j);
+                if (w == 0 || w == ~(uint64_t)0)
+                    break;
+            }
+            bitarray_bytes_varint(out, (uint64_t)(j - k) << 2 | 2);
+            for (size_t i = k; i < j; ++i)
+                bitarray_bytes_word64(out, bitarray_get_word64(ba, i));
+        }
+        k = j;
+    }
+}
+
+/* fills ba from the n bytes of rle data at p. returns NULL on success, or
+   the problem */
+static const char *bitarray_rle_decode(Bitarray *ba, const unsigned char *p,
+    size_t n)
+{
+    size_t total = bitarray_words64(ba->size), k = 0, pos = 0;
+    if (!bitarray_words64_fit(ba))
+        return "array too large for this platform";
+    while (k < total) {
+        uint64_t t;
+        if (!bitarray_read_varint(p, &pos, n, &t))
+            return "corrupt data";
+        uint64_t count = t >> 2;
+        int kind = (int)(t & 3);
+        if (count == 0 || count > total - k || kind == 3)
+            return "corrupt data";
+        if (kind == 2) {
+            if (count > (n - pos) / 8)
+                return "corrupt data";
+            for (uint64_t i = 0; i < count; ++i, pos += 8)
+                bitarray_put_word64(ba, k + i, bitarray_get_le64(p + pos));
+        } else {
+            bitarray_fill_word64(ba, k, count, kind);
+        }
+        k += count;
+    }
+    if (pos != n)
+        return "corrupt data";
+    bitarray_clear_tail(ba);
+    return NULL;
+}
+
+/* builds an ewah stream, clean words are folded into the runs of markers */
+typedef struct BitarrayEwahWriter
+{
+    BitarrayBytes out;
+    size_t marker; /* offset of the open marker in out */
+    int bit;
+    uint64_t run, lits;
+} BitarrayEwahWriter;
+
+static void bitarray_ewah_flush(BitarrayEwahWriter *w)
+{
+    if (!w->out.failed)
+        bitarray_put_le64(w->out.p + w->marker,
+            (uint64_t)w->bit | w->run << 1 | w->lits << 33);
+}
+
+static void bitarray_ewah_marker(BitarrayEwahWriter *w)
+{
+    w->marker = w->out.n;
+    w->bit = 0;
+    w->run = w->lits = 0;
+    bitarray_bytes_grow(&w->out, 8);
+}
+
+static void bitarray_ewah_init(BitarrayEwahWriter *w)
+{
+    memset(&w->out, 0, sizeof(w->out));
+    bitarray_ewah_marker(w);
+}
+
+/* closes the stream, its bytes are left in w->out */
+static void bitarray_ewah_finish(BitarrayEwahWriter *w)
+{
+    bitarray_ewah_flush(w);
+}
+
+/* appends count clean words of bit */
+static void bitarray_ewah_clean(BitarrayEwahWriter *w, int bit, uint64_t count)
+{
+    while (count > 0) {
+        if (w->lits != 0 || (w->run != 0 && w->bit != bit)
+            || w->run == BITARRAY_EWAH_MAX_RUN) {
+            bitarray_ewah_flush(w);
+            bitarray_ewah_marker(w);
+        }
+        w->bit = bit;
+        uint64_t k = BITARRAY_EWAH_MAX_RUN - w->run;
+        if (k > count)
+            k = count;
+        w->run += k;
+        count -= k;
+    }
+}
+
+static void bitarray_ewah_literal(BitarrayEwahWriter *w, uint64_t v)
+{
+    if (v == 0 || v == ~(uint64_t)0) {
+        bitarray_ewah_clean(w, v != 0, 1);
+        return;
+    }
+    if (w->lits == BITARRAY_EWAH_MAX_LITS) {
+        bitarray_ewah_flush(w);
+        bitarray_ewah_marker(w);
+    }
+    ++w->lits;
+    bitarray_bytes_word64(&w->out, v);
+}
+
+/* appends the ewah encoding of ba to a fresh writer */
+static void bitarray_ewah_encode(const Bitarray *ba, BitarrayEwahWriter *w)
+{
+    size_t n = bitarray_words64(ba->size);
+    bitarray_ewah_init(w);
+    for (size_t k = 0; k < n; ++k)
+        bitarray_ewah_literal(w, bitarray_get_word64(ba, k));
+    bitarray_ewah_finish(w);
+}
+
+/* whether the n bytes at p are an ewah stream of exactly total words. only
+   the markers are visited */
+static int bitarray_ewah_check(const unsigned char *p, size_t n, size_t total)
+{
+    size_t k = 0, pos = 0;
+    if (n % 8 != 0)
+        return 0;
+    while (pos < n) {
+        uint64_t m = bitarray_get_le64(p + pos);
+        uint64_t run = m >> 1 & BITARRAY_EWAH_MAX_RUN, lits = m >> 33;
+        pos += 8;
+        if (lits > (n - pos) / 8 || run > total - k || lits > total - k - run)
+            return 0;
+        pos += lits * 8;
+        k += run + lits;
+    }
+    return k == total;
+}
+
+/* fills ba from the n bytes of ewah data at p. returns NULL on success, or
+   the problem */
+static const char *bitarray_ewah_decode(Bitarray *ba, const unsigned char *p,
+    size_t n)
+{
+    if (!bitarray_words64_fit(ba))
+        return "array too large for this platform";
+    if (!bitarray_ewah_check(p, n, bitarray_words64(ba->size)))
+        return "corrupt data";
+    for (size_t k = 0, pos = 0; pos < n; ) {
+        uint64_t m = bitarray_get_le64(p + pos);
+        uint64_t run = m >> 1 & BITARRAY_EWAH_MAX_RUN, lits = m >> 33;
+        pos += 8;
+        bitarray_fill_word64(ba, k, run, (int)(m & 1));
+        k += run;
+        for (uint64_t i = 0; i < lits; ++i, pos += 8)
+            bitarray_put_word64(ba, k++, bitarray_get_le64(p + pos));
+    }
+    bitarray_clear_tail(ba);
+    return NULL;
+}
+
+/* reads a checked ewah stream, the remainder of the current run and of the
+   literal words after it */
+typedef struct BitarrayEwahCursor
+{
+    const unsigned char *p;
+    size_t pos, n;
+    int bit;
+    uint64_t run, lits;
+} BitarrayEwahCursor;
+
+static void bitarray_ewah_cursor(BitarrayEwahCursor *c, const unsigned char *p,
+    size_t n)
+{
+    c->p = p;
+    c->pos = 0;
+    c->n = n;
+    c->run = c->lits = 0;
+    c->bit = 0;
+}
+
+/* moves on to the next marker once the current one is used up */
+static void bitarray_ewah_load(BitarrayEwahCursor *c)
+{
+    while (c->run == 0 && c->lits == 0 && c->pos < c->n) {
+        uint64_t m = bitarray_get_le64(c->p + c->pos);
+        c->pos += 8;
+        c->bit = (int)(m & 1);
+        c->run = m >> 1 & BITARRAY_EWAH_MAX_RUN;
+        c->lits = m >> 33;
+    }
+}
+
+static uint64_t bitarray_ewah_next(BitarrayEwahCursor *c)
+{
+    uint64_t v = bitarray_get_le64(c->p + c->pos);
+    c->pos += 8;
+    --c->lits;
+    return v;
+}
+
+static uint64_t bitarray_ewah_apply(int op, uint64_t a, uint64_t b)
+{
+    switch (op) {
+        case BITARRAY_EWAH_AND: return a & b;
+        case BITARRAY_EWAH_OR: return a | b;
+        default: return a ^ b;
+    }
+}
+
+/* writes x op y, two checked streams of total words each, to a fresh
+   writer */
+static void bitarray_ewah_op(BitarrayEwahWriter *w, BitarrayEwahCursor *x,
+    BitarrayEwahCursor *y, size_t total, int op)
+{
+    bitarray_ewah_init(w);
+    for (size_t k = 0; k < total; ) {
+        bitarray_ewah_load(x);
+        bitarray_ewah_load(y);
+        if (x->run != 0 && y->run != 0) {
+            uint64_t n = x->run < y->run ? x->run : y->run;
+            bitarray_ewah_clean(w,
+                (int)bitarray_ewah_apply(op, (uint64_t)x->bit, (uint64_t)y->bit), n);
+            x->run -= n;
+            y->run -= n;
+            k += n;
+        } else if (x->run != 0 || y->run != 0) {
+            /* a run against literal words */
+            BitarrayEwahCursor *c = x->run != 0 ? x : y, *o = x->run != 0 ? y : x;
+            uint64_t n = c->run < o->lits ? c->run : o->lits;
+            if ((op == BITARRAY_EWAH_AND && !c->bit)
+                || (op == BITARRAY_EWAH_OR && c->bit)) {
+                /* the result does not depend on the literals */
+                bitarray_ewah_clean(w, c->bit, n);
+                o->pos += n * 8;
+                o->lits -= n;
+            } else {
+                uint64_t flip = op == BITARRAY_EWAH_XOR && c->bit ? ~(uint64_t)0 : 0;
+                for (uint64_t i = 0; i < n; ++i)
+                    bitarray_ewah_literal(w, bitarray_ewah_next(o) ^ flip);
+            }
+            c->run -= n;
+            k += n;
+        } else {
+            uint64_t n = x->lits < y->lits ? x->lits : y->lits;
+            for (uint64_t i = 0; i < n; ++i)
+                bitarray_ewah_literal(w, bitarray_ewah_apply(op,
+                    bitarray_ewah_next(x), bitarray_ewah_next(y)));
+            k += n;
+        }
+    }
+    bitarray_ewah_finish(w);
+}
+
+/* fills h with the header of a payload of nbits compressed with codec */
+static void bitarray_codec_header(unsigned char *h, size_t nbits, int codec,
+    int crc)
+{
+    bitarray_header_write(h, nbits, crc);
+    h[5] |= (unsigned char)(codec << 1);
+    h[6] = 8;
+    h[7] = 0;
+}
+
+/* fills ba, sized for hd->nbits, from the n bytes of payload at p. returns
+   NULL on success, or the problem */
+static const char *bitarray_decode(Bitarray *ba, const unsigned char *p,
+    size_t n, const BitarrayHeader *hd)
+{
+    switch (hd->codec) {
+        case BITARRAY_CODEC_RLE: return bitarray_rle_decode(ba, p, n);
+        case BITARRAY_CODEC_EWAH: return bitarray_ewah_decode(ba, p, n);
+        default:
+            if (n != bitarray_payload_bytes(hd))
+                return "corrupt data";
+            bitarray_import(ba, p, hd);
+            return NULL;
+    }
+}
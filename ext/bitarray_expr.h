@@ -0,0 +1,345 @@
+/* fused evaluation of bitwise expressions over arrays of the same size, such
+   as (a & b) | (c ^ d) & ~e. an expression is a postfix program whose leaves
+   are arrays. it runs block by block: every BITARRAY_EXPR_BLOCK_WORDS words
+   go through the whole program while they are in cache, intermediate results
+   live in a small stack of block buffers, and only the final one is written
+   out, or just counted. large arrays are cut into parts over the worker pool
+   note all indices start with 0 in this file */
+#pragma once
+
+#include "bitarray_impl.h"
+
+/* words of a block, small enough for the buffers of a deep expression to
+   stay in the first level caches */
+#define BITARRAY_EXPR_BLOCK_WORDS 256
+
+enum
+{
+    BITARRAY_EXPR_LEAF,
+    BITARRAY_EXPR_NOT,
+    BITARRAY_EXPR_AND,
+    BITARRAY_EXPR_OR,
+    BITARRAY_EXPR_XOR,
+    BITARRAY_EXPR_ANDNOT
+};
+
+typedef struct BitarrayExprOp
+{
+    int op;
+    size_t leaf; /* which leaf BITARRAY_EXPR_LEAF pushes */
+} BitarrayExprOp;
+
+typedef struct BitarrayExpr
+{
+    size_t size;    /* bits of every leaf */
+    size_t nleaves;
+    size_t depth;   /* most values on the stack at once */
+    size_t nops;
+    BitarrayExprOp *ops;
+} BitarrayExpr;
+
+/* e = the array of nbits bits that will be leaf 0. returns 0 if there is
+   no memory */
+static int bitarray_expr_leaf(BitarrayExpr *e, size_t nbits)
+{
+    e->ops = (BitarrayExprOp *)malloc(sizeof(BitarrayExprOp));
+    if (e->ops == NULL)
+        return 0;
+    e->ops[0].op = BITARRAY_EXPR_LEAF;
+    e->ops[0].leaf = 0;
+    e->size = nbits;
+    e->nleaves = 1;
+    e->depth = 1;
+    e->nops = 1;
+    return 1;
+}
+
+/* e = a OP b, the leaves of b numbered after those of a. b may be NULL for
+   BITARRAY_EXPR_NOT. returns 0 if there is no memory */
+static int bitarray_expr_combine(BitarrayExpr *e, const BitarrayExpr *a,
+    const BitarrayExpr *b, int op)
+{
+    size_t nb = b != NULL ? b->nops : 0;
+    e->ops = (BitarrayExprOp *)malloc((a->nops + nb + 1) * sizeof(BitarrayExprOp));
+    if (e->ops == NULL)
+        return 0;
+    memcpy(e->ops, a->ops, a->nops * sizeof(BitarrayExprOp));
+    e->size = a->size;
+    e->nleaves = a->nleaves;
+    e->depth = a->depth;
+    e->nops = a->nops;
+    if (b != NULL) {
+        for (size_t i = 0; i < b->nops; ++i) {
+            e->ops[e->nops] = b->ops[i];
+            e->ops[e->nops++].leaf += a->nleaves;
+        }
+        e->nleaves += b->nleaves;
+        /* b runs with the value of a below it */
+        if (b->depth + 1 > e->depth)
+            e->depth = b->depth + 1;
+    }
+    e->ops[e->nops].op = op;
+    e->ops[e->nops++].leaf = 0;
+    return 1;
+}
+
+static void bitarray_expr_free(BitarrayExpr *e)
+{
+    free(e->ops);
+    e->ops = NULL;
+}
+
+/* one evaluation: leaves[i] holds the words of leaf i, d receives the result
+   or is NULL when it is only counted. every part has depth block buffers and
+   as many stack slots */
+typedef struct BitarrayExprRun
+{
+    const BitarrayExpr *e;
+    const WORD *const *leaves;
+    WORD *d;
+    WORD *buffers;
+    const WORD **stacks;
+} BitarrayExprRun;
+
+/* runs the program over words [from, from + n), returns the number of 1
+   bits of the result if it is counted */
+static size_t bitarray_expr_range(const BitarrayExprRun *r, size_t part,
+    size_t from, size_t n)
+{
+    const BitarrayExpr *e = r->e;
+    WORD *tmp = r->buffers + part * e->depth * BITARRAY_EXPR_BLOCK_WORDS;
+    const WORD **st = r->stacks + part * e->depth;
+    size_t nwords = WORDS_FOR_BITS(e->size), used = e->size % BITS_PER_WORD;
+    size_t c = 0;
+    for (size_t at = from; at < from + n; at += BITARRAY_EXPR_BLOCK_WORDS) {
+        size_t k = from + n - at < BITARRAY_EXPR_BLOCK_WORDS
+            ? from + n - at : BITARRAY_EXPR_BLOCK_WORDS;
+        size_t sp = 0;
+        for (size_t i = 0; i < e->nops; ++i) {
+            const BitarrayExprOp *o = &e->ops[i];
+            if (o->op == BITARRAY_EXPR_LEAF) {
+                st[sp++] = r->leaves[o->leaf] + at;
+                continue;
+            }
+            /* a value replaces its operands in the slot of the lowest one,
+               the last one goes straight to the destination */
+            size_t slot = o->op == BITARRAY_EXPR_NOT ? sp - 1 : sp - 2;
+            WORD *out = i + 1 == e->nops && r->d != NULL ? r->d + at
+                : tmp + slot * BITARRAY_EXPR_BLOCK_WORDS;
+            switch (o->op) {
+            case BITARRAY_EXPR_NOT:
+                bitarray_kernels.not_(out, st[slot], k);
+                break;
+            case BITARRAY_EXPR_AND:
+                bitarray_kernels.and_(out, st[slot], st[slot + 1], k);
+                break;
+            case BITARRAY_EXPR_OR:
+                bitarray_kernels.or_(out, st[slot], st[slot + 1], k);
+                break;
+            case BITARRAY_EXPR_XOR:
+                bitarray_kernels.xor_(out, st[slot], st[slot + 1], k);
+                break;
+            default:
+                bitarray_kernels.andnot(out, st[slot], st[slot + 1], k);
+                break;
+            }
+            st[slot] = out;
+            sp = slot + 1;
+        }
+        if (r->d == NULL) {
+            c += bitarray_kernels.popcount(st[0], k);
+            /* not sets the unused bits of the last word */
+            if (at + k == nwords && used != 0) {
+                WORD extra = st[0][k - 1] & ~(((WORD)1 << used) - 1);
+                c -= bitarray_kernels.popcount(&extra, 1);
+            }
+        } else if (st[0] != r->d + at) {
+            /* the program is a single leaf */
+            memmove(r->d + at, st[0], k * sizeof(WORD));
+        }
+    }
+    return c;
+}
+
+static void bitarray_task_expr(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    t->results[p] = bitarray_expr_range((const BitarrayExprRun *)t->arg, p, from, k);
+}
+
+/* evaluates e on leaves into d, whose unused bits are left for the caller to
+   clear, or counts the 1 bits of the result into *count if d is NULL.
+   returns 0 if there is no memory for the block buffers */
+static int bitarray_expr_eval(const BitarrayExpr *e, const WORD *const *leaves,
+    WORD *d, size_t *count)
+{
+    BitarrayTask t;
+    BitarrayExprRun r;
+    size_t nparts = bitarray_parts(WORDS_FOR_BITS(e->size));
+    t.n = WORDS_FOR_BITS(e->size);
+    t.arg = &r;
+    if (nparts == 1)
+        t.chunk = t.n;
+    else
+        nparts = bitarray_task_split(&t, nparts, d);
+    r.e = e;
+    r.leaves = leaves;
+    r.d = d;
+    r.buffers = (WORD *)malloc(nparts * e->depth * BITARRAY_EXPR_BLOCK_WORDS
+        * sizeof(WORD));
+    r.stacks = (const WORD **)malloc(nparts * e->depth * sizeof(WORD *));
+    if (r.buffers == NULL || r.stacks == NULL) {
+        free(r.buffers);
+        free((void *)r.stacks);
+        return 0;
+    }
+    if (nparts == 1)
+        t.results[0] = bitarray_expr_range(&r, 0, 0, t.n);
+    else
+        bitarray_pool_run(bitarray_task_expr, &t, nparts);
+    if (count != NULL) {
+        *count = 0;
+        for (size_t p = 0; p < nparts; ++p)
+            *count += t.results[p];
+    }
+    free(r.buffers);
+    free((void *)r.stacks);
+    return 1;
+}
+
+/* n-ary reductions of n >= 1 arrays of the same size into d: and, or and
+   xor of all of them, and whether at least k of them have a bit. every input
+   is read once and d written once. and, or and xor fold the inputs into a
+   block buffer with the kernels. at_least keeps a bit-sliced count of every
+   bit position of a word: plane j holds bit j of the counts. inputs are added
+   two at a time by a carry save adder into plane 0, its carry then ripples
+   into the planes above, and the planes are compared with k at the end */
+enum
+{
+    BITARRAY_REDUCE_AND,
+    BITARRAY_REDUCE_OR,
+    BITARRAY_REDUCE_XOR,
+    BITARRAY_REDUCE_AT_LEAST
+};
+
+typedef struct BitarrayReduce
+{
+    const WORD *const *in;
+    size_t n;
+    WORD *d;
+    int op;
+    size_t k;      /* for at_least, 1 <= k <= n */
+    WORD *buffers; /* a block per part, for and, or and xor */
+} BitarrayReduce;
+
+/* planes a count up to n takes */
+static size_t bitarray_count_planes(size_t n)
+{
+    size_t nplanes = 1;
+    while (nplanes < sizeof(size_t) * CHAR_BIT && ((size_t)1 << nplanes) <= n)
+        ++nplanes;
+    return nplanes;
+}
+
+/* bits set in at least k of the words in[i][w], i < n */
+static WORD bitarray_at_least_word(const WORD *const *in, size_t n, size_t k,
+    size_t nplanes, size_t w)
+{
+    WORD planes[sizeof(size_t) * CHAR_BIT];
+    for (size_t j = 0; j < nplanes; ++j)
+        planes[j] = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        WORD a = in[i][w], b = i + 1 < n ? in[i + 1][w] : 0;
+        WORD u = planes[0] ^ a;
+        WORD carry = (planes[0] & a) | (u & b);
+        planes[0] = u ^ b;
+        for (size_t j = 1; carry != 0; ++j) {
+            WORD t = planes[j] & carry;
+            planes[j] ^= carry;
+            carry = t;
+        }
+    }
+    /* count >= k, from the most significant plane down: gt has the counts
+       already known to be greater, eq those equal so far */
+    WORD gt = 0, eq = ~(WORD)0;
+    for (size_t j = nplanes; j-- > 0; ) {
+        if ((k >> j) & 1) {
+            eq &= planes[j];
+        } else {
+            gt |= eq & planes[j];
+            eq &= ~planes[j];
+        }
+    }
+    return gt | eq;
+}
+
+/* reduces words [from, from + n) */
+static void bitarray_reduce_range(const BitarrayReduce *r, size_t part,
+    size_t from, size_t n)
+{
+    if (r->op == BITARRAY_REDUCE_AT_LEAST) {
+        size_t nplanes = bitarray_count_planes(r->n);
+        for (size_t w = from; w < from + n; ++w)
+            r->d[w] = bitarray_at_least_word(r->in, r->n, r->k, nplanes, w);
+        return;
+    }
+    void (*kernel)(WORD *, const WORD *, const WORD *, size_t) =
+        r->op == BITARRAY_REDUCE_AND ? bitarray_kernels.and_
+        : r->op == BITARRAY_REDUCE_OR ? bitarray_kernels.or_
+        : bitarray_kernels.xor_;
+    WORD *tmp = r->buffers + part * BITARRAY_EXPR_BLOCK_WORDS;
+    for (size_t at = from; at < from + n; at += BITARRAY_EXPR_BLOCK_WORDS) {
+        size_t k = from + n - at < BITARRAY_EXPR_BLOCK_WORDS
+            ? from + n - at : BITARRAY_EXPR_BLOCK_WORDS;
+        if (r->n == 1) {
+            memmove(r->d + at, r->in[0] + at, k * sizeof(WORD));
+            continue;
+        }
+        /* d is written last, it may be one of the inputs */
+        const WORD *acc = r->in[0] + at;
+        for (size_t i = 1; i + 1 < r->n; ++i) {
+            kernel(tmp, acc, r->in[i] + at, k);
+            acc = tmp;
+        }
+        kernel(r->d + at, acc, r->in[r->n - 1] + at, k);
+    }
+}
+
+static void bitarray_task_reduce(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    bitarray_reduce_range((const BitarrayReduce *)t->arg, p, from, k);
+}
+
+/* d = OP of the nwords words of the n arrays in. returns 0 if there is no
+   memory for the block buffers */
+static int bitarray_reduce(const WORD *const *in, size_t n, size_t nwords,
+    WORD *d, int op, size_t k)
+{
+    BitarrayTask t;
+    BitarrayReduce r;
+    size_t nparts = bitarray_parts(nwords);
+    t.n = nwords;
+    t.arg = &r;
+    if (nparts == 1)
+        t.chunk = t.n;
+    else
+        nparts = bitarray_task_split(&t, nparts, d);
+    r.in = in;
+    r.n = n;
+    r.d = d;
+    r.op = op;
+    r.k = k;
+    r.buffers = NULL;
+    if (op != BITARRAY_REDUCE_AT_LEAST) {
+        r.buffers = (WORD *)malloc(nparts * BITARRAY_EXPR_BLOCK_WORDS * sizeof(WORD));
+        if (r.buffers == NULL)
+            return 0;
+    }
+    if (nparts == 1)
+        bitarray_reduce_range(&r, 0, 0, t.n);
+    else
+        bitarray_pool_run(bitarray_task_reduce, &t, nparts);
+    free(r.buffers);
+    return 1;
+}
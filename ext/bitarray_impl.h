@@ -2,21 +2,87 @@
    in this file */
 #pragma once
 
+/* file mappings need the posix declarations, which -std=c99 hides, and
+   memfd_create a gnu one */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
 #include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+    #define BITARRAY_HAVE_MMAP
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 
+/* width of a storage word, 32 or 64. can be chosen at build time with
+   -DBITARRAY_WORD_BITS=32, defaults to 64 on 64-bit targets */
+#ifndef BITARRAY_WORD_BITS
+    #if SIZE_MAX > 0xFFFFFFFFu
+        #define BITARRAY_WORD_BITS 64
+    #else
+        #define BITARRAY_WORD_BITS 32
+    #endif
+#endif
 
-typedef unsigned int WORD;
+#if BITARRAY_WORD_BITS == 64
+typedef uint64_t WORD;
+#elif BITARRAY_WORD_BITS == 32
+typedef uint32_t WORD;
+#else
+    #error "BITARRAY_WORD_BITS must be 32 or 64"
+#endif
+
+/* byte order of the host, the byte conversions take a shortcut on little
+   endian hosts where the storage already is a plain LSB first byte stream */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+    #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        #define BITARRAY_LITTLE_ENDIAN
+    #endif
+#elif defined(_WIN32) || defined(__x86_64__) || defined(__i386__)
+    #define BITARRAY_LITTLE_ENDIAN
+#endif
 
 /*  number of bits in a word */
 #define BITS_PER_WORD     (CHAR_BIT * sizeof(WORD))
 /* gets the word that contains the bit corresponding to a given index i */
-#define I_WORD(i)         ((WORD)(i) / BITS_PER_WORD)
+#define I_WORD(i)         ((size_t)(i) / BITS_PER_WORD)
 /*  computes a mask to access the correct bit inside this word */
-#define I_BIT(i)          ((WORD)1 << ((WORD)(i) % BITS_PER_WORD))
+#define I_BIT(i)          ((WORD)1 << ((size_t)(i) % BITS_PER_WORD))
 /* computes how many words to store n bits */
-#define WORDS_FOR_BITS(n) (I_WORD((n) - 1) + 1)
+#define WORDS_FOR_BITS(n) (I_WORD(n) + ((size_t)(n) % BITS_PER_WORD != 0))
+
+#include "bitarray_kernels.h"
+#include "bitarray_parallel.h"
+
+/* bits covered by one entry of the rank/select directory */
+#define BITARRAY_SUPERBLOCK_BITS 512
+#define WORDS_PER_SUPERBLOCK     (BITARRAY_SUPERBLOCK_BITS / BITS_PER_WORD)
+/* the directory remembers the superblock of every this many 1 bits */
+#define BITARRAY_SELECT_SAMPLE   4096
+
+/* rank/select directory. built on demand and dropped on any mutation */
+typedef struct BitarrayDirectory
+{
+    size_t nblocks;
+    size_t *blocks;   /* blocks[b]: number of 1 bits before superblock b,
+                         blocks[nblocks] is the total */
+    size_t nsamples;
+    size_t *samples;  /* samples[j]: superblock holding the
+                         (j * BITARRAY_SELECT_SAMPLE + 1)th 1 bit */
+} BitarrayDirectory;
 
 /* lua userdata for bit array
    must note all unused bit positions have to be 0 at all times*/
@@ -24,21 +90,611 @@ typedef struct Bitarray
 {
     size_t size;
     WORD *values; /* uses little endian to store bits */
+    BitarrayDirectory *dir; /* NULL until rank/select needs it */
+    size_t maplen; /* bytes mapped if values is a file mapping, else 0 */
+    int readonly; /* a read-only mapping, mutators refuse it */
+    int embedded; /* values live in the block holding the struct */
+    struct BitarrayShared *shared; /* owner of values if they are shared */
+    struct BitarrayBuffer *buffer; /* owner of values if other arrays of this
+                                      state may read them */
+    size_t offset; /* words of buffer before the first of values */
+    int written; /* values differ from a file buffer, see BitarrayBuffer */
+    struct Bitarray *prev_user, *next_user; /* the other arrays of buffer */
 } Bitarray;
 
-/* allocate space to store n bits for ba and set them to 0,
-   returns the number of bits available */
-static size_t bitarray_validate(Bitarray *ba, size_t nbits)
+/* bytes from the start of a block to words embedded in it after a Bitarray,
+   and the size of such a block for n bits */
+#define BITARRAY_EMBED_OFFSET \
+    ((sizeof(Bitarray) + sizeof(WORD) - 1) / sizeof(WORD) * sizeof(WORD))
+#define BITARRAY_EMBEDDED_SIZE(n) \
+    (BITARRAY_EMBED_OFFSET + WORDS_FOR_BITS(n) * sizeof(WORD))
+
+/* whether an array of n bits can exist on this platform. its size and
+   indices are lua integers, which never go past PTRDIFF_MAX, and so must the
+   block embedding its words for malloc to hand it out */
+static int bitarray_size_fits(uint64_t n)
 {
-    ba->values = (WORD *)calloc(WORDS_FOR_BITS(nbits), sizeof(WORD));
-    if (ba->values != NULL)
-        return ba->size = nbits;
-    return 0;
+    uint64_t words = n / BITS_PER_WORD + (n % BITS_PER_WORD != 0);
+    return n <= PTRDIFF_MAX
+        && words <= (PTRDIFF_MAX - BITARRAY_EMBED_OFFSET) / sizeof(WORD);
+}
+
+/* the serialized form, which is also the layout of a mapped file:
+     0   4 bytes  magic "\211BIT"
+     4   1 byte   format version
+     5   1 byte   flags, BITARRAY_FLAG_CRC if a checksum follows the payload,
+                  and the payload codec in BITARRAY_FLAG_CODEC
+     6   1 byte   size of a payload word in bytes, 4 or 8
+     7   1 byte   byte order of the payload words, 0 little and 1 big endian
+     8   8 bytes  number of bits, little endian
+     16           payload: the storage words, unused bits are 0
+   followed by the crc32c of everything before it, little endian, if the
+   flag is set. a raw payload is a straight copy of the storage, readers
+   convert it when their word size or byte order differs. compressed ones
+   are described in bitarray_codec.h */
+#define BITARRAY_HEADER_BYTES 16
+#define BITARRAY_FORMAT_VERSION 1
+#define BITARRAY_FLAG_CRC 1
+#define BITARRAY_FLAG_CODEC 6
+
+/* payload codecs, stored at bit 1 of the flags */
+enum { BITARRAY_CODEC_RAW, BITARRAY_CODEC_RLE, BITARRAY_CODEC_EWAH };
+
+typedef struct BitarrayHeader
+{
+    uint64_t nbits;
+    size_t wordsize;
+    int bigendian;
+    int crc;
+    int codec;
+} BitarrayHeader;
+
+/* storage shared by arrays in any number of lua states, found by its handle.
+   the arrays hold references and the last one to go frees the words */
+typedef struct BitarrayShared
+{
+    struct BitarrayShared *next;
+    uint64_t id;
+    size_t refs;
+    size_t size;
+    WORD *values;
+} BitarrayShared;
+
+/* words read by several arrays of one lua state, made by view and copyfrom,
+   instead of each having a copy. they are kept in one of two ways:
+   - in memory. they are never written while more than one array uses them:
+     the array about to change gets words of its own first or, if that is
+     more to copy, gives all the others theirs
+   - in an anonymous memory file, for large arrays, that every user
+     maps privately. the system then copies a page of the file the first
+     time a user writes to it, and only that page. the file is never
+     written, so a user that was cannot share its words with new arrays
+   the last user frees them */
+typedef struct BitarrayBuffer
+{
+    struct Bitarray *users; /* linked through prev_user and next_user */
+    size_t nwords;
+    WORD *words; /* NULL if they are in the file */
+    int fd;
+} BitarrayBuffer;
+
+/* smallest buffer worth keeping in a file, in bytes. the file comes from
+   memfd_create on linux, shm_open(SHM_ANON) on freebsd and a shm_open name
+   unlinked at once on macos, all of them backed by memory without a size
+   limit of their own. only where none of these exists, or memfd_create
+   fails, is it an unlinked file under /dev/shm, which can be small (64 MiB
+   in a docker container): the buffer then stays in memory when it is full */
+#define BITARRAY_PAGED_MIN_BYTES (256 * 1024)
+
+/* every live shared storage, so that handles can be checked */
+static struct
+{
+#ifdef BITARRAY_HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+    BitarrayShared *list;
+    uint64_t lastid;
+} bitarray_shares = {
+#ifdef BITARRAY_HAVE_THREADS
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    NULL, 0
+};
+
+#ifdef BITARRAY_HAVE_THREADS
+    #define bitarray_shares_lock()   pthread_mutex_lock(&bitarray_shares.lock)
+    #define bitarray_shares_unlock() pthread_mutex_unlock(&bitarray_shares.lock)
+#else
+    #define bitarray_shares_lock()   ((void)0)
+    #define bitarray_shares_unlock() ((void)0)
+#endif
+
+/* storage accounting of all lua states, see Bitarray.memstats. bytes are
+   those of storage words allocated on the heap, shared words only once.
+   words in a file, and the pages of it an array has written to, are not
+   counted */
+static struct
+{
+#ifdef BITARRAY_HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+    size_t arrays, bytes, peak, allocations;
+} bitarray_stats = {
+#ifdef BITARRAY_HAVE_THREADS
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    0, 0, 0, 0
+};
+
+#ifdef BITARRAY_HAVE_THREADS
+    #define bitarray_stats_lock()   pthread_mutex_lock(&bitarray_stats.lock)
+    #define bitarray_stats_unlock() pthread_mutex_unlock(&bitarray_stats.lock)
+#else
+    #define bitarray_stats_lock()   ((void)0)
+    #define bitarray_stats_unlock() ((void)0)
+#endif
+
+/* records an array coming (1) or going (-1), and words of allocated bytes
+   taken and of freed bytes given back */
+static void bitarray_account(int arrays, size_t allocated, size_t freed)
+{
+    bitarray_stats_lock();
+    if (arrays > 0)
+        ++bitarray_stats.arrays;
+    else if (arrays < 0)
+        --bitarray_stats.arrays;
+    if (allocated != 0) {
+        ++bitarray_stats.allocations;
+        bitarray_stats.bytes += allocated;
+        if (bitarray_stats.bytes > bitarray_stats.peak)
+            bitarray_stats.peak = bitarray_stats.bytes;
+    }
+    bitarray_stats.bytes -= freed;
+    bitarray_stats_unlock();
+}
+
+static void bitarray_buffer_join(Bitarray *ba, BitarrayBuffer *b, size_t offset)
+{
+    ba->buffer = b;
+    ba->offset = offset;
+    ba->written = 0;
+    ba->prev_user = NULL;
+    ba->next_user = b->users;
+    if (b->users != NULL)
+        b->users->prev_user = ba;
+    b->users = ba;
+}
+
+#ifdef BITARRAY_HAVE_MMAP
+/* bytes from the start of the page holding word k of a file to the word */
+static size_t bitarray_page_gap(size_t k)
+{
+    static size_t pagesize = 0;
+    if (pagesize == 0)
+        pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    return k * sizeof(WORD) % pagesize;
+}
+
+/* private mapping of nwords words of the file of b from word k on. returns
+   NULL on failure */
+static WORD *bitarray_buffer_map(BitarrayBuffer *b, size_t k, size_t nwords)
+{
+    size_t gap = bitarray_page_gap(k);
+    void *p = mmap(NULL, gap + nwords * sizeof(WORD), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE, b->fd, (off_t)(k * sizeof(WORD) - gap));
+    return p == MAP_FAILED ? NULL : (WORD *)((unsigned char *)p + gap);
+}
+
+static void bitarray_buffer_unmap(Bitarray *ba)
+{
+    size_t gap = bitarray_page_gap(ba->offset);
+    munmap((unsigned char *)ba->values - gap,
+        gap + WORDS_FOR_BITS(ba->size) * sizeof(WORD));
+}
+
+/* writes the nwords words w to the empty file fd. returns fd, or -1 after
+   closing it */
+static int bitarray_buffer_fill(int fd, const WORD *w, size_t nwords)
+{
+    const unsigned char *p = (const unsigned char *)w;
+    size_t left = nwords * sizeof(WORD);
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    return fd;
+}
+
+#if defined(SHM_ANON) || defined(__APPLE__)
+/* the same for shared memory objects, which not all systems can write to */
+static int bitarray_buffer_fill_mapped(int fd, const WORD *w, size_t nwords)
+{
+    size_t bytes = nwords * sizeof(WORD);
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, (off_t)bytes) == 0)
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    memcpy(p, w, bytes);
+    munmap(p, bytes);
+    return fd;
+}
+#endif
+
+/* an anonymous file holding the nwords words w, see
+   BITARRAY_PAGED_MIN_BYTES. returns -1 on failure */
+static int bitarray_buffer_file(const WORD *w, size_t nwords)
+{
+    int fd;
+#if defined(SHM_ANON)
+    fd = shm_open(SHM_ANON, O_RDWR, 0600);
+    return fd < 0 ? -1 : bitarray_buffer_fill_mapped(fd, w, nwords);
+#elif defined(__APPLE__)
+    /* the words are at a live address, no other buffer can take the name */
+    char shmname[32];
+    snprintf(shmname, sizeof(shmname), "/bitarray-%lx", (unsigned long)(uintptr_t)w);
+    fd = shm_open(shmname, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+    shm_unlink(shmname);
+    return bitarray_buffer_fill_mapped(fd, w, nwords);
+#else
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("bitarray", MFD_CLOEXEC);
+    if (fd >= 0)
+        return bitarray_buffer_fill(fd, w, nwords);
+#endif
+    char name[] = "/dev/shm/bitarray-XXXXXX";
+    fd = mkstemp(name);
+    if (fd < 0)
+        return -1;
+    unlink(name);
+    return bitarray_buffer_fill(fd, w, nwords);
+#endif
+}
+
+/* moves the words of a buffer in memory to a file, giving every user a
+   mapping of its part, and takes them off the heap bytes. returns 0 and
+   leaves the buffer as it is on failure */
+static int bitarray_buffer_page(BitarrayBuffer *b)
+{
+    int fd = bitarray_buffer_file(b->words, b->nwords);
+    if (fd < 0)
+        return 0;
+    b->fd = fd;
+    Bitarray *u;
+    for (u = b->users; u != NULL; u = u->next_user) {
+        WORD *w = bitarray_buffer_map(b, u->offset, WORDS_FOR_BITS(u->size));
+        if (w == NULL)
+            break;
+        u->values = w;
+    }
+    if (u != NULL) {
+        for (Bitarray *v = b->users; v != u; v = v->next_user) {
+            bitarray_buffer_unmap(v);
+            v->values = b->words + v->offset;
+        }
+        close(fd);
+        b->fd = -1;
+        return 0;
+    }
+    free(b->words);
+    b->words = NULL;
+    bitarray_account(0, 0, b->nwords * sizeof(WORD));
+    return 1;
+}
+#endif
+
+/* takes ba off the users of its buffer, the last one frees the words (those
+   in a file were given back when they moved there) */
+static void bitarray_buffer_leave(Bitarray *ba)
+{
+    BitarrayBuffer *b = ba->buffer;
+#ifdef BITARRAY_HAVE_MMAP
+    if (b->words == NULL)
+        bitarray_buffer_unmap(ba);
+#endif
+    if (ba->prev_user != NULL)
+        ba->prev_user->next_user = ba->next_user;
+    else
+        b->users = ba->next_user;
+    if (ba->next_user != NULL)
+        ba->next_user->prev_user = ba->prev_user;
+    ba->buffer = NULL;
+    ba->prev_user = ba->next_user = NULL;
+    if (b->users == NULL) {
+        if (b->words != NULL)
+            bitarray_account(0, 0, b->nwords * sizeof(WORD));
+#ifdef BITARRAY_HAVE_MMAP
+        if (b->fd >= 0)
+            close(b->fd);
+#endif
+        free(b->words);
+        free(b);
+    }
+}
+
+/* gives ba words of its own if it reads those of a buffer, so that it can be
+   resized or shared like any other array. returns 0 if there is no memory */
+static int bitarray_buffer_own(Bitarray *ba)
+{
+    BitarrayBuffer *b = ba->buffer;
+    if (b == NULL)
+        return 1;
+    size_t nwords = WORDS_FOR_BITS(ba->size), bytes = nwords * sizeof(WORD);
+    if (b->users == ba && ba->next_user == NULL && ba->values == b->words
+        && nwords == b->nwords) {
+        /* the last user takes the words over */
+        ba->buffer = NULL;
+        free(b);
+        return 1;
+    }
+    WORD *w = (WORD *)malloc(bytes);
+    if (w == NULL)
+        return 0;
+    memcpy(w, ba->values, bytes);
+    bitarray_buffer_leave(ba);
+    ba->values = w;
+    bitarray_account(0, bytes, 0);
+    return 1;
+}
+
+/* moves the words of ba, which must be neither mapped nor shared, to a
+   buffer other arrays can read them from. with paged set large arrays get
+   theirs in a file, even if they already were in a buffer in memory.
+   returns 0 if there is no memory */
+static int bitarray_buffer_wrap(Bitarray *ba, int paged)
+{
+    size_t nwords = WORDS_FOR_BITS(ba->size), bytes = nwords * sizeof(WORD);
+    /* others would read the file, without the changes */
+    if (ba->buffer != NULL && ba->written && !bitarray_buffer_own(ba))
+        return 0;
+    if (ba->buffer == NULL) {
+        BitarrayBuffer *b = (BitarrayBuffer *)malloc(sizeof(BitarrayBuffer));
+        if (b == NULL)
+            return 0;
+        if (ba->embedded) {
+            /* the words have to outlive the block they are in */
+            WORD *w = (WORD *)malloc(bytes);
+            if (w == NULL) {
+                free(b);
+                return 0;
+            }
+            memcpy(w, ba->values, bytes);
+            ba->values = w;
+            ba->embedded = 0;
+            bitarray_account(0, bytes, bytes);
+        }
+        b->users = NULL;
+        b->nwords = nwords;
+        b->words = ba->values;
+        b->fd = -1;
+        bitarray_buffer_join(ba, b, 0);
+    }
+#ifdef BITARRAY_HAVE_MMAP
+    BitarrayBuffer *b = ba->buffer;
+    /* staying in memory is fine too, only the first write costs more */
+    if (paged && b->words != NULL && b->nwords * sizeof(WORD) >= BITARRAY_PAGED_MIN_BYTES)
+        bitarray_buffer_page(b);
+#else
+    (void)paged;
+#endif
+    return 1;
+}
+
+/* makes sure no other array reads the words of ba before they change.
+   returns 0 if there is no memory */
+static int bitarray_buffer_write(Bitarray *ba)
+{
+    BitarrayBuffer *b = ba->buffer;
+    if (b == NULL)
+        return 1;
+    /* a mapping of a file is written by its user alone */
+    if (b->words == NULL) {
+        ba->written = 1;
+        return 1;
+    }
+    if (b->users == ba && ba->next_user == NULL)
+        return 1;
+    size_t others = 0;
+    for (Bitarray *u = b->users; u != NULL; u = u->next_user)
+        if (u != ba)
+            others += WORDS_FOR_BITS(u->size);
+    if (WORDS_FOR_BITS(ba->size) <= others)
+        return bitarray_buffer_own(ba);
+    /* say a large array with a few small views: the views move out */
+    for (Bitarray *u = b->users, *next; u != NULL; u = next) {
+        next = u->next_user;
+        if (u != ba && !bitarray_buffer_own(u))
+            return 0;
+    }
+    return 1;
+}
+
+/* sets up v as an array of nbits bits reading the words of ba from the kth
+   on, without copying them. ba must be neither mapped nor shared, and the
+   bits of the last word of v past nbits must be 0 in ba. paged as for
+   bitarray_buffer_wrap. returns 0 if there is no memory */
+static int bitarray_view(Bitarray *v, Bitarray *ba, size_t k, size_t nbits, int paged)
+{
+    if (!bitarray_buffer_wrap(ba, paged))
+        return 0;
+    BitarrayBuffer *b = ba->buffer;
+    if (b->words != NULL) {
+        v->values = ba->values + k;
+    } else {
+#ifdef BITARRAY_HAVE_MMAP
+        v->values = bitarray_buffer_map(b, ba->offset + k, WORDS_FOR_BITS(nbits));
+        if (v->values == NULL)
+            return 0;
+#endif
+    }
+    v->size = nbits;
+    v->dir = NULL;
+    v->maplen = 0;
+    v->readonly = 0;
+    v->embedded = 0;
+    v->shared = NULL;
+    bitarray_buffer_join(v, b, ba->offset + k);
+    bitarray_account(1, 0, 0);
+    return 1;
+}
+
+/* moves the words of ba, which must not be mapped, to shared storage.
+   returns its handle, or 0 if there is no memory for it */
+static uint64_t bitarray_share(Bitarray *ba)
+{
+    if (ba->shared != NULL)
+        return ba->shared->id;
+    if (!bitarray_buffer_own(ba))
+        return 0;
+    size_t bytes = WORDS_FOR_BITS(ba->size) * sizeof(WORD);
+    WORD *w = ba->values;
+    if (ba->embedded) {
+        /* the words have to outlive the block they are in */
+        w = (WORD *)malloc(bytes);
+        if (w == NULL)
+            return 0;
+        memcpy(w, ba->values, bytes);
+    }
+    BitarrayShared *sh = (BitarrayShared *)malloc(sizeof(BitarrayShared));
+    if (sh == NULL) {
+        if (w != ba->values)
+            free(w);
+        return 0;
+    }
+    if (ba->embedded) {
+        ba->values = w;
+        ba->embedded = 0;
+        bitarray_account(0, bytes, bytes);
+    }
+    sh->refs = 1;
+    sh->size = ba->size;
+    sh->values = ba->values;
+    bitarray_shares_lock();
+    sh->id = ++bitarray_shares.lastid;
+    sh->next = bitarray_shares.list;
+    bitarray_shares.list = sh;
+    bitarray_shares_unlock();
+    ba->shared = sh;
+    return sh->id;
+}
+
+/* makes ba another user of the shared storage with handle id. returns 0 if
+   there is no such storage */
+static int bitarray_attach(Bitarray *ba, uint64_t id)
+{
+    BitarrayShared *sh;
+    bitarray_shares_lock();
+    for (sh = bitarray_shares.list; sh != NULL && sh->id != id; sh = sh->next)
+        ;
+    if (sh != NULL)
+        ++sh->refs;
+    bitarray_shares_unlock();
+    if (sh == NULL)
+        return 0;
+    ba->size = sh->size;
+    ba->values = sh->values;
+    ba->dir = NULL;
+    ba->maplen = 0;
+    ba->readonly = 0;
+    ba->embedded = 0;
+    ba->shared = sh;
+    ba->buffer = NULL;
+    ba->prev_user = ba->next_user = NULL;
+    bitarray_account(1, 0, 0);
+    return 1;
+}
+
+static void bitarray_shared_release(BitarrayShared *sh)
+{
+    bitarray_shares_lock();
+    int last = --sh->refs == 0;
+    if (last) {
+        BitarrayShared **p = &bitarray_shares.list;
+        while (*p != sh)
+            p = &(*p)->next;
+        *p = sh->next;
+    }
+    bitarray_shares_unlock();
+    if (last) {
+        bitarray_account(0, 0, WORDS_FOR_BITS(sh->size) * sizeof(WORD));
+        free(sh->values);
+        free(sh);
+    }
+}
+
+/* set up ba to store n bits, all set to 0. words is room for them in the
+   block holding ba, usually BITARRAY_EMBED_OFFSET bytes from its start, which
+   gives them back with it. NULL allocates them apart. returns the number of
+   bits available, 0 if there is no memory for them */
+static size_t bitarray_validate(Bitarray *ba, size_t nbits, WORD *words)
+{
+    size_t bytes = WORDS_FOR_BITS(nbits) * sizeof(WORD);
+    ba->dir = NULL;
+    ba->maplen = 0;
+    ba->readonly = 0;
+    ba->shared = NULL;
+    ba->buffer = NULL;
+    ba->prev_user = ba->next_user = NULL;
+    ba->embedded = words != NULL;
+    if (words != NULL)
+        ba->values = (WORD *)memset(words, 0, bytes);
+    else
+        ba->values = (WORD *)calloc(WORDS_FOR_BITS(nbits), sizeof(WORD));
+    if (ba->values == NULL)
+        return 0;
+    bitarray_account(1, bytes, 0);
+    return ba->size = nbits;
+}
+
+/* free the rank/select directory, it goes stale once the array changes */
+static void bitarray_drop_directory(Bitarray *ba)
+{
+    if (ba->dir == NULL)
+        return;
+    free(ba->dir->blocks);
+    free(ba->dir->samples);
+    free(ba->dir);
+    ba->dir = NULL;
 }
 
 static void bitarray_invalidate(Bitarray *ba)
 {
-    free(ba->values);
+    size_t freed = 0;
+    bitarray_drop_directory(ba);
+    if (ba->values == NULL)
+        return;
+    if (ba->shared != NULL) {
+        bitarray_shared_release(ba->shared);
+    } else if (ba->buffer != NULL) {
+        bitarray_buffer_leave(ba);
+    }
+#ifdef BITARRAY_HAVE_MMAP
+    else if (ba->maplen != 0) {
+        munmap((unsigned char *)ba->values - BITARRAY_HEADER_BYTES, ba->maplen);
+    }
+#endif
+    else {
+        /* embedded words go with their block */
+        if (!ba->embedded)
+            free(ba->values);
+        freed = WORDS_FOR_BITS(ba->size) * sizeof(WORD);
+    }
+    bitarray_account(-1, 0, freed);
+    ba->values = NULL;
+    ba->shared = NULL;
+    ba->embedded = 0;
+    ba->maplen = 0;
     ba->size = 0;
 }
 
@@ -77,30 +733,236 @@ static void bitarray_flip_bit(Bitarray *ba, size_t i)
     *word = (*word & mask) ? (*word & ~mask) : (*word | mask);
 }
 
+/* set the unused bits in the last word to 0 */
+static void bitarray_clear_tail(Bitarray *ba)
+{
+    size_t used = ba->size % BITS_PER_WORD;
+    if (used != 0)
+        ba->values[I_WORD(ba->size)] &= ((WORD)1 << used) - 1;
+}
+
+/* whether storage words are big endian on this host */
+static int bitarray_host_big_endian(void)
+{
+    const WORD one = 1;
+    return *(const unsigned char *)&one == 0;
+}
+
+/* fills h with the header of an array of nbits stored by this build */
+static void bitarray_header_write(unsigned char *h, size_t nbits, int crc)
+{
+    memcpy(h, "\211BIT", 4);
+    h[4] = BITARRAY_FORMAT_VERSION;
+    h[5] = crc ? BITARRAY_FLAG_CRC : 0;
+    h[6] = (unsigned char)sizeof(WORD);
+    h[7] = (unsigned char)bitarray_host_big_endian();
+    for (int k = 0; k < 8; ++k)
+        h[8 + k] = (unsigned char)((uint64_t)nbits >> (8 * k));
+}
+
+/* decodes the header in h. returns NULL if it is valid, or the problem */
+static const char *bitarray_header_read(const unsigned char *h,
+    BitarrayHeader *hd)
+{
+    if (memcmp(h, "\211BIT", 4) != 0)
+        return "not a serialized bitarray";
+    if (h[4] != BITARRAY_FORMAT_VERSION)
+        return "unsupported format version";
+    if ((h[5] & ~(BITARRAY_FLAG_CRC | BITARRAY_FLAG_CODEC)) != 0
+        || (h[6] != 4 && h[6] != 8) || h[7] > 1)
+        return "corrupt header";
+    hd->nbits = 0;
+    for (int k = 7; k >= 0; --k)
+        hd->nbits = hd->nbits << 8 | h[8 + k];
+    hd->wordsize = h[6];
+    hd->bigendian = h[7];
+    hd->crc = h[5] & BITARRAY_FLAG_CRC;
+    hd->codec = (h[5] & BITARRAY_FLAG_CODEC) >> 1;
+    if (hd->codec > BITARRAY_CODEC_EWAH)
+        return "unsupported codec";
+    /* compressed payloads are made of little endian 64-bit words */
+    if (hd->codec != BITARRAY_CODEC_RAW && (hd->wordsize != 8 || hd->bigendian))
+        return "corrupt header";
+    if (hd->nbits == 0)
+        return "corrupt header";
+    if (!bitarray_size_fits(hd->nbits))
+        return "array too large for this platform";
+    return NULL;
+}
+
+/* size of the payload described by hd in bytes */
+static size_t bitarray_payload_bytes(const BitarrayHeader *hd)
+{
+    size_t bits = CHAR_BIT * hd->wordsize;
+    return ((size_t)hd->nbits / bits + (hd->nbits % bits != 0)) * hd->wordsize;
+}
+
+/* whether the payload can be used as the storage of this build as is */
+static int bitarray_header_native(const BitarrayHeader *hd)
+{
+    return hd->codec == BITARRAY_CODEC_RAW && hd->wordsize == sizeof(WORD)
+        && hd->bigendian == bitarray_host_big_endian();
+}
+
+#ifdef BITARRAY_HAVE_MMAP
+/* ways to map a file */
+enum { BITARRAY_MAP_SHARED, BITARRAY_MAP_PRIVATE, BITARRAY_MAP_READONLY };
+
+/* backs ba with the array serialized in the file at path. a shared mapping
+   of an empty or new file stores a fresh array of nbits 0 bits in it. nbits
+   may be 0 to take the size from the file, otherwise it has to match. the
+   payload has to be in the storage layout of this build and the checksum is
+   not verified. returns NULL on success, or the reason for the failure */
+static const char *bitarray_mmap(Bitarray *ba, const char *path, size_t nbits,
+    int mode)
+{
+    unsigned char h[BITARRAY_HEADER_BYTES];
+    BitarrayHeader hd;
+    struct stat st;
+    size_t len = 0;
+    void *p = MAP_FAILED;
+    const char *err = NULL;
+    int flags = mode != BITARRAY_MAP_SHARED ? O_RDONLY
+        : nbits != 0 ? O_RDWR | O_CREAT : O_RDWR;
+    int fd = open(path, flags, 0666);
+    if (fd < 0)
+        return strerror(errno);
+    if (fstat(fd, &st) != 0)
+        goto fail;
+    if (st.st_size == 0 && mode == BITARRAY_MAP_SHARED) {
+        if (nbits == 0) {
+            err = "the size of a new array is needed";
+            goto done;
+        }
+        hd.nbits = nbits;
+        hd.wordsize = sizeof(WORD);
+        len = BITARRAY_HEADER_BYTES + bitarray_payload_bytes(&hd);
+        if (ftruncate(fd, (off_t)len) != 0)
+            goto fail;
+    } else {
+        ssize_t got = pread(fd, h, sizeof(h), 0);
+        if (got < 0)
+            goto fail;
+        if (got != sizeof(h)) {
+            err = "not a serialized bitarray";
+            goto done;
+        }
+        if ((err = bitarray_header_read(h, &hd)) != NULL)
+            goto done;
+        if (hd.codec != BITARRAY_CODEC_RAW) {
+            err = "compressed arrays cannot be mapped";
+            goto done;
+        }
+        if (!bitarray_header_native(&hd)) {
+            err = "stored with another word size or byte order, use Bitarray.read";
+            goto done;
+        }
+        if (nbits != 0 && nbits != hd.nbits) {
+            err = "the file holds an array of another size";
+            goto done;
+        }
+        nbits = (size_t)hd.nbits;
+        len = BITARRAY_HEADER_BYTES + bitarray_payload_bytes(&hd);
+        if ((uint64_t)st.st_size < len) {
+            err = "file is truncated";
+            goto done;
+        }
+    }
+    p = mmap(NULL, len, mode == BITARRAY_MAP_READONLY ? PROT_READ
+        : PROT_READ | PROT_WRITE,
+        mode == BITARRAY_MAP_PRIVATE ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+    goto done;
+fail:
+    err = strerror(errno);
+done:
+    /* the mapping stays valid after the descriptor is closed */
+    close(fd);
+    if (err != NULL)
+        return err;
+    unsigned char *base = (unsigned char *)p;
+    if (st.st_size == 0)
+        bitarray_header_write(base, nbits, 0);
+    else if (mode == BITARRAY_MAP_SHARED)
+        base[5] &= ~BITARRAY_FLAG_CRC; /* stale after the first change */
+    ba->size = nbits;
+    ba->values = (WORD *)(base + BITARRAY_HEADER_BYTES);
+    ba->dir = NULL;
+    ba->maplen = len;
+    ba->readonly = mode == BITARRAY_MAP_READONLY;
+    ba->embedded = 0;
+    ba->shared = NULL;
+    ba->buffer = NULL;
+    ba->prev_user = ba->next_user = NULL;
+    bitarray_account(1, 0, 0);
+    /* the unused bits must be 0 like in any other array. only a private
+       mapping may fix them up, in the others they belong to the file */
+    if (mode == BITARRAY_MAP_PRIVATE) {
+        bitarray_clear_tail(ba);
+    } else if (nbits % BITS_PER_WORD != 0
+        && (ba->values[WORDS_FOR_BITS(nbits) - 1] >> (nbits % BITS_PER_WORD)) != 0) {
+        bitarray_invalidate(ba);
+        return "unused bits of the last word are not 0";
+    }
+    return NULL;
+}
+
+/* writes the changes of a shared mapping back to its file, nothing to do for
+   other arrays. returns 0 on failure */
+static int bitarray_sync(Bitarray *ba)
+{
+    return ba->maplen == 0 || msync((unsigned char *)ba->values
+        - BITARRAY_HEADER_BYTES, ba->maplen, MS_SYNC) == 0;
+}
+#endif
+
 /* for loop that always set the unused bits to 0 */
 #define BITARRAY_WORD_ITER(ba, I, EXPR) do { \
     size_t nwords = WORDS_FOR_BITS((ba)->size); \
     for (size_t (I) = 0; (I) < nwords; ++(I)) { \
         EXPR } \
-    for (size_t (I) = (ba)->size; (I) < nwords * BITS_PER_WORD; ++(I)) \
-        bitarray_set_bit((ba), (I), 0); } while(0) \
+    bitarray_clear_tail(ba); } while(0) \
 
 static void bitarray_flip(Bitarray *ba)
 {
-    BITARRAY_WORD_ITER(ba, i,
-        ba->values[i] = ~ba->values[i];
-    );
+    bitarray_par_unary(bitarray_kernels.not_, ba->values, ba->values,
+        WORDS_FOR_BITS(ba->size));
+    bitarray_clear_tail(ba);
 }
 
 /* set all bits to 1 if b is truthy, else 0 */
 static void bitarray_fill(Bitarray *ba, int b)
 {
-    WORD bb = b ? (WORD)-1 : 0;
-    BITARRAY_WORD_ITER(ba, i,
-        ba->values[i] = bb;
-    );
+    bitarray_par_fill(ba->values, b, WORDS_FOR_BITS(ba->size));
+    bitarray_clear_tail(ba);
+}
+
+/* tg = ~ba. tg must be of the same size as ba and may be ba itself */
+static void bitarray_not(Bitarray *tg, Bitarray *ba)
+{
+    bitarray_par_unary(bitarray_kernels.not_, tg->values, ba->values,
+        WORDS_FOR_BITS(tg->size));
+    bitarray_clear_tail(tg);
 }
 
+/* binary operations of the form tg = l OP r. all three arrays must be of the
+   same size, tg may be l or r */
+#define BITARRAY_BINARY_KERNEL(NAME, KERNEL) \
+    static void NAME(Bitarray *tg, Bitarray *l, Bitarray *r) \
+    { \
+        bitarray_par_binary(bitarray_kernels.KERNEL, tg->values, l->values, \
+            r->values, WORDS_FOR_BITS(tg->size)); \
+        bitarray_clear_tail(tg); \
+    }
+
+BITARRAY_BINARY_KERNEL(bitarray_and, and_)
+BITARRAY_BINARY_KERNEL(bitarray_or, or_)
+BITARRAY_BINARY_KERNEL(bitarray_xor, xor_)
+BITARRAY_BINARY_KERNEL(bitarray_andnot, andnot)
+
+#undef BITARRAY_BINARY_KERNEL
+
 /* resize the array. if new size is bigger, fill the new bit positions with 0.
    also set any unused bits to 0 (ie the gap between size and the actual end
    of WORDs). returns the new size, or 0 is returned if failed (array unchanged)*/
@@ -108,13 +970,24 @@ static size_t bitarray_resize(Bitarray *ba, size_t nbits)
 {
     if (nbits == ba->size)
         return nbits;
+    if (!bitarray_buffer_own(ba))
+        return 0;
     size_t oldwords = WORDS_FOR_BITS(ba->size);
     size_t newwords = WORDS_FOR_BITS(nbits);
-    if (oldwords != newwords) {
-        WORD *tmp = (WORD *)realloc(ba->values, newwords * sizeof(WORD));
+    if (newwords > oldwords || (newwords < oldwords && !ba->embedded)) {
+        /* embedded words cannot grow with their block, they move out */
+        WORD *tmp = ba->embedded ? (WORD *)malloc(newwords * sizeof(WORD))
+            : (WORD *)realloc(ba->values, newwords * sizeof(WORD));
         if (tmp == NULL)
             return 0;
+        if (ba->embedded)
+            memcpy(tmp, ba->values, oldwords * sizeof(WORD));
         ba->values = tmp;
+        ba->embedded = 0;
+        bitarray_account(0, newwords * sizeof(WORD), oldwords * sizeof(WORD));
+    } else if (newwords < oldwords) {
+        /* the end of the block goes unused */
+        bitarray_account(0, 0, (oldwords - newwords) * sizeof(WORD));
     }
     size_t oldbits = ba->size;
     ba->size = nbits;
@@ -129,55 +1002,748 @@ static size_t bitarray_resize(Bitarray *ba, size_t nbits)
     return nbits;
 }
 
+/* copy values from ba to tg */
+static void bitarray_copyvalues(Bitarray *ba, Bitarray *tg)
+{
+    bitarray_par_copy(tg->values, ba->values, WORDS_FOR_BITS(ba->size));
+}
+
+/* reads k (1 <= k <= BITS_PER_WORD) bits starting at bit p into the low bits
+   of a word */
+static WORD bitarray_extract_word(const WORD *src, size_t p, size_t k)
+{
+    size_t sh = p % BITS_PER_WORD;
+    WORD w = src[I_WORD(p)] >> sh;
+    if (sh != 0 && sh + k > BITS_PER_WORD)
+        w |= src[I_WORD(p) + 1] << (BITS_PER_WORD - sh);
+    return k < BITS_PER_WORD ? w & (((WORD)1 << k) - 1) : w;
+}
+
+/* writes the low k bits of v to bit p onwards. the k bits must not cross a
+   word boundary */
+static void bitarray_deposit_word(WORD *dst, size_t p, size_t k, WORD v)
+{
+    size_t sh = p % BITS_PER_WORD;
+    WORD mask = (k < BITS_PER_WORD ? ((WORD)1 << k) - 1 : (WORD)-1) << sh;
+    dst[I_WORD(p)] = (dst[I_WORD(p)] & ~mask) | ((v << sh) & mask);
+}
+
+/* memmove for bits: copy n bits from src starting at bit s to dst starting at
+   bit d. the two ranges may overlap. words are copied with memmove when both
+   offsets have the same position inside a word, otherwise each destination
+   word is stitched from the two source words it straddles */
+static void bitarray_copybits(WORD *dst, size_t d, const WORD *src, size_t s,
+    size_t n)
+{
+    if (n == 0 || (dst == src && d == s))
+        return;
+    /* when the destination is behind the source, walk backwards so no source
+       bit is overwritten before it is read */
+    int backward = dst == src && d > s && d < s + n;
+
+    if (d % BITS_PER_WORD == s % BITS_PER_WORD) {
+        size_t head = (BITS_PER_WORD - d % BITS_PER_WORD) % BITS_PER_WORD;
+        if (head > n)
+            head = n;
+        size_t nwords = (n - head) / BITS_PER_WORD;
+        size_t tail = n - head - nwords * BITS_PER_WORD;
+        if (!backward && head != 0)
+            bitarray_deposit_word(dst, d, head, bitarray_extract_word(src, s, head));
+        if (backward && tail != 0)
+            bitarray_deposit_word(dst, d + n - tail, tail,
+                bitarray_extract_word(src, s + n - tail, tail));
+        memmove(&dst[I_WORD(d + head)], &src[I_WORD(s + head)],
+            nwords * sizeof(WORD));
+        if (backward && head != 0)
+            bitarray_deposit_word(dst, d, head, bitarray_extract_word(src, s, head));
+        if (!backward && tail != 0)
+            bitarray_deposit_word(dst, d + n - tail, tail,
+                bitarray_extract_word(src, s + n - tail, tail));
+        return;
+    }
+
+    if (!backward) {
+        for (size_t done = 0; done < n; ) {
+            size_t k = BITS_PER_WORD - (d + done) % BITS_PER_WORD;
+            if (k > n - done)
+                k = n - done;
+            bitarray_deposit_word(dst, d + done, k,
+                bitarray_extract_word(src, s + done, k));
+            done += k;
+        }
+    } else {
+        for (size_t left = n; left > 0; ) {
+            size_t k = (d + left) % BITS_PER_WORD;
+            if (k == 0)
+                k = BITS_PER_WORD;
+            if (k > left)
+                k = left;
+            left -= k;
+            bitarray_deposit_word(dst, d + left, k,
+                bitarray_extract_word(src, s + left, k));
+        }
+    }
+}
+
+/* writes the low k (1 <= k <= BITS_PER_WORD) bits of v to bit p onwards,
+   possibly across two words */
+static void bitarray_deposit_bits(WORD *dst, size_t p, size_t k, WORD v)
+{
+    size_t first = BITS_PER_WORD - p % BITS_PER_WORD;
+    if (k <= first) {
+        bitarray_deposit_word(dst, p, k, v);
+    } else {
+        bitarray_deposit_word(dst, p, first, v);
+        bitarray_deposit_word(dst, p + first, k - first, v >> first);
+    }
+}
+
+/* reverses the bit order of a 64-bit integer: swap bits, pairs and nibbles,
+   then the bytes */
+static uint64_t bitarray_bitrev64(uint64_t x)
+{
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_bswap64(x);
+#else
+    x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+    x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+    return (x >> 32) | (x << 32);
+#endif
+}
+
+/* reads k (1 <= k <= 64) bits starting at i as an unsigned integer, bit i
+   being the most significant one. one or two word loads with 64-bit words */
+static uint64_t bitarray_get_bits(Bitarray *ba, size_t i, size_t k)
+{
+    uint64_t v = 0;
+    for (size_t done = 0; done < k; done += BITS_PER_WORD) {
+        size_t n = k - done < BITS_PER_WORD ? k - done : BITS_PER_WORD;
+        v |= (uint64_t)bitarray_extract_word(ba->values, i + done, n) << done;
+    }
+    /* v has bit i in its lowest bit */
+    return bitarray_bitrev64(v) >> (64 - k);
+}
+
+/* writes the low k (1 <= k <= 64) bits of v starting at i, the most
+   significant one going to bit i */
+static void bitarray_set_bits(Bitarray *ba, size_t i, size_t k, uint64_t v)
+{
+    v = bitarray_bitrev64(v << (64 - k));
+    for (size_t done = 0; done < k; done += BITS_PER_WORD) {
+        size_t n = k - done < BITS_PER_WORD ? k - done : BITS_PER_WORD;
+        bitarray_deposit_bits(ba->values, i + done, n, (WORD)(v >> done));
+    }
+}
+
+/* bit reversal of a single word */
+static WORD bitarray_bitrev_word(WORD w)
+{
+#if BITARRAY_WORD_BITS == 64
+    return bitarray_bitrev64(w);
+#else
+    return (WORD)(bitarray_bitrev64(w) >> (64 - BITS_PER_WORD));
+#endif
+}
+
+#if defined(BITARRAY_LITTLE_ENDIAN) && (defined(__GNUC__) || defined(__clang__))
+    #if BITARRAY_WORD_BITS == 64
+        #define bitarray_bswap_word(w) __builtin_bswap64(w)
+    #else
+        #define bitarray_bswap_word(w) __builtin_bswap32(w)
+    #endif
+#endif
+
+/* reverses the whole array: the word order is reversed and every word bit
+   reversed, which moves bit i to nwords * BITS_PER_WORD - 1 - i. the unused
+   bits then sit at the bottom of word 0 and one funnel shift moves everything
+   down by that amount */
 static void bitarray_reverse(Bitarray *ba)
 {
-    for (size_t i = 0, j = ba->size-1; i < j; ++i, --j) {
-        int tmp = bitarray_get_bit(ba, i);
-        bitarray_set_bit(ba, i, bitarray_get_bit(ba, j));
-        bitarray_set_bit(ba, j, tmp);
+    size_t nwords = WORDS_FOR_BITS(ba->size);
+    size_t pad = nwords * BITS_PER_WORD - ba->size;
+    WORD *v = ba->values;
+#ifdef bitarray_bswap_word
+    /* bit i is bit i % 8 of byte i / 8 in memory, so reversing the bits of
+       each byte (the simd kernel) and then the byte order is the same thing */
+    bitarray_kernels.bitrev8((unsigned char *)v, (const unsigned char *)v,
+        nwords * sizeof(WORD));
+    for (size_t i = 0, j = nwords - 1; i < j; ++i, --j) {
+        WORD tmp = bitarray_bswap_word(v[i]);
+        v[i] = bitarray_bswap_word(v[j]);
+        v[j] = tmp;
+    }
+    if (nwords % 2)
+        v[nwords / 2] = bitarray_bswap_word(v[nwords / 2]);
+#else
+    for (size_t i = 0, j = nwords - 1; i < j; ++i, --j) {
+        WORD tmp = bitarray_bitrev_word(v[i]);
+        v[i] = bitarray_bitrev_word(v[j]);
+        v[j] = tmp;
+    }
+    if (nwords % 2)
+        v[nwords / 2] = bitarray_bitrev_word(v[nwords / 2]);
+#endif
+    if (pad == 0)
+        return;
+    for (size_t i = 0; i < nwords; ++i) {
+        WORD hi = i + 1 < nwords ? v[i + 1] : 0;
+        v[i] = (v[i] >> pad) | (hi << (BITS_PER_WORD - pad));
     }
 }
 
-/* copy values from ba to tg */
-static void bitarray_copyvalues(Bitarray *ba, Bitarray *tg)
+/* reverses the bits in [from, to). whole words are swapped from both ends
+   towards the middle, what is left (less than two words) is split in two
+   halves that are swapped, an odd middle bit stays where it is */
+static void bitarray_reverse_range(Bitarray *ba, size_t from, size_t to)
 {
-    for (size_t i = 0; i < WORDS_FOR_BITS(ba->size); ++i)
-        tg->values[i] = ba->values[i];
+    if (from == 0 && to == ba->size) {
+        bitarray_reverse(ba);
+        return;
+    }
+    size_t l = from, r = to;
+    while (r - l >= 2 * BITS_PER_WORD) {
+        r -= BITS_PER_WORD;
+        WORD a = bitarray_extract_word(ba->values, l, BITS_PER_WORD);
+        WORD b = bitarray_extract_word(ba->values, r, BITS_PER_WORD);
+        bitarray_deposit_bits(ba->values, l, BITS_PER_WORD, bitarray_bitrev_word(b));
+        bitarray_deposit_bits(ba->values, r, BITS_PER_WORD, bitarray_bitrev_word(a));
+        l += BITS_PER_WORD;
+    }
+    size_t h = (r - l) / 2;
+    if (h > 0) {
+        size_t sh = BITS_PER_WORD - h;
+        WORD a = bitarray_extract_word(ba->values, l, h);
+        WORD b = bitarray_extract_word(ba->values, r - h, h);
+        bitarray_deposit_bits(ba->values, l, h, bitarray_bitrev_word(b) >> sh);
+        bitarray_deposit_bits(ba->values, r - h, h, bitarray_bitrev_word(a) >> sh);
+    }
 }
 
-/* copy values from ba to tg, make tg[start] = ba[from], ...tg[to-from-1] = ba[to-1] */
+/* copy values from ba to tg, make tg[start] = ba[from], ...tg[to-from-1] = ba[to-1].
+   ba and tg may be the same array with overlapping ranges */
 static void bitarray_copyvalues2(Bitarray *ba, Bitarray *tg,
     size_t from, size_t to, size_t start)
 {
-    /* TODO: optimise situation where whole WORD copying is ok */
-    for(size_t i = 0; i < to - from; ++i)
-        bitarray_set_bit(tg, start + i, bitarray_get_bit(ba, from + i));
+    bitarray_copybits(tg->values, start, ba->values, from, to - from);
 }
 
 static int bitarray_equal(Bitarray *l, Bitarray *r)
 {
     if (l->size != r->size)
         return 0;
-    for (size_t i = 0; i < WORDS_FOR_BITS(l->size); ++i)
-        if (l->values[i] != r->values[i])
-            return 0;
-    return 1;
+    return bitarray_par_equal(l->values, r->values, WORDS_FOR_BITS(l->size));
+}
+
+/* shift engine. the array is big endian from the lua side: index 0 is the
+   leftmost bit, but it is stored in the least significant bit of word 0. so
+   a left shift (moving bits towards index 0) is a right shift of the words
+   and vice versa. q whole words are moved, then the remaining r bits are
+   funnelled in from the neighbouring word */
+
+/* tg[i] = ba[i + s], bits shifted in are 0. tg must be of the same size as ba
+   and may be ba itself */
+static void bitarray_be_lshift2(Bitarray *ba, Bitarray *tg, size_t s)
+{
+    size_t nwords = WORDS_FOR_BITS(ba->size);
+    size_t q = s / BITS_PER_WORD, r = s % BITS_PER_WORD;
+    if (s >= ba->size) {
+        for (size_t i = 0; i < nwords; ++i)
+            tg->values[i] = 0;
+        return;
+    }
+    /* source word is never behind the target word, so going forward is safe
+       when shifting in place */
+    for (size_t i = 0; i + q < nwords; ++i) {
+        WORD lo = ba->values[i + q];
+        WORD hi = i + q + 1 < nwords ? ba->values[i + q + 1] : 0;
+        tg->values[i] = r == 0 ? lo : (lo >> r) | (hi << (BITS_PER_WORD - r));
+    }
+    for (size_t i = nwords - q; i < nwords; ++i)
+        tg->values[i] = 0;
+    /* unused bits of ba are 0 so nothing but 0 is shifted into the tail */
+}
+
+/* tg[i + s] = ba[i], bits shifted in are 0. tg must be of the same size as ba
+   and may be ba itself */
+static void bitarray_be_rshift2(Bitarray *ba, Bitarray *tg, size_t s)
+{
+    size_t nwords = WORDS_FOR_BITS(ba->size);
+    size_t q = s / BITS_PER_WORD, r = s % BITS_PER_WORD;
+    if (s >= ba->size) {
+        for (size_t i = 0; i < nwords; ++i)
+            tg->values[i] = 0;
+        return;
+    }
+    /* source word is never ahead of the target word, go backwards */
+    for (size_t i = nwords; i-- > q; ) {
+        WORD hi = ba->values[i - q];
+        WORD lo = i > q ? ba->values[i - q - 1] : 0;
+        tg->values[i] = r == 0 ? hi : (hi << r) | (lo >> (BITS_PER_WORD - r));
+    }
+    for (size_t i = 0; i < q; ++i)
+        tg->values[i] = 0;
+    bitarray_clear_tail(tg);
 }
 
 static void bitarray_be_lshift(Bitarray *ba, size_t s)
 {
-    size_t sz = ba->size;
-    for (size_t i = 0; i + s < sz; ++i)
-        bitarray_set_bit(ba, i, bitarray_get_bit(ba, i + s));
-    for (size_t i = sz > s ? sz - s : 0; i < sz; ++i)
-        bitarray_set_bit(ba, i, 0);
+    bitarray_be_lshift2(ba, ba, s);
 }
 
 static void bitarray_be_rshift(Bitarray *ba, size_t s)
 {
-    size_t sz = ba->size;
-    for (size_t i = 0; i + s < sz; ++i)
-        bitarray_set_bit(ba, sz - i - 1, bitarray_get_bit(ba, sz - i - 1 - s));
-    for (size_t i = sz > s ? sz - s : 0; i < sz; ++i)
-        bitarray_set_bit(ba, sz - i - 1, 0);
+    bitarray_be_rshift2(ba, ba, s);
+}
+
+/* number of 1 bits in [from, to) */
+static size_t bitarray_count(Bitarray *ba, size_t from, size_t to)
+{
+    if (from >= to)
+        return 0;
+    size_t wf = I_WORD(from), wt = I_WORD(to - 1);
+    WORD head = (WORD)-1 << (from % BITS_PER_WORD);
+    WORD tail = to % BITS_PER_WORD ? I_BIT(to) - 1 : (WORD)-1;
+    if (wf == wt)
+        return bitarray_popcount_word(ba->values[wf] & head & tail);
+    return bitarray_popcount_word(ba->values[wf] & head)
+        + bitarray_par_popcount(ba->values + wf + 1, wt - wf - 1)
+        + bitarray_popcount_word(ba->values[wt] & tail);
+}
+
+/* sets bits [from, to) to 1 if b is truthy, else 0. only the first and the
+   last word are masked, the words in between are written whole */
+static void bitarray_fill_range(Bitarray *ba, size_t from, size_t to, int b)
+{
+    if (from >= to)
+        return;
+    size_t wf = I_WORD(from), wt = I_WORD(to - 1);
+    WORD head = (WORD)-1 << (from % BITS_PER_WORD);
+    WORD tail = to % BITS_PER_WORD ? I_BIT(to) - 1 : (WORD)-1;
+    WORD *w = ba->values;
+    if (wf == wt) {
+        w[wf] = b ? w[wf] | (head & tail) : w[wf] & ~(head & tail);
+        return;
+    }
+    w[wf] = b ? w[wf] | head : w[wf] & ~head;
+    bitarray_par_fill(w + wf + 1, b, wt - wf - 1);
+    w[wt] = b ? w[wt] | tail : w[wt] & ~tail;
+}
+
+/* 1 -> 0 and 0 -> 1 for the bits in [from, to) */
+static void bitarray_flip_range(Bitarray *ba, size_t from, size_t to)
+{
+    if (from >= to)
+        return;
+    size_t wf = I_WORD(from), wt = I_WORD(to - 1);
+    WORD head = (WORD)-1 << (from % BITS_PER_WORD);
+    WORD tail = to % BITS_PER_WORD ? I_BIT(to) - 1 : (WORD)-1;
+    WORD *w = ba->values;
+    if (wf == wt) {
+        w[wf] ^= head & tail;
+        return;
+    }
+    w[wf] ^= head;
+    bitarray_par_unary(bitarray_kernels.not_, w + wf + 1, w + wf + 1, wt - wf - 1);
+    w[wt] ^= tail;
+}
+
+/* atomic access to storage words, for arrays written by several threads at
+   once. C11 atomics when the compiler is in C11 mode, otherwise the gcc/clang
+   builtins, which follow the same memory model */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+    && !defined(__STDC_NO_ATOMICS__)
+    #include <stdatomic.h>
+    #define BITARRAY_HAVE_ATOMICS
+    #define bitarray_atomic_or(p, v) \
+        atomic_fetch_or_explicit((_Atomic WORD *)(p), (v), memory_order_acq_rel)
+    #define bitarray_atomic_and(p, v) \
+        atomic_fetch_and_explicit((_Atomic WORD *)(p), (v), memory_order_acq_rel)
+    #define bitarray_atomic_load(p) \
+        atomic_load_explicit((_Atomic WORD *)(p), memory_order_relaxed)
+#elif defined(__GNUC__) || defined(__clang__)
+    #define BITARRAY_HAVE_ATOMICS
+    #define bitarray_atomic_or(p, v)  __atomic_fetch_or((p), (v), __ATOMIC_ACQ_REL)
+    #define bitarray_atomic_and(p, v) __atomic_fetch_and((p), (v), __ATOMIC_ACQ_REL)
+    #define bitarray_atomic_load(p)   __atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+#ifdef BITARRAY_HAVE_ATOMICS
+/* sets the ith bit to 1, returns its old value */
+static int bitarray_test_and_set(Bitarray *ba, size_t i)
+{
+    return (bitarray_atomic_or(&ba->values[I_WORD(i)], I_BIT(i)) & I_BIT(i)) != 0;
+}
+
+/* sets the ith bit to 0, returns its old value */
+static int bitarray_test_and_clear(Bitarray *ba, size_t i)
+{
+    return (bitarray_atomic_and(&ba->values[I_WORD(i)], ~I_BIT(i)) & I_BIT(i)) != 0;
+}
+
+/* ors v into word k, leaving the unused bits alone. returns the old word */
+static WORD bitarray_fetch_or_word(Bitarray *ba, size_t k, WORD v)
+{
+    if (k == I_WORD(ba->size) && ba->size % BITS_PER_WORD != 0)
+        v &= I_BIT(ba->size) - 1;
+    return bitarray_atomic_or(&ba->values[k], v);
+}
+
+/* bitarray_count with every word read once, atomically, so that it can run
+   while other threads write. the result is not a snapshot */
+static size_t bitarray_count_relaxed(Bitarray *ba, size_t from, size_t to)
+{
+    size_t wf = I_WORD(from), wt = I_WORD(to - 1), c = 0;
+    WORD head = (WORD)-1 << (from % BITS_PER_WORD);
+    WORD tail = to % BITS_PER_WORD ? I_BIT(to) - 1 : (WORD)-1;
+    for (size_t k = wf; k <= wt; ++k) {
+        WORD w = bitarray_atomic_load(&ba->values[k]);
+        if (k == wf)
+            w &= head;
+        if (k == wt)
+            w &= tail;
+        c += bitarray_popcount_word(w);
+    }
+    return c;
+}
+#endif
+
+/* build the rank/select directory if it is not there. returns it, or NULL if
+   there is no memory for it */
+static BitarrayDirectory *bitarray_directory(Bitarray *ba)
+{
+    /* other users of shared words may have changed them since */
+    if (ba->shared != NULL)
+        bitarray_drop_directory(ba);
+    if (ba->dir != NULL)
+        return ba->dir;
+    size_t nwords = WORDS_FOR_BITS(ba->size);
+    size_t nblocks = (nwords + WORDS_PER_SUPERBLOCK - 1) / WORDS_PER_SUPERBLOCK;
+    BitarrayDirectory *dir = (BitarrayDirectory *)malloc(sizeof(BitarrayDirectory));
+    if (dir == NULL)
+        return NULL;
+    dir->nblocks = nblocks;
+    dir->blocks = (size_t *)malloc((nblocks + 1) * sizeof(size_t));
+    dir->samples = NULL;
+    if (dir->blocks == NULL)
+        goto fail;
+
+    dir->blocks[0] = 0;
+    for (size_t b = 0; b < nblocks; ++b) {
+        size_t w = b * WORDS_PER_SUPERBLOCK;
+        size_t n = nwords - w < WORDS_PER_SUPERBLOCK ? nwords - w : WORDS_PER_SUPERBLOCK;
+        dir->blocks[b + 1] = dir->blocks[b]
+            + bitarray_kernels.popcount(ba->values + w, n);
+    }
+
+    size_t total = dir->blocks[nblocks];
+    dir->nsamples = (total + BITARRAY_SELECT_SAMPLE - 1) / BITARRAY_SELECT_SAMPLE;
+    if (dir->nsamples != 0) {
+        dir->samples = (size_t *)malloc(dir->nsamples * sizeof(size_t));
+        if (dir->samples == NULL)
+            goto fail;
+        for (size_t b = 0, j = 0; b < nblocks && j < dir->nsamples; ++b)
+            while (j < dir->nsamples
+                && j * BITARRAY_SELECT_SAMPLE + 1 <= dir->blocks[b + 1])
+                dir->samples[j++] = b;
+    }
+    return ba->dir = dir;
+fail:
+    free(dir->blocks);
+    free(dir->samples);
+    free(dir);
+    return NULL;
+}
+
+/* number of 1 bits in [0, i). O(1) once the directory exists */
+static size_t bitarray_rank(Bitarray *ba, size_t i)
+{
+    BitarrayDirectory *dir = bitarray_directory(ba);
+    if (dir == NULL)
+        return bitarray_count(ba, 0, i);
+    size_t b = i / BITARRAY_SUPERBLOCK_BITS;
+    size_t w = b * WORDS_PER_SUPERBLOCK;
+    size_t c = dir->blocks[b]
+        + bitarray_kernels.popcount(ba->values + w, I_WORD(i) - w);
+    if (i % BITS_PER_WORD)
+        c += bitarray_popcount_word(ba->values[I_WORD(i)] & (I_BIT(i) - 1));
+    return c;
+}
+
+/* position of the kth (k >= 1) 1 bit in word w, which must have that many */
+static size_t bitarray_select_word(WORD w, size_t k)
+{
+    while (--k)
+        w &= w - 1;
+    return bitarray_ctz_word(w);
+}
+
+/* index of the kth (k >= 1) 1 bit. returns 0 if there are fewer than k 1
+   bits, otherwise the index is stored in i */
+static int bitarray_select(Bitarray *ba, size_t k, size_t *i)
+{
+    BitarrayDirectory *dir = bitarray_directory(ba);
+    size_t nwords = WORDS_FOR_BITS(ba->size);
+    size_t w = 0;
+    if (dir != NULL) {
+        if (k > dir->blocks[dir->nblocks])
+            return 0;
+        /* the superblock is between two samples, search that span */
+        size_t j = (k - 1) / BITARRAY_SELECT_SAMPLE;
+        size_t lo = dir->samples[j];
+        size_t hi = j + 1 < dir->nsamples ? dir->samples[j + 1] : dir->nblocks - 1;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo + 1) / 2;
+            if (dir->blocks[mid] < k)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        k -= dir->blocks[lo];
+        w = lo * WORDS_PER_SUPERBLOCK;
+    }
+    for (; w < nwords; ++w) {
+        size_t c = bitarray_popcount_word(ba->values[w]);
+        if (c >= k) {
+            *i = w * BITS_PER_WORD + bitarray_select_word(ba->values[w], k);
+            return 1;
+        }
+        k -= c;
+    }
+    return 0;
+}
+
+/* finds the first index >= from whose bit is b (1 or 0) in the nbits bits
+   of words w, skipping whole words that cannot match. returns 0 if there is
+   none, otherwise the index is stored in i */
+static int bitarray_find_next_words(const WORD *w, size_t nbits, size_t from,
+    int b, size_t *i)
+{
+    if (from >= nbits)
+        return 0;
+    size_t nwords = WORDS_FOR_BITS(nbits);
+    WORD flip = b ? 0 : (WORD)-1;
+    size_t k = I_WORD(from);
+    WORD cur = (w[k] ^ flip) & ((WORD)-1 << (from % BITS_PER_WORD));
+    while (cur == 0) {
+        if (++k == nwords)
+            return 0;
+        cur = w[k] ^ flip;
+    }
+    size_t idx = k * BITS_PER_WORD + bitarray_ctz_word(cur);
+    /* when looking for 0 the unused tail reads as 1s */
+    if (idx >= nbits)
+        return 0;
+    *i = idx;
+    return 1;
+}
+
+/* the same on the bits of ba */
+static int bitarray_find_next(Bitarray *ba, size_t from, int b, size_t *i)
+{
+    return bitarray_find_next_words(ba->values, ba->size, from, b, i);
+}
+
+/* finds the last index < before whose bit is b (1 or 0). returns 0 if there
+   is none, otherwise the index is stored in i */
+static int bitarray_find_prev(Bitarray *ba, size_t before, int b, size_t *i)
+{
+    if (before > ba->size)
+        before = ba->size;
+    if (before == 0)
+        return 0;
+    WORD flip = b ? 0 : (WORD)-1;
+    size_t w = I_WORD(before - 1);
+    /* bits up to and including before - 1, wraps to all ones at the top */
+    WORD cur = (ba->values[w] ^ flip) & ((I_BIT(before - 1) << 1) - 1);
+    while (cur == 0) {
+        if (w == 0)
+            return 0;
+        cur = ba->values[--w] ^ flip;
+    }
+    *i = w * BITS_PER_WORD + BITS_PER_WORD - 1 - bitarray_clz_word(cur);
+    return 1;
+}
+
+/* packs the first n bytes of the bit stream in w into out. byte k holds bits
+   8k to 8k+7, the lowest index in the most significant bit if msb is set and
+   in the least significant bit otherwise */
+static void bitarray_to_bytes(const WORD *w, unsigned char *out, size_t n,
+    int msb)
+{
+#ifdef BITARRAY_LITTLE_ENDIAN
+    if (msb)
+        bitarray_kernels.bitrev8(out, (const unsigned char *)w, n);
+    else
+        memcpy(out, w, n);
+#else
+    for (size_t k = 0; k < n; ++k) {
+        unsigned char b = (unsigned char)(w[k / sizeof(WORD)]
+            >> (CHAR_BIT * (k % sizeof(WORD))));
+        out[k] = msb ? bitarray_bitrev_table[b] : b;
+    }
+#endif
+}
+
+/* the reverse of bitarray_to_bytes. w must have room for n bytes rounded up
+   to whole words, the rest of the last word is set to 0 */
+static void bitarray_from_bytes(WORD *w, const unsigned char *in, size_t n,
+    int msb)
+{
+    size_t nwords = (n + sizeof(WORD) - 1) / sizeof(WORD);
+    if (nwords != 0)
+        w[nwords - 1] = 0;
+#ifdef BITARRAY_LITTLE_ENDIAN
+    if (msb)
+        bitarray_kernels.bitrev8((unsigned char *)w, in, n);
+    else
+        memcpy(w, in, n);
+#else
+    for (size_t k = 0; k < n; ++k) {
+        if (k % sizeof(WORD) == 0)
+            w[k / sizeof(WORD)] = 0;
+        WORD b = msb ? bitarray_bitrev_table[in[k]] : in[k];
+        w[k / sizeof(WORD)] |= b << (CHAR_BIT * (k % sizeof(WORD)));
+    }
+#endif
+}
+
+/* bytes moved per fread/fwrite call when streaming an array */
+#define BITARRAY_IO_CHUNK ((size_t)1 << 20)
+
+static void bitarray_put_le32(unsigned char *p, uint32_t v)
+{
+    for (int k = 0; k < 4; ++k)
+        p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static uint32_t bitarray_get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+        | (uint32_t)p[3] << 24;
+}
+
+/* fills the storage of ba, sized for hd->nbits, from payload p. the payload
+   words may have another size or byte order than the storage */
+static void bitarray_import(Bitarray *ba, const unsigned char *p,
+    const BitarrayHeader *hd)
+{
+    size_t nbytes = ba->size / CHAR_BIT + (ba->size % CHAR_BIT != 0);
+    if (bitarray_header_native(hd)) {
+        if (p != (const unsigned char *)ba->values)
+            memcpy(ba->values, p, WORDS_FOR_BITS(ba->size) * sizeof(WORD));
+    } else if (!hd->bigendian) {
+        /* little endian words of any size are a plain byte stream */
+        bitarray_from_bytes(ba->values, p, nbytes, 0);
+    } else {
+        size_t ws = hd->wordsize;
+        memset(ba->values, 0, WORDS_FOR_BITS(ba->size) * sizeof(WORD));
+        for (size_t k = 0; k < nbytes; ++k) {
+            WORD b = p[k - k % ws + ws - 1 - k % ws];
+            ba->values[k / sizeof(WORD)] |= b << (CHAR_BIT * (k % sizeof(WORD)));
+        }
+    }
+    /* a payload without checksum may come with garbage there */
+    bitarray_clear_tail(ba);
+}
+
+/* writes ba to f in the serialized form, with a checksum if crc is set.
+   returns 0 on a write error */
+static int bitarray_save(const Bitarray *ba, FILE *f, int crc)
+{
+    unsigned char h[BITARRAY_HEADER_BYTES];
+    bitarray_header_write(h, ba->size, crc);
+    uint32_t c = bitarray_kernels.crc32c(0, h, sizeof(h));
+    if (fwrite(h, 1, sizeof(h), f) != sizeof(h))
+        return 0;
+    const unsigned char *p = (const unsigned char *)ba->values;
+    size_t n = WORDS_FOR_BITS(ba->size) * sizeof(WORD);
+    /* checksum each chunk while it is still in cache */
+    while (n > 0) {
+        size_t k = n < BITARRAY_IO_CHUNK ? n : BITARRAY_IO_CHUNK;
+        if (crc)
+            c = bitarray_kernels.crc32c(c, p, k);
+        if (fwrite(p, 1, k, f) != k)
+            return 0;
+        p += k;
+        n -= k;
+    }
+    if (crc) {
+        unsigned char t[4];
+        bitarray_put_le32(t, c);
+        if (fwrite(t, 1, sizeof(t), f) != sizeof(t))
+            return 0;
+    }
+    return 1;
+}
+
+/* reads the payload and checksum following header h from f into ba, which
+   is sized for hd->nbits. returns NULL on success, or the problem */
+static const char *bitarray_read_payload(Bitarray *ba, FILE *f,
+    const unsigned char *h, const BitarrayHeader *hd)
+{
+    int native = bitarray_header_native(hd);
+    size_t n = bitarray_payload_bytes(hd);
+    unsigned char *buf = native ? (unsigned char *)ba->values
+        : (unsigned char *)malloc(n);
+    const char *err = NULL;
+    if (buf == NULL)
+        return "not enough memory";
+    uint32_t c = bitarray_kernels.crc32c(0, h, BITARRAY_HEADER_BYTES);
+    for (size_t off = 0; off < n && err == NULL; ) {
+        size_t k = n - off < BITARRAY_IO_CHUNK ? n - off : BITARRAY_IO_CHUNK;
+        if (fread(buf + off, 1, k, f) != k)
+            err = ferror(f) ? strerror(errno) : "data is truncated";
+        else if (hd->crc)
+            c = bitarray_kernels.crc32c(c, buf + off, k);
+        off += k;
+    }
+    if (err == NULL && hd->crc) {
+        unsigned char t[4];
+        if (fread(t, 1, sizeof(t), f) != sizeof(t))
+            err = ferror(f) ? strerror(errno) : "data is truncated";
+        else if (bitarray_get_le32(t) != c)
+            err = "checksum mismatch";
+    }
+    if (err == NULL)
+        bitarray_import(ba, buf, hd);
+    if (!native)
+        free(buf);
+    return err;
+}
+
+/* parses n '0'/'1' chars into bits 0 to n-1 of w, which must have room for
+   n bits rounded up to whole words. the rest of the last word is set to 0.
+   returns 0 if s holds any other char */
+static int bitarray_parse_binary(WORD *w, const char *s, size_t n)
+{
+    size_t nwords = WORDS_FOR_BITS(n);
+#ifdef BITARRAY_LITTLE_ENDIAN
+    if (nwords != 0)
+        w[nwords - 1] = 0;
+    return bitarray_kernels.parse01((unsigned char *)w, s, n);
+#else
+    for (size_t k = 0; k < nwords; ++k)
+        w[k] = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] != '0' && s[i] != '1')
+            return 0;
+        if (s[i] == '1')
+            w[I_WORD(i)] |= I_BIT(i);
+    }
+    return 1;
+#endif
+}
+
+/* writes bits 0 to n-1 of w as n '0'/'1' chars */
+static void bitarray_format_binary(char *d, const WORD *w, size_t n)
+{
+#ifdef BITARRAY_LITTLE_ENDIAN
+    bitarray_kernels.format01(d, (const unsigned char *)w, n);
+#else
+    for (size_t i = 0; i < n; ++i)
+        d[i] = (w[I_WORD(i)] & I_BIT(i)) ? '1' : '0';
+#endif
 }
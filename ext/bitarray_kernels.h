@@ -0,0 +1,653 @@
+/* bulk word kernels used by bitarray_impl.h. every kernel works on plain
+   WORD buffers of n words and knows nothing about unused bits, callers have
+   to clear them afterwards. a portable version always exists, SSE2, AVX2 and
+   AVX-512 versions are compiled in on x86 with gcc/clang and one set is
+   picked at runtime by bitarray_select_kernels(). popcount, byte bit
+   reversal, the '0'/'1' text conversions and crc32c are picked on their
+   own. define BITARRAY_NO_SIMD to build the
+   portable version only */
+#pragma once
+
+#if !defined(BITARRAY_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+    #define BITARRAY_X86_SIMD
+    #include <immintrin.h>
+#endif
+
+typedef struct bitarray_Kernels
+{
+    const char *name;
+    /* d = a OP b */
+    void (*and_)(WORD *d, const WORD *a, const WORD *b, size_t n);
+    void (*or_)(WORD *d, const WORD *a, const WORD *b, size_t n);
+    void (*xor_)(WORD *d, const WORD *a, const WORD *b, size_t n);
+    void (*andnot)(WORD *d, const WORD *a, const WORD *b, size_t n);
+    /* d = ~a */
+    void (*not_)(WORD *d, const WORD *a, size_t n);
+    /* all bits of d set to 1 if b is truthy, else 0 */
+    void (*fill)(WORD *d, int b, size_t n);
+    /* 1 if the buffers hold the same words */
+    int (*equal)(const WORD *a, const WORD *b, size_t n);
+    /* number of 1 bits. picked separately from the set above */
+    size_t (*popcount)(const WORD *a, size_t n);
+    /* d[i] = s[i] with the bit order reversed. picked separately as well */
+    void (*bitrev8)(unsigned char *d, const unsigned char *s, size_t n);
+    /* packs n '0'/'1' chars into bits, char i going to bit i % 8 of d[i / 8],
+       unused bits of the last byte are 0. returns 0 if s holds any other
+       char. picked separately */
+    int (*parse01)(unsigned char *d, const char *s, size_t n);
+    /* the reverse of parse01: n chars for the first n bits of s */
+    void (*format01)(char *d, const unsigned char *s, size_t n);
+    /* crc32c of n bytes, continuing from crc (0 to start, no extra
+       inversions needed). picked separately */
+    uint32_t (*crc32c)(uint32_t crc, const unsigned char *p, size_t n);
+} bitarray_Kernels;
+
+/* single word bit tricks, builtins where the compiler has them */
+#if defined(__GNUC__) || defined(__clang__)
+    #if BITARRAY_WORD_BITS == 64
+        #define bitarray_popcount_word(w) ((size_t)__builtin_popcountll(w))
+        #define bitarray_ctz_word(w)      ((size_t)__builtin_ctzll(w))
+        #define bitarray_clz_word(w)      ((size_t)__builtin_clzll(w))
+    #else
+        #define bitarray_popcount_word(w) ((size_t)__builtin_popcount(w))
+        #define bitarray_ctz_word(w)      ((size_t)__builtin_ctz(w))
+        #define bitarray_clz_word(w)      ((size_t)__builtin_clz(w))
+    #endif
+#else
+static size_t bitarray_popcount_word(WORD w)
+{
+    size_t c = 0;
+    for (; w != 0; w &= w - 1)
+        ++c;
+    return c;
+}
+
+/* w must not be 0 */
+static size_t bitarray_ctz_word(WORD w)
+{
+    size_t c = 0;
+    for (; !(w & 1); w >>= 1)
+        ++c;
+    return c;
+}
+
+/* w must not be 0 */
+static size_t bitarray_clz_word(WORD w)
+{
+    size_t c = 0;
+    for (; !(w >> (BITS_PER_WORD - 1)); w <<= 1)
+        ++c;
+    return c;
+}
+#endif
+
+#define BITARRAY_SCALAR_BINARY(NAME, OP) \
+    static void NAME(WORD *d, const WORD *a, const WORD *b, size_t n) \
+    { \
+        for (size_t i = 0; i < n; ++i) \
+            d[i] = OP(a[i], b[i]); \
+    }
+
+#define BITARRAY_OP_AND(x, y)    ((x) & (y))
+#define BITARRAY_OP_OR(x, y)     ((x) | (y))
+#define BITARRAY_OP_XOR(x, y)    ((x) ^ (y))
+#define BITARRAY_OP_ANDNOT(x, y) ((x) & ~(y))
+
+BITARRAY_SCALAR_BINARY(bitarray_and_scalar, BITARRAY_OP_AND)
+BITARRAY_SCALAR_BINARY(bitarray_or_scalar, BITARRAY_OP_OR)
+BITARRAY_SCALAR_BINARY(bitarray_xor_scalar, BITARRAY_OP_XOR)
+BITARRAY_SCALAR_BINARY(bitarray_andnot_scalar, BITARRAY_OP_ANDNOT)
+
+static void bitarray_not_scalar(WORD *d, const WORD *a, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        d[i] = ~a[i];
+}
+
+static void bitarray_fill_scalar(WORD *d, int b, size_t n)
+{
+    WORD bb = b ? (WORD)-1 : 0;
+    for (size_t i = 0; i < n; ++i)
+        d[i] = bb;
+}
+
+static int bitarray_equal_scalar(const WORD *a, const WORD *b, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (a[i] != b[i])
+            return 0;
+    return 1;
+}
+
+static size_t bitarray_popcount_scalar(const WORD *a, size_t n)
+{
+    size_t c = 0;
+    for (size_t i = 0; i < n; ++i)
+        c += bitarray_popcount_word(a[i]);
+    return c;
+}
+
+/* bit reversed bytes, bitarray_bitrev_table[0x01] == 0x80 */
+#define BITARRAY_R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define BITARRAY_R4(n) \
+    BITARRAY_R2(n), BITARRAY_R2(n + 2*16), BITARRAY_R2(n + 1*16), BITARRAY_R2(n + 3*16)
+#define BITARRAY_R6(n) \
+    BITARRAY_R4(n), BITARRAY_R4(n + 2*4), BITARRAY_R4(n + 1*4), BITARRAY_R4(n + 3*4)
+static const unsigned char bitarray_bitrev_table[256] = {
+    BITARRAY_R6(0), BITARRAY_R6(2), BITARRAY_R6(1), BITARRAY_R6(3)
+};
+#undef BITARRAY_R6
+#undef BITARRAY_R4
+#undef BITARRAY_R2
+
+static void bitarray_bitrev8_scalar(unsigned char *d, const unsigned char *s,
+    size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        d[i] = bitarray_bitrev_table[s[i]];
+}
+
+static int bitarray_parse01_scalar(unsigned char *d, const char *s, size_t n)
+{
+    unsigned bad = 0;
+    for (size_t i = 0; i < n; i += 8) {
+        unsigned b = 0;
+        for (size_t j = 0; j < 8 && i + j < n; ++j) {
+            /* anything below '0' wraps around */
+            unsigned c = (unsigned)((unsigned char)s[i + j] - '0');
+            bad |= c >> 1;
+            b |= (c & 1u) << j;
+        }
+        d[i / 8] = (unsigned char)b;
+    }
+    return bad == 0;
+}
+
+static void bitarray_format01_scalar(char *d, const unsigned char *s, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        d[i] = (char)('0' + ((s[i / 8] >> (i % 8)) & 1));
+}
+
+/* crc32c (Castagnoli), reflected polynomial 0x82F63B78. table[k][b] is the
+   crc of the byte b followed by k zero bytes so eight bytes can be folded in
+   at once (slicing-by-8). filled in by bitarray_select_kernels() */
+static uint32_t bitarray_crc32c_table[8][256];
+
+static void bitarray_crc32c_init(void)
+{
+    for (unsigned b = 0; b < 256; ++b) {
+        uint32_t c = b;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        bitarray_crc32c_table[0][b] = c;
+    }
+    for (unsigned b = 0; b < 256; ++b) {
+        for (int k = 1; k < 8; ++k) {
+            uint32_t c = bitarray_crc32c_table[k - 1][b];
+            bitarray_crc32c_table[k][b] = (c >> 8) ^ bitarray_crc32c_table[0][c & 0xFF];
+        }
+    }
+}
+
+static uint32_t bitarray_crc32c_scalar(uint32_t crc, const unsigned char *p,
+    size_t n)
+{
+    const uint32_t (*t)[256] = (const uint32_t (*)[256])bitarray_crc32c_table;
+    crc = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8
+            | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF]
+            ^ t[4][lo >> 24] ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; n > 0; --n)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+static bitarray_Kernels bitarray_kernels = {
+    "scalar",
+    bitarray_and_scalar, bitarray_or_scalar, bitarray_xor_scalar,
+    bitarray_andnot_scalar, bitarray_not_scalar, bitarray_fill_scalar,
+    bitarray_equal_scalar, bitarray_popcount_scalar, bitarray_bitrev8_scalar,
+    bitarray_parse01_scalar, bitarray_format01_scalar, bitarray_crc32c_scalar
+};
+
+#ifdef BITARRAY_X86_SIMD
+
+/* generates one kernel set. VEC is the vector type, the rest are intrinsics
+   or helper macros of that width. loads and stores are unaligned, the words
+   that do not fill a whole vector go through the scalar expression */
+#define BITARRAY_SIMD_KERNELS(ISA, TARGET, VEC, LOAD, STORE, AND, OR, XOR, \
+    ANDNOT, ONES, SET8, NEQ) \
+    \
+    BITARRAY_SIMD_BINARY(ISA, TARGET, VEC, LOAD, STORE, and, AND, BITARRAY_OP_AND) \
+    BITARRAY_SIMD_BINARY(ISA, TARGET, VEC, LOAD, STORE, or, OR, BITARRAY_OP_OR) \
+    BITARRAY_SIMD_BINARY(ISA, TARGET, VEC, LOAD, STORE, xor, XOR, BITARRAY_OP_XOR) \
+    BITARRAY_SIMD_BINARY(ISA, TARGET, VEC, LOAD, STORE, andnot, ANDNOT, \
+        BITARRAY_OP_ANDNOT) \
+    \
+    TARGET static void bitarray_not_ ## ISA(WORD *d, const WORD *a, size_t n) \
+    { \
+        const size_t step = sizeof(VEC) / sizeof(WORD); \
+        VEC ones = ONES(); \
+        size_t i = 0; \
+        for (; i + step <= n; i += step) \
+            STORE((VEC *)(d + i), XOR(LOAD((const VEC *)(a + i)), ones)); \
+        for (; i < n; ++i) \
+            d[i] = ~a[i]; \
+    } \
+    \
+    TARGET static void bitarray_fill_ ## ISA(WORD *d, int b, size_t n) \
+    { \
+        const size_t step = sizeof(VEC) / sizeof(WORD); \
+        VEC v = SET8(b ? -1 : 0); \
+        size_t i = 0; \
+        for (; i + step <= n; i += step) \
+            STORE((VEC *)(d + i), v); \
+        for (; i < n; ++i) \
+            d[i] = b ? (WORD)-1 : 0; \
+    } \
+    \
+    TARGET static int bitarray_equal_ ## ISA(const WORD *a, const WORD *b, \
+        size_t n) \
+    { \
+        const size_t step = sizeof(VEC) / sizeof(WORD); \
+        size_t i = 0; \
+        for (; i + step <= n; i += step) \
+            if (NEQ(LOAD((const VEC *)(a + i)), LOAD((const VEC *)(b + i)))) \
+                return 0; \
+        for (; i < n; ++i) \
+            if (a[i] != b[i]) \
+                return 0; \
+        return 1; \
+    } \
+    \
+    static const bitarray_Kernels bitarray_kernels_ ## ISA = { \
+        #ISA, \
+        bitarray_and_ ## ISA, bitarray_or_ ## ISA, bitarray_xor_ ## ISA, \
+        bitarray_andnot_ ## ISA, bitarray_not_ ## ISA, bitarray_fill_ ## ISA, \
+        bitarray_equal_ ## ISA, bitarray_popcount_scalar, bitarray_bitrev8_scalar, \
+        bitarray_parse01_scalar, bitarray_format01_scalar, bitarray_crc32c_scalar \
+    };
+
+#define BITARRAY_SIMD_BINARY(ISA, TARGET, VEC, LOAD, STORE, NAME, VOP, SOP) \
+    TARGET static void bitarray_ ## NAME ## _ ## ISA(WORD *d, const WORD *a, \
+        const WORD *b, size_t n) \
+    { \
+        const size_t step = sizeof(VEC) / sizeof(WORD); \
+        size_t i = 0; \
+        for (; i + step <= n; i += step) \
+            STORE((VEC *)(d + i), \
+                VOP(LOAD((const VEC *)(a + i)), LOAD((const VEC *)(b + i)))); \
+        for (; i < n; ++i) \
+            d[i] = SOP(a[i], b[i]); \
+    }
+
+/* the intrinsic andnot computes ~x & y, kernels want x & ~y */
+#define BITARRAY_SSE2_ANDNOT(x, y) _mm_andnot_si128((y), (x))
+#define BITARRAY_SSE2_ONES()       _mm_set1_epi8(-1)
+#define BITARRAY_SSE2_NEQ(x, y) \
+    (_mm_movemask_epi8(_mm_cmpeq_epi8((x), (y))) != 0xFFFF)
+
+BITARRAY_SIMD_KERNELS(sse2, __attribute__((target("sse2"))), __m128i,
+    _mm_loadu_si128, _mm_storeu_si128, _mm_and_si128, _mm_or_si128,
+    _mm_xor_si128, BITARRAY_SSE2_ANDNOT, BITARRAY_SSE2_ONES, _mm_set1_epi8,
+    BITARRAY_SSE2_NEQ)
+
+#define BITARRAY_AVX2_ANDNOT(x, y) _mm256_andnot_si256((y), (x))
+#define BITARRAY_AVX2_ONES()       _mm256_set1_epi8(-1)
+#define BITARRAY_AVX2_NEQ(x, y) \
+    (_mm256_movemask_epi8(_mm256_cmpeq_epi8((x), (y))) != -1)
+
+BITARRAY_SIMD_KERNELS(avx2, __attribute__((target("avx2"))), __m256i,
+    _mm256_loadu_si256, _mm256_storeu_si256, _mm256_and_si256,
+    _mm256_or_si256, _mm256_xor_si256, BITARRAY_AVX2_ANDNOT,
+    BITARRAY_AVX2_ONES, _mm256_set1_epi8, BITARRAY_AVX2_NEQ)
+
+#if (defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)
+    #define BITARRAY_X86_AVX512
+
+#define BITARRAY_AVX512_ANDNOT(x, y) _mm512_andnot_si512((y), (x))
+#define BITARRAY_AVX512_ONES()       _mm512_set1_epi32(-1)
+#define BITARRAY_AVX512_SET8(b)      _mm512_set1_epi32(b)
+#define BITARRAY_AVX512_NEQ(x, y)    (_mm512_cmpneq_epi32_mask((x), (y)) != 0)
+
+BITARRAY_SIMD_KERNELS(avx512, __attribute__((target("avx512f"))), __m512i,
+    _mm512_loadu_si512, _mm512_storeu_si512, _mm512_and_si512,
+    _mm512_or_si512, _mm512_xor_si512, BITARRAY_AVX512_ANDNOT,
+    BITARRAY_AVX512_ONES, BITARRAY_AVX512_SET8, BITARRAY_AVX512_NEQ)
+#endif
+
+/* popcount with the hardware instruction */
+__attribute__((target("popcnt")))
+static size_t bitarray_popcount_popcnt(const WORD *a, size_t n)
+{
+    size_t c = 0;
+    for (size_t i = 0; i < n; ++i)
+        c += bitarray_popcount_word(a[i]);
+    return c;
+}
+
+/* Harley-Seal popcount (Mula, Kurz, Lemire): 16 vectors at a time are summed
+   with carry-save adders so only one in 16 goes through the nibble lookup
+   popcount */
+#define BITARRAY_AVX2_POPCNT __attribute__((target("avx2,popcnt")))
+
+BITARRAY_AVX2_POPCNT static __m256i bitarray_popcount256(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+        _mm256_shuffle_epi8(lookup, hi));
+    /* four 64-bit partial sums */
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+/* carry-save adder: h:l = a + b + c */
+#define BITARRAY_CSA256(h, l, a, b, c) do { \
+    __m256i u_ = _mm256_xor_si256((a), (b)); \
+    (h) = _mm256_or_si256(_mm256_and_si256((a), (b)), _mm256_and_si256(u_, (c))); \
+    (l) = _mm256_xor_si256(u_, (c)); } while (0)
+
+BITARRAY_AVX2_POPCNT static size_t bitarray_popcount_avx2(const WORD *a, size_t n)
+{
+    const size_t step = sizeof(__m256i) / sizeof(WORD);
+    const __m256i *v = (const __m256i *)a;
+    size_t nv = n / step, i = 0;
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = total, twos = total, fours = total, eights = total;
+    __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+#define L(k) _mm256_loadu_si256(v + i + (k))
+    for (; i + 16 <= nv; i += 16) {
+        BITARRAY_CSA256(twosA, ones, ones, L(0), L(1));
+        BITARRAY_CSA256(twosB, ones, ones, L(2), L(3));
+        BITARRAY_CSA256(foursA, twos, twos, twosA, twosB);
+        BITARRAY_CSA256(twosA, ones, ones, L(4), L(5));
+        BITARRAY_CSA256(twosB, ones, ones, L(6), L(7));
+        BITARRAY_CSA256(foursB, twos, twos, twosA, twosB);
+        BITARRAY_CSA256(eightsA, fours, fours, foursA, foursB);
+        BITARRAY_CSA256(twosA, ones, ones, L(8), L(9));
+        BITARRAY_CSA256(twosB, ones, ones, L(10), L(11));
+        BITARRAY_CSA256(foursA, twos, twos, twosA, twosB);
+        BITARRAY_CSA256(twosA, ones, ones, L(12), L(13));
+        BITARRAY_CSA256(twosB, ones, ones, L(14), L(15));
+        BITARRAY_CSA256(foursB, twos, twos, twosA, twosB);
+        BITARRAY_CSA256(eightsB, fours, fours, foursA, foursB);
+        BITARRAY_CSA256(sixteens, eights, eights, eightsA, eightsB);
+        total = _mm256_add_epi64(total, bitarray_popcount256(sixteens));
+    }
+#undef L
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total,
+        _mm256_slli_epi64(bitarray_popcount256(eights), 3));
+    total = _mm256_add_epi64(total,
+        _mm256_slli_epi64(bitarray_popcount256(fours), 2));
+    total = _mm256_add_epi64(total,
+        _mm256_slli_epi64(bitarray_popcount256(twos), 1));
+    total = _mm256_add_epi64(total, bitarray_popcount256(ones));
+    for (; i < nv; ++i)
+        total = _mm256_add_epi64(total,
+            bitarray_popcount256(_mm256_loadu_si256(v + i)));
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    size_t c = (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    for (i = nv * step; i < n; ++i)
+        c += bitarray_popcount_word(a[i]);
+    return c;
+}
+
+#undef BITARRAY_CSA256
+#undef BITARRAY_AVX2_POPCNT
+
+/* byte bit reversal with a nibble shuffle: each nibble indexes a 16 entry
+   table of its reversal, the low nibble one pre-shifted to the high half */
+#define BITARRAY_NIBBLE_REV_LO \
+    0x00, (char)0x80, 0x40, (char)0xC0, 0x20, (char)0xA0, 0x60, (char)0xE0, \
+    0x10, (char)0x90, 0x50, (char)0xD0, 0x30, (char)0xB0, 0x70, (char)0xF0
+#define BITARRAY_NIBBLE_REV_HI \
+    0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF
+
+__attribute__((target("ssse3")))
+static void bitarray_bitrev8_ssse3(unsigned char *d, const unsigned char *s,
+    size_t n)
+{
+    const __m128i lo_tab = _mm_setr_epi8(BITARRAY_NIBBLE_REV_LO);
+    const __m128i hi_tab = _mm_setr_epi8(BITARRAY_NIBBLE_REV_HI);
+    const __m128i low = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i lo = _mm_shuffle_epi8(lo_tab, _mm_and_si128(v, low));
+        __m128i hi = _mm_shuffle_epi8(hi_tab,
+            _mm_and_si128(_mm_srli_epi16(v, 4), low));
+        _mm_storeu_si128((__m128i *)(d + i), _mm_or_si128(lo, hi));
+    }
+    for (; i < n; ++i)
+        d[i] = bitarray_bitrev_table[s[i]];
+}
+
+__attribute__((target("avx2")))
+static void bitarray_bitrev8_avx2(unsigned char *d, const unsigned char *s,
+    size_t n)
+{
+    const __m256i lo_tab = _mm256_setr_epi8(BITARRAY_NIBBLE_REV_LO,
+        BITARRAY_NIBBLE_REV_LO);
+    const __m256i hi_tab = _mm256_setr_epi8(BITARRAY_NIBBLE_REV_HI,
+        BITARRAY_NIBBLE_REV_HI);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_tab, _mm256_and_si256(v, low));
+        __m256i hi = _mm256_shuffle_epi8(hi_tab,
+            _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_or_si256(lo, hi));
+    }
+    for (; i < n; ++i)
+        d[i] = bitarray_bitrev_table[s[i]];
+}
+
+#undef BITARRAY_NIBBLE_REV_LO
+#undef BITARRAY_NIBBLE_REV_HI
+
+/* '0'/'1' text: parsing compares a vector of chars against both digits,
+   one movemask gives the bits and the other checks nothing else is there.
+   formatting spreads every input byte over 8 lanes, tests one bit per lane
+   and turns the all-ones result into '1'. the rest goes through the scalar
+   version, which starts on a byte boundary */
+__attribute__((target("sse2")))
+static int bitarray_parse01_sse2(unsigned char *d, const char *s, size_t n)
+{
+    const __m128i zero = _mm_set1_epi8('0'), one = _mm_set1_epi8('1');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned m1 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, one));
+        unsigned m0 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if ((m0 | m1) != 0xFFFFu)
+            return 0;
+        d[i / 8] = (unsigned char)m1;
+        d[i / 8 + 1] = (unsigned char)(m1 >> 8);
+    }
+    return bitarray_parse01_scalar(d + i / 8, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int bitarray_parse01_avx2(unsigned char *d, const char *s, size_t n)
+{
+    const __m256i zero = _mm256_set1_epi8('0'), one = _mm256_set1_epi8('1');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        uint32_t m1 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, one));
+        uint32_t m0 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        if ((m0 | m1) != 0xFFFFFFFFu)
+            return 0;
+        memcpy(d + i / 8, &m1, sizeof m1);
+    }
+    return bitarray_parse01_scalar(d + i / 8, s + i, n - i);
+}
+
+#define BITARRAY_SPREAD_SEL \
+    1, 2, 4, 8, 16, 32, 64, (char)0x80, 1, 2, 4, 8, 16, 32, 64, (char)0x80
+
+__attribute__((target("ssse3")))
+static void bitarray_format01_ssse3(char *d, const unsigned char *s, size_t n)
+{
+    const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+        1, 1, 1, 1, 1, 1, 1, 1);
+    const __m128i sel = _mm_setr_epi8(BITARRAY_SPREAD_SEL);
+    const __m128i zero = _mm_set1_epi8('0');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_shuffle_epi8(
+            _mm_cvtsi32_si128(s[i / 8] | s[i / 8 + 1] << 8), spread);
+        __m128i t = _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel);
+        _mm_storeu_si128((__m128i *)(d + i), _mm_sub_epi8(zero, t));
+    }
+    bitarray_format01_scalar(d + i, s + i / 8, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bitarray_format01_avx2(char *d, const unsigned char *s, size_t n)
+{
+    /* shuffles stay inside 128-bit lanes, the broadcast puts all four
+       source bytes in both of them */
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+        1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i sel = _mm256_setr_epi8(BITARRAY_SPREAD_SEL,
+        BITARRAY_SPREAD_SEL);
+    const __m256i zero = _mm256_set1_epi8('0');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        uint32_t x;
+        memcpy(&x, s + i / 8, sizeof x);
+        __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32((int)x), spread);
+        __m256i t = _mm256_cmpeq_epi8(_mm256_and_si256(v, sel), sel);
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_sub_epi8(zero, t));
+    }
+    bitarray_format01_scalar(d + i, s + i / 8, n - i);
+}
+
+#undef BITARRAY_SPREAD_SEL
+
+#ifdef BITARRAY_X86_AVX512
+/* AVX-512BW compares straight into a 64-bit mask and expands one back */
+__attribute__((target("avx512bw")))
+static int bitarray_parse01_avx512(unsigned char *d, const char *s, size_t n)
+{
+    const __m512i zero = _mm512_set1_epi8('0'), one = _mm512_set1_epi8('1');
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(s + i));
+        uint64_t m1 = _mm512_cmpeq_epi8_mask(v, one);
+        uint64_t m0 = _mm512_cmpeq_epi8_mask(v, zero);
+        if ((m0 | m1) != ~(uint64_t)0)
+            return 0;
+        memcpy(d + i / 8, &m1, sizeof m1);
+    }
+    return bitarray_parse01_scalar(d + i / 8, s + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static void bitarray_format01_avx512(char *d, const unsigned char *s, size_t n)
+{
+    const __m512i zero = _mm512_set1_epi8('0');
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t x;
+        memcpy(&x, s + i / 8, sizeof x);
+        _mm512_storeu_si512((void *)(d + i),
+            _mm512_sub_epi8(zero, _mm512_movm_epi8((__mmask64)x)));
+    }
+    bitarray_format01_scalar(d + i, s + i / 8, n - i);
+}
+#endif
+
+#ifdef __x86_64__
+/* the sse4.2 crc32 instruction computes crc32c, 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t bitarray_crc32c_sse42(uint32_t crc, const unsigned char *p,
+    size_t n)
+{
+    uint64_t c = (uint32_t)~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; n > 0; --n)
+        c32 = _mm_crc32_u8(c32, *p++);
+    return ~c32;
+}
+#endif
+
+#undef BITARRAY_SIMD_BINARY
+#undef BITARRAY_SIMD_KERNELS
+
+#endif /* BITARRAY_X86_SIMD */
+
+#undef BITARRAY_SCALAR_BINARY
+#undef BITARRAY_OP_AND
+#undef BITARRAY_OP_OR
+#undef BITARRAY_OP_XOR
+#undef BITARRAY_OP_ANDNOT
+
+/* picks the widest kernel set the cpu supports, and the fastest popcount.
+   must run once, before any kernel is used: the library calls it when the
+   first lua state loads it, and never again */
+static void bitarray_select_kernels(void)
+{
+    bitarray_crc32c_init();
+#ifdef BITARRAY_X86_SIMD
+    __builtin_cpu_init();
+#ifdef BITARRAY_X86_AVX512
+    if (__builtin_cpu_supports("avx512f"))
+        bitarray_kernels = bitarray_kernels_avx512;
+    else
+#endif
+    if (__builtin_cpu_supports("avx2"))
+        bitarray_kernels = bitarray_kernels_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        bitarray_kernels = bitarray_kernels_sse2;
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        bitarray_kernels.popcount = bitarray_popcount_avx2;
+    else if (__builtin_cpu_supports("popcnt"))
+        bitarray_kernels.popcount = bitarray_popcount_popcnt;
+
+    if (__builtin_cpu_supports("avx2"))
+        bitarray_kernels.bitrev8 = bitarray_bitrev8_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        bitarray_kernels.bitrev8 = bitarray_bitrev8_ssse3;
+
+#ifdef BITARRAY_X86_AVX512
+    if (__builtin_cpu_supports("avx512bw")) {
+        bitarray_kernels.parse01 = bitarray_parse01_avx512;
+        bitarray_kernels.format01 = bitarray_format01_avx512;
+    } else
+#endif
+    if (__builtin_cpu_supports("avx2")) {
+        bitarray_kernels.parse01 = bitarray_parse01_avx2;
+        bitarray_kernels.format01 = bitarray_format01_avx2;
+    } else {
+        if (__builtin_cpu_supports("sse2"))
+            bitarray_kernels.parse01 = bitarray_parse01_sse2;
+        if (__builtin_cpu_supports("ssse3"))
+            bitarray_kernels.format01 = bitarray_format01_ssse3;
+    }
+
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("sse4.2"))
+        bitarray_kernels.crc32c = bitarray_crc32c_sse42;
+#endif
+#endif
+}
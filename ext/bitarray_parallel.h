@@ -0,0 +1,372 @@
+/* optional worker pool for the bulk kernels. a call over at least
+   bitarray_pool.threshold bytes is cut into one cache line aligned part per
+   thread, the calling thread working on one of them. smaller calls, and every
+   call while the pool is off (one thread, the default) or busy with another
+   caller, run the kernel directly as before. posix threads only, define
+   BITARRAY_NO_THREADS to leave the pool out */
+#pragma once
+
+#if !defined(BITARRAY_NO_THREADS) && (defined(__unix__) || defined(__unix) \
+    || (defined(__APPLE__) && defined(__MACH__)))
+    #define BITARRAY_HAVE_THREADS
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+/* most threads a pool can have */
+#define BITARRAY_MAX_THREADS 256
+/* parts never split a cache line */
+#define BITARRAY_LINE_WORDS (64 / sizeof(WORD))
+
+/* one bulk call cut into parts. part p > 0 covers words skew + p * chunk
+   onwards, part 0 everything before */
+typedef struct BitarrayTask
+{
+    WORD *d;
+    const WORD *a, *b;
+    size_t n, chunk, skew;
+    int value;
+    void (*binary)(WORD *d, const WORD *a, const WORD *b, size_t n);
+    void (*unary)(WORD *d, const WORD *a, size_t n);
+    void *arg; /* for tasks defined elsewhere */
+    size_t results[BITARRAY_MAX_THREADS];
+} BitarrayTask;
+
+static struct BitarrayPool
+{
+    size_t threads;   /* including the calling thread */
+    size_t threshold; /* bytes */
+#ifdef BITARRAY_HAVE_THREADS
+    size_t users;     /* lua states that loaded the library */
+    pthread_mutex_t submit; /* held by the caller owning the workers */
+    pthread_mutex_t lock;   /* guards everything below */
+    pthread_cond_t wake, done;
+    pthread_t workers[BITARRAY_MAX_THREADS];
+    size_t nworkers;
+    int quit;
+    void (*run)(BitarrayTask *t, size_t part);
+    BitarrayTask *task;
+    size_t nparts, next, finished;
+#endif
+} bitarray_pool = {
+    1, (size_t)4 << 20,
+#ifdef BITARRAY_HAVE_THREADS
+    0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    { 0 }, 0, 0, NULL, NULL, 0, 0, 0
+#endif
+};
+
+/* threads and threshold are set by any lua state and read by every bulk
+   call, on any thread, without taking a lock */
+#if defined(__GNUC__) || defined(__clang__)
+    #define bitarray_pool_get(field) __atomic_load_n(&bitarray_pool.field, __ATOMIC_RELAXED)
+    #define bitarray_pool_set(field, v) \
+        __atomic_store_n(&bitarray_pool.field, (v), __ATOMIC_RELAXED)
+    #define bitarray_pool_swap(field, v) \
+        __atomic_exchange_n(&bitarray_pool.field, (v), __ATOMIC_RELAXED)
+#else
+    #define bitarray_pool_get(field) (bitarray_pool.field)
+    #define bitarray_pool_set(field, v) ((void)(bitarray_pool.field = (v)))
+    static size_t bitarray_pool_swap_(size_t *p, size_t v)
+    {
+        size_t old = *p;
+        *p = v;
+        return old;
+    }
+    #define bitarray_pool_swap(field, v) bitarray_pool_swap_(&bitarray_pool.field, (v))
+#endif
+
+#ifdef BITARRAY_HAVE_THREADS
+static void *bitarray_worker(void *arg)
+{
+    struct BitarrayPool *pool = &bitarray_pool;
+    (void)arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->next >= pool->nparts)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+            break;
+        size_t part = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->run(pool->task, part);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->nparts)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* stops all workers. the caller holds submit */
+static void bitarray_pool_stop(void)
+{
+    struct BitarrayPool *pool = &bitarray_pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->nworkers; ++i)
+        pthread_join(pool->workers[i], NULL);
+    pool->nworkers = 0;
+    pool->quit = 0;
+}
+
+/* runs all parts of t, with the workers if they are free */
+static void bitarray_pool_run(void (*run)(BitarrayTask *t, size_t part),
+    BitarrayTask *t, size_t nparts)
+{
+    struct BitarrayPool *pool = &bitarray_pool;
+    if (pthread_mutex_trylock(&pool->submit) != 0) {
+        for (size_t p = 0; p < nparts; ++p)
+            run(t, p);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->run = run;
+    pool->task = t;
+    pool->nparts = nparts;
+    pool->next = 0;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->next < nparts) {
+        size_t part = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        run(t, part);
+        pthread_mutex_lock(&pool->lock);
+        ++pool->finished;
+    }
+    while (pool->finished < nparts)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit);
+}
+
+/* starts workers until the pool has n threads. the caller holds submit */
+static void bitarray_pool_start(size_t n)
+{
+    struct BitarrayPool *pool = &bitarray_pool;
+    bitarray_pool_stop();
+    while (pool->nworkers + 1 < n && pthread_create(
+        &pool->workers[pool->nworkers], NULL, bitarray_worker, NULL) == 0)
+        ++pool->nworkers;
+    bitarray_pool_set(threads, pool->nworkers + 1);
+}
+
+/* resizes the pool to n threads, 0 for one per online cpu. returns the
+   number of threads it ended up with */
+static size_t bitarray_pool_resize(size_t n)
+{
+    struct BitarrayPool *pool = &bitarray_pool;
+    if (n == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (n > BITARRAY_MAX_THREADS)
+        n = BITARRAY_MAX_THREADS;
+    pthread_mutex_lock(&pool->submit);
+    bitarray_pool_start(n);
+    n = pool->threads;
+    pthread_mutex_unlock(&pool->submit);
+    return n;
+}
+
+/* a lua state loaded (1) or closed (-1) the library. the workers go away
+   with the last one, before the library can be unloaded under them */
+static void bitarray_pool_use(int delta)
+{
+    struct BitarrayPool *pool = &bitarray_pool;
+    pthread_mutex_lock(&pool->submit);
+    if (delta > 0)
+        ++pool->users;
+    else if (--pool->users == 0)
+        bitarray_pool_start(1);
+    pthread_mutex_unlock(&pool->submit);
+}
+#else
+static void bitarray_pool_run(void (*run)(BitarrayTask *t, size_t part),
+    BitarrayTask *t, size_t nparts)
+{
+    for (size_t p = 0; p < nparts; ++p)
+        run(t, p);
+}
+
+static size_t bitarray_pool_resize(size_t n)
+{
+    (void)n;
+    return 1;
+}
+
+static void bitarray_pool_use(int delta)
+{
+    (void)delta;
+}
+#endif
+
+/* number of parts to cut a call over n words into, 1 to run it directly */
+static size_t bitarray_parts(size_t n)
+{
+    size_t threads = bitarray_pool_get(threads);
+    if (threads <= 1 || n < 2 * BITARRAY_LINE_WORDS
+        || n * sizeof(WORD) < bitarray_pool_get(threshold))
+        return 1;
+    return threads;
+}
+
+/* fills t->chunk and t->skew for at most nparts parts, so that every part
+   but the first starts on a cache line of base, the words written (or read,
+   if nothing is), and no two parts write to the same line. returns how many
+   parts hold any word */
+static size_t bitarray_task_split(BitarrayTask *t, size_t nparts, const void *base)
+{
+    size_t chunk = (t->n + nparts - 1) / nparts;
+    t->chunk = (chunk + BITARRAY_LINE_WORDS - 1) / BITARRAY_LINE_WORDS
+        * BITARRAY_LINE_WORDS;
+    t->skew = (64 - (uintptr_t)base % 64) % 64 / sizeof(WORD);
+    if (t->n <= t->skew + t->chunk)
+        return 1;
+    return (t->n - t->skew + t->chunk - 1) / t->chunk;
+}
+
+/* words of part p, sets *from to the first one */
+static size_t bitarray_task_part(const BitarrayTask *t, size_t p, size_t *from)
+{
+    size_t to = t->skew + (p + 1) * t->chunk;
+    *from = p == 0 ? 0 : t->skew + p * t->chunk;
+    return (t->n < to ? t->n : to) - *from;
+}
+
+static void bitarray_task_binary(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    t->binary(t->d + from, t->a + from, t->b + from, k);
+}
+
+static void bitarray_task_unary(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    t->unary(t->d + from, t->a + from, k);
+}
+
+static void bitarray_task_fill(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    bitarray_kernels.fill(t->d + from, t->value, k);
+}
+
+static void bitarray_task_copy(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    memcpy(t->d + from, t->a + from, k * sizeof(WORD));
+}
+
+static void bitarray_task_popcount(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    t->results[p] = bitarray_kernels.popcount(t->a + from, k);
+}
+
+static void bitarray_task_equal(BitarrayTask *t, size_t p)
+{
+    size_t from, k = bitarray_task_part(t, p, &from);
+    t->results[p] = (size_t)bitarray_kernels.equal(t->a + from, t->b + from, k);
+}
+
+/* the kernels below behave like the ones they take or call, over the pool
+   when n is large enough */
+
+static void bitarray_par_binary(void (*kernel)(WORD *, const WORD *,
+    const WORD *, size_t), WORD *d, const WORD *a, const WORD *b, size_t n)
+{
+    size_t nparts = bitarray_parts(n);
+    if (nparts == 1) {
+        kernel(d, a, b, n);
+        return;
+    }
+    BitarrayTask t;
+    t.d = d;
+    t.a = a;
+    t.b = b;
+    t.n = n;
+    t.binary = kernel;
+    bitarray_pool_run(bitarray_task_binary, &t, bitarray_task_split(&t, nparts, d));
+}
+
+static void bitarray_par_unary(void (*kernel)(WORD *, const WORD *, size_t),
+    WORD *d, const WORD *a, size_t n)
+{
+    size_t nparts = bitarray_parts(n);
+    if (nparts == 1) {
+        kernel(d, a, n);
+        return;
+    }
+    BitarrayTask t;
+    t.d = d;
+    t.a = a;
+    t.n = n;
+    t.unary = kernel;
+    bitarray_pool_run(bitarray_task_unary, &t, bitarray_task_split(&t, nparts, d));
+}
+
+static void bitarray_par_fill(WORD *d, int b, size_t n)
+{
+    size_t nparts = bitarray_parts(n);
+    if (nparts == 1) {
+        bitarray_kernels.fill(d, b, n);
+        return;
+    }
+    BitarrayTask t;
+    t.d = d;
+    t.n = n;
+    t.value = b;
+    bitarray_pool_run(bitarray_task_fill, &t, bitarray_task_split(&t, nparts, d));
+}
+
+/* d and a must not overlap */
+static void bitarray_par_copy(WORD *d, const WORD *a, size_t n)
+{
+    size_t nparts = bitarray_parts(n);
+    if (nparts == 1) {
+        memcpy(d, a, n * sizeof(WORD));
+        return;
+    }
+    BitarrayTask t;
+    t.d = d;
+    t.a = a;
+    t.n = n;
+    bitarray_pool_run(bitarray_task_copy, &t, bitarray_task_split(&t, nparts, d));
+}
+
+static size_t bitarray_par_popcount(const WORD *a, size_t n)
+{
+    size_t nparts = bitarray_parts(n);
+    if (nparts == 1)
+        return bitarray_kernels.popcount(a, n);
+    BitarrayTask t;
+    t.a = a;
+    t.n = n;
+    nparts = bitarray_task_split(&t, nparts, a);
+    bitarray_pool_run(bitarray_task_popcount, &t, nparts);
+    size_t c = 0;
+    for (size_t p = 0; p < nparts; ++p)
+        c += t.results[p];
+    return c;
+}
+
+static int bitarray_par_equal(const WORD *a, const WORD *b, size_t n)
+{
+    size_t nparts = bitarray_parts(n);
+    if (nparts == 1)
+        return bitarray_kernels.equal(a, b, n);
+    BitarrayTask t;
+    t.a = a;
+    t.b = b;
+    t.n = n;
+    nparts = bitarray_task_split(&t, nparts, a);
+    bitarray_pool_run(bitarray_task_equal, &t, nparts);
+    for (size_t p = 0; p < nparts; ++p)
+        if (!t.results[p])
+            return 0;
+    return 1;
+}
@@ -0,0 +1,669 @@
+/* compressed bit array for sparse data, after Roaring bitmaps (Chambi, Lemire,
+   Kaser, Godin). the index space is cut into chunks of 2^16 bits and chunks
+   without any 1 bit are not stored at all. every other chunk is held in one
+   of three containers, the smallest one for its contents:
+   - array: the sorted 16-bit offsets of its 1 bits, at most 4096 of them
+   - bitmap: the 2^16 bits as plain words, laid out like a Bitarray
+   - run: sorted, disjoint and non adjacent [first, last] ranges of 1 bits,
+     stored as pairs of 16-bit offsets
+   note all indices start with 0 in this file */
+#pragma once
+
+#include "bitarray_impl.h"
+
+#define BITARRAY_CHUNK_BITS  65536
+#define BITARRAY_CHUNK_WORDS (BITARRAY_CHUNK_BITS / BITS_PER_WORD)
+#define BITARRAY_CHUNK_BYTES (BITARRAY_CHUNK_WORDS * sizeof(WORD))
+/* an array container larger than this is bigger than a bitmap */
+#define BITARRAY_ARRAY_MAX   4096
+
+enum { BITARRAY_ARRAY, BITARRAY_BITMAP, BITARRAY_RUN };
+
+/* binary operations on sparse arrays */
+enum { BITARRAY_SPARSE_AND, BITARRAY_SPARSE_OR, BITARRAY_SPARSE_XOR };
+
+typedef struct BitarrayChunk
+{
+    size_t key;    /* holds bits key * 2^16 to key * 2^16 + 2^16 - 1 */
+    size_t card;   /* number of 1 bits, never 0 for a stored chunk */
+    size_t n;      /* values of an array container, ranges of a run container */
+    size_t cap;    /* room for that many values or ranges */
+    int type;
+    /* uint16_t[cap], WORD[BITARRAY_CHUNK_WORDS] or uint16_t[2 * cap] */
+    void *data;
+} BitarrayChunk;
+
+typedef struct BitarraySparse
+{
+    size_t size;
+    size_t n, cap;
+    BitarrayChunk *chunks; /* sorted by key */
+} BitarraySparse;
+
+/* sets bits [from, to) of w */
+static void bitarray_words_fill(WORD *w, size_t from, size_t to)
+{
+    if (from >= to)
+        return;
+    size_t wf = I_WORD(from), wt = I_WORD(to - 1);
+    WORD head = (WORD)-1 << (from % BITS_PER_WORD);
+    WORD tail = to % BITS_PER_WORD ? I_BIT(to) - 1 : (WORD)-1;
+    if (wf == wt) {
+        w[wf] |= head & tail;
+        return;
+    }
+    w[wf] |= head;
+    for (size_t i = wf + 1; i < wt; ++i)
+        w[i] = (WORD)-1;
+    w[wt] |= tail;
+}
+
+/* number of entries among v[0], v[stride], ... v[(n - 1) * stride] that are
+   <= x. the entries are sorted */
+static size_t bitarray_upper16(const uint16_t *v, size_t n, size_t stride,
+    unsigned x)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v[mid * stride] <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* container helpers. a chunk whose data is NULL owns nothing */
+
+static void bitarray_chunk_free(BitarrayChunk *c)
+{
+    free(c->data);
+    c->data = NULL;
+}
+
+/* gives c an uninitialized container of the type for n values or ranges.
+   returns 0 if out of memory */
+static int bitarray_chunk_alloc(BitarrayChunk *c, int type, size_t n)
+{
+    size_t bytes = type == BITARRAY_BITMAP ? BITARRAY_CHUNK_BYTES
+        : (type == BITARRAY_RUN ? 2 : 1) * n * sizeof(uint16_t);
+    c->data = malloc(bytes);
+    if (c->data == NULL)
+        return 0;
+    c->type = type;
+    c->n = type == BITARRAY_BITMAP ? 0 : n;
+    c->cap = c->n;
+    return 1;
+}
+
+/* makes room for n values or ranges. returns 0 if out of memory */
+static int bitarray_chunk_reserve(BitarrayChunk *c, size_t n)
+{
+    if (n <= c->cap)
+        return 1;
+    size_t cap = c->cap * 2 > n ? c->cap * 2 : n;
+    if (c->type == BITARRAY_ARRAY && cap > BITARRAY_ARRAY_MAX)
+        cap = BITARRAY_ARRAY_MAX;
+    size_t unit = (c->type == BITARRAY_RUN ? 2 : 1) * sizeof(uint16_t);
+    void *tmp = realloc(c->data, cap * unit);
+    if (tmp == NULL)
+        return 0;
+    c->data = tmp;
+    c->cap = cap;
+    return 1;
+}
+
+/* which container is the smallest for card 1 bits forming nruns ranges. an
+   array wins ties with the bitmap, runs have to be strictly smaller */
+static int bitarray_chunk_best(size_t card, size_t nruns)
+{
+    size_t array = card <= BITARRAY_ARRAY_MAX ? card * sizeof(uint16_t) : SIZE_MAX;
+    size_t run = nruns * 2 * sizeof(uint16_t);
+    if (run < array && run < BITARRAY_CHUNK_BYTES)
+        return BITARRAY_RUN;
+    return array <= BITARRAY_CHUNK_BYTES ? BITARRAY_ARRAY : BITARRAY_BITMAP;
+}
+
+static int bitarray_chunk_get(const BitarrayChunk *c, unsigned low)
+{
+    const uint16_t *v = (const uint16_t *)c->data;
+    size_t p;
+    switch (c->type) {
+    case BITARRAY_BITMAP:
+        return (((const WORD *)c->data)[I_WORD(low)] & I_BIT(low)) != 0;
+    case BITARRAY_ARRAY:
+        p = bitarray_upper16(v, c->n, 1, low);
+        return p > 0 && v[p - 1] == low;
+    default:
+        p = bitarray_upper16(v, c->n, 2, low);
+        return p > 0 && v[2 * p - 1] >= low;
+    }
+}
+
+/* writes the contents of c to the bitmap w */
+static void bitarray_chunk_to_bitmap(const BitarrayChunk *c, WORD *w)
+{
+    const uint16_t *v = (const uint16_t *)c->data;
+    if (c->type == BITARRAY_BITMAP) {
+        memcpy(w, c->data, BITARRAY_CHUNK_BYTES);
+        return;
+    }
+    memset(w, 0, BITARRAY_CHUNK_BYTES);
+    if (c->type == BITARRAY_ARRAY) {
+        for (size_t k = 0; k < c->n; ++k)
+            w[I_WORD(v[k])] |= I_BIT(v[k]);
+    } else {
+        for (size_t k = 0; k < c->n; ++k)
+            bitarray_words_fill(w, v[2 * k], (size_t)v[2 * k + 1] + 1);
+    }
+}
+
+/* fills c with the n sorted, distinct offsets in v using the smallest
+   container. n must not be 0. returns 0 if out of memory */
+static int bitarray_chunk_from_array(BitarrayChunk *c, const uint16_t *v,
+    size_t n)
+{
+    size_t nruns = 1;
+    for (size_t k = 1; k < n; ++k)
+        nruns += v[k] != v[k - 1] + 1;
+    int type = bitarray_chunk_best(n, nruns);
+    if (!bitarray_chunk_alloc(c, type, type == BITARRAY_RUN ? nruns : n))
+        return 0;
+    c->card = n;
+    uint16_t *d = (uint16_t *)c->data;
+    if (type == BITARRAY_ARRAY) {
+        memcpy(d, v, n * sizeof(uint16_t));
+    } else if (type == BITARRAY_BITMAP) {
+        WORD *w = (WORD *)c->data;
+        memset(w, 0, BITARRAY_CHUNK_BYTES);
+        for (size_t k = 0; k < n; ++k)
+            w[I_WORD(v[k])] |= I_BIT(v[k]);
+    } else {
+        size_t r = 0;
+        for (size_t k = 0; k < n; ++k) {
+            if (k == 0 || v[k] != v[k - 1] + 1)
+                d[2 * r++] = v[k];
+            d[2 * r - 1] = v[k];
+        }
+    }
+    return 1;
+}
+
+/* fills c with the card 1 bits of the bitmap w using the smallest container.
+   card must not be 0. returns 0 if out of memory */
+static int bitarray_chunk_from_bitmap(BitarrayChunk *c, const WORD *w,
+    size_t card)
+{
+    /* a range starts at every 1 bit whose lower neighbour is 0 */
+    size_t nruns = 0;
+    WORD carry = 0;
+    for (size_t i = 0; i < BITARRAY_CHUNK_WORDS; ++i) {
+        nruns += bitarray_popcount_word(w[i] & ~((w[i] << 1) | carry));
+        carry = w[i] >> (BITS_PER_WORD - 1);
+    }
+    int type = bitarray_chunk_best(card, nruns);
+    if (!bitarray_chunk_alloc(c, type, type == BITARRAY_RUN ? nruns : card))
+        return 0;
+    c->card = card;
+    uint16_t *d = (uint16_t *)c->data;
+    if (type == BITARRAY_BITMAP) {
+        memcpy(c->data, w, BITARRAY_CHUNK_BYTES);
+    } else if (type == BITARRAY_ARRAY) {
+        size_t k = 0;
+        for (size_t i = 0; i < BITARRAY_CHUNK_WORDS; ++i)
+            for (WORD x = w[i]; x != 0; x &= x - 1)
+                d[k++] = (uint16_t)(i * BITS_PER_WORD + bitarray_ctz_word(x));
+    } else {
+        size_t from = 0, first, end, r = 0;
+        while (bitarray_find_next_words(w, BITARRAY_CHUNK_BITS, from, 1, &first)) {
+            if (!bitarray_find_next_words(w, BITARRAY_CHUNK_BITS, first, 0, &end))
+                end = BITARRAY_CHUNK_BITS;
+            d[2 * r] = (uint16_t)first;
+            d[2 * r + 1] = (uint16_t)(end - 1);
+            ++r;
+            from = end;
+        }
+    }
+    return 1;
+}
+
+/* rebuilds c in the smallest container for its contents. c is left as it is
+   if out of memory */
+static void bitarray_chunk_shrink(BitarrayChunk *c)
+{
+    WORD *w = (WORD *)malloc(BITARRAY_CHUNK_BYTES);
+    if (w == NULL)
+        return;
+    BitarrayChunk t = *c;
+    bitarray_chunk_to_bitmap(c, w);
+    if (bitarray_chunk_from_bitmap(&t, w, c->card)) {
+        bitarray_chunk_free(c);
+        *c = t;
+    }
+    free(w);
+}
+
+static int bitarray_chunk_copy(BitarrayChunk *dst, const BitarrayChunk *src)
+{
+    size_t n = src->type == BITARRAY_BITMAP ? 0 : src->n;
+    if (!bitarray_chunk_alloc(dst, src->type, n))
+        return 0;
+    dst->key = src->key;
+    dst->card = src->card;
+    memcpy(dst->data, src->data, src->type == BITARRAY_BITMAP ?
+        BITARRAY_CHUNK_BYTES
+        : (src->type == BITARRAY_RUN ? 2 : 1) * n * sizeof(uint16_t));
+    return 1;
+}
+
+/* sets (b = 1) or clears the bit at low. a full array turns into another
+   container, and so does a bitmap that becomes small enough to be an array
+   or a run container that grew bigger than the alternatives. returns 0 if
+   out of memory, c is then unchanged */
+static int bitarray_chunk_set(BitarrayChunk *c, unsigned low, int b)
+{
+    if (bitarray_chunk_get(c, low) == b)
+        return 1;
+    uint16_t *v = (uint16_t *)c->data;
+    size_t n = c->n;
+    if (c->type == BITARRAY_BITMAP) {
+        ((WORD *)c->data)[I_WORD(low)] ^= I_BIT(low);
+        if (b) {
+            ++c->card;
+        } else if (--c->card <= BITARRAY_ARRAY_MAX && c->card > 0) {
+            bitarray_chunk_shrink(c);
+        }
+        return 1;
+    }
+
+    if (c->type == BITARRAY_ARRAY) {
+        size_t p = bitarray_upper16(v, n, 1, low);
+        if (!b) {
+            memmove(v + p - 1, v + p, (n - p) * sizeof(uint16_t));
+            --c->n;
+            --c->card;
+            return 1;
+        }
+        if (n == BITARRAY_ARRAY_MAX) {
+            WORD *w = (WORD *)malloc(BITARRAY_CHUNK_BYTES);
+            if (w == NULL)
+                return 0;
+            BitarrayChunk t = *c;
+            bitarray_chunk_to_bitmap(c, w);
+            w[I_WORD(low)] |= I_BIT(low);
+            int ok = bitarray_chunk_from_bitmap(&t, w, c->card + 1);
+            free(w);
+            if (!ok)
+                return 0;
+            bitarray_chunk_free(c);
+            *c = t;
+            return 1;
+        }
+        if (!bitarray_chunk_reserve(c, n + 1))
+            return 0;
+        v = (uint16_t *)c->data;
+        memmove(v + p + 1, v + p, (n - p) * sizeof(uint16_t));
+        v[p] = (uint16_t)low;
+        ++c->n;
+        ++c->card;
+        return 1;
+    }
+
+    /* run container, p ranges start at or before low */
+    size_t p = bitarray_upper16(v, n, 2, low);
+    if (b) {
+        int left = p > 0 && v[2 * p - 1] + 1u == low;
+        int right = p < n && v[2 * p] == low + 1;
+        if (left && right) {
+            v[2 * p - 1] = v[2 * p + 1];
+            memmove(v + 2 * p, v + 2 * p + 2, (n - p - 1) * 2 * sizeof(uint16_t));
+            --c->n;
+        } else if (left) {
+            v[2 * p - 1] = (uint16_t)low;
+        } else if (right) {
+            v[2 * p] = (uint16_t)low;
+        } else {
+            if (!bitarray_chunk_reserve(c, n + 1))
+                return 0;
+            v = (uint16_t *)c->data;
+            memmove(v + 2 * p + 2, v + 2 * p, (n - p) * 2 * sizeof(uint16_t));
+            v[2 * p] = v[2 * p + 1] = (uint16_t)low;
+            ++c->n;
+        }
+        ++c->card;
+    } else {
+        size_t q = p - 1;
+        unsigned first = v[2 * q], last = v[2 * q + 1];
+        if (first == last) {
+            memmove(v + 2 * q, v + 2 * q + 2, (n - q - 1) * 2 * sizeof(uint16_t));
+            --c->n;
+        } else if (low == first) {
+            v[2 * q] = (uint16_t)(low + 1);
+        } else if (low == last) {
+            v[2 * q + 1] = (uint16_t)(low - 1);
+        } else {
+            /* splits the range in two */
+            if (!bitarray_chunk_reserve(c, n + 1))
+                return 0;
+            v = (uint16_t *)c->data;
+            memmove(v + 2 * q + 4, v + 2 * q + 2, (n - q - 1) * 2 * sizeof(uint16_t));
+            v[2 * q + 1] = (uint16_t)(low - 1);
+            v[2 * q + 2] = (uint16_t)(low + 1);
+            v[2 * q + 3] = (uint16_t)last;
+            ++c->n;
+        }
+        --c->card;
+    }
+    if (c->card > 0 && bitarray_chunk_best(c->card, c->n) != BITARRAY_RUN)
+        bitarray_chunk_shrink(c);
+    return 1;
+}
+
+static int bitarray_chunk_equal(const BitarrayChunk *a, const BitarrayChunk *b,
+    WORD *scratch)
+{
+    if (a->card != b->card)
+        return 0;
+    if (a->type == b->type) {
+        /* ranges are kept maximal so every content has one encoding */
+        size_t bytes = a->type == BITARRAY_BITMAP ? BITARRAY_CHUNK_BYTES
+            : (a->type == BITARRAY_RUN ? 2 : 1) * a->n * sizeof(uint16_t);
+        return a->n == b->n && memcmp(a->data, b->data, bytes) == 0;
+    }
+    WORD *wa = scratch, *wb = scratch + BITARRAY_CHUNK_WORDS;
+    bitarray_chunk_to_bitmap(a, wa);
+    bitarray_chunk_to_bitmap(b, wb);
+    return bitarray_kernels.equal(wa, wb, BITARRAY_CHUNK_WORDS);
+}
+
+/* scratch space for the chunk operations: two bitmaps, then room for the
+   merge of two array containers */
+#define BITARRAY_SCRATCH_BYTES \
+    (2 * BITARRAY_CHUNK_BYTES + 2 * BITARRAY_ARRAY_MAX * sizeof(uint16_t))
+
+/* c = a OP b for two chunks of the same key. c->card is 0 when the result
+   is empty and then c holds nothing. returns 0 if out of memory. two arrays
+   are merged, an array and anything is filtered through lookups, the rest
+   goes through bitmaps and the bulk kernels */
+static int bitarray_chunk_op(BitarrayChunk *c, const BitarrayChunk *a,
+    const BitarrayChunk *b, int op, WORD *scratch)
+{
+    WORD *wa = scratch, *wb = scratch + BITARRAY_CHUNK_WORDS;
+    uint16_t *m = (uint16_t *)(scratch + 2 * BITARRAY_CHUNK_WORDS);
+    size_t n = 0;
+    c->key = a->key;
+    c->card = 0;
+    c->data = NULL;
+    if (a->type == BITARRAY_ARRAY && b->type == BITARRAY_ARRAY) {
+        const uint16_t *x = (const uint16_t *)a->data, *y = (const uint16_t *)b->data;
+        size_t i = 0, j = 0;
+        while (i < a->n && j < b->n) {
+            if (x[i] < y[j]) {
+                if (op != BITARRAY_SPARSE_AND)
+                    m[n++] = x[i];
+                ++i;
+            } else if (x[i] > y[j]) {
+                if (op != BITARRAY_SPARSE_AND)
+                    m[n++] = y[j];
+                ++j;
+            } else {
+                if (op != BITARRAY_SPARSE_XOR)
+                    m[n++] = x[i];
+                ++i, ++j;
+            }
+        }
+        if (op != BITARRAY_SPARSE_AND) {
+            while (i < a->n)
+                m[n++] = x[i++];
+            while (j < b->n)
+                m[n++] = y[j++];
+        }
+        return n == 0 || bitarray_chunk_from_array(c, m, n);
+    }
+    if (op == BITARRAY_SPARSE_AND
+        && (a->type == BITARRAY_ARRAY || b->type == BITARRAY_ARRAY)) {
+        const BitarrayChunk *x = a->type == BITARRAY_ARRAY ? a : b;
+        const BitarrayChunk *y = x == a ? b : a;
+        const uint16_t *v = (const uint16_t *)x->data;
+        for (size_t k = 0; k < x->n; ++k)
+            if (bitarray_chunk_get(y, v[k]))
+                m[n++] = v[k];
+        return n == 0 || bitarray_chunk_from_array(c, m, n);
+    }
+    bitarray_chunk_to_bitmap(a, wa);
+    bitarray_chunk_to_bitmap(b, wb);
+    if (op == BITARRAY_SPARSE_AND)
+        bitarray_kernels.and_(wa, wa, wb, BITARRAY_CHUNK_WORDS);
+    else if (op == BITARRAY_SPARSE_OR)
+        bitarray_kernels.or_(wa, wa, wb, BITARRAY_CHUNK_WORDS);
+    else
+        bitarray_kernels.xor_(wa, wa, wb, BITARRAY_CHUNK_WORDS);
+    size_t card = bitarray_kernels.popcount(wa, BITARRAY_CHUNK_WORDS);
+    return card == 0 || bitarray_chunk_from_bitmap(c, wa, card);
+}
+
+/* sparse array of the given size with no 1 bit */
+static void bitarray_sparse_init(BitarraySparse *sp, size_t size)
+{
+    sp->size = size;
+    sp->n = sp->cap = 0;
+    sp->chunks = NULL;
+}
+
+static void bitarray_sparse_free(BitarraySparse *sp)
+{
+    for (size_t k = 0; k < sp->n; ++k)
+        bitarray_chunk_free(&sp->chunks[k]);
+    free(sp->chunks);
+    sp->chunks = NULL;
+    sp->n = sp->cap = 0;
+}
+
+/* position of the first chunk whose key is >= key */
+static size_t bitarray_sparse_find(const BitarraySparse *sp, size_t key)
+{
+    size_t lo = 0, hi = sp->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sp->chunks[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* moves the chunk c into position p, the sparse array takes ownership of
+   its container. returns 0 if out of memory */
+static int bitarray_sparse_insert(BitarraySparse *sp, size_t p,
+    const BitarrayChunk *c)
+{
+    if (sp->n == sp->cap) {
+        size_t cap = sp->cap ? sp->cap * 2 : 4;
+        BitarrayChunk *tmp = (BitarrayChunk *)realloc(sp->chunks,
+            cap * sizeof(BitarrayChunk));
+        if (tmp == NULL)
+            return 0;
+        sp->chunks = tmp;
+        sp->cap = cap;
+    }
+    memmove(sp->chunks + p + 1, sp->chunks + p,
+        (sp->n - p) * sizeof(BitarrayChunk));
+    sp->chunks[p] = *c;
+    ++sp->n;
+    return 1;
+}
+
+static void bitarray_sparse_remove(BitarraySparse *sp, size_t p)
+{
+    bitarray_chunk_free(&sp->chunks[p]);
+    memmove(sp->chunks + p, sp->chunks + p + 1,
+        (sp->n - p - 1) * sizeof(BitarrayChunk));
+    --sp->n;
+}
+
+static int bitarray_sparse_get(const BitarraySparse *sp, size_t i)
+{
+    size_t key = i / BITARRAY_CHUNK_BITS;
+    size_t p = bitarray_sparse_find(sp, key);
+    return p < sp->n && sp->chunks[p].key == key
+        && bitarray_chunk_get(&sp->chunks[p], i % BITARRAY_CHUNK_BITS);
+}
+
+/* returns 0 if out of memory, the array is then unchanged */
+static int bitarray_sparse_set(BitarraySparse *sp, size_t i, int b)
+{
+    size_t key = i / BITARRAY_CHUNK_BITS;
+    unsigned low = (unsigned)(i % BITARRAY_CHUNK_BITS);
+    size_t p = bitarray_sparse_find(sp, key);
+    if (p < sp->n && sp->chunks[p].key == key) {
+        if (!bitarray_chunk_set(&sp->chunks[p], low, b))
+            return 0;
+        if (sp->chunks[p].card == 0)
+            bitarray_sparse_remove(sp, p);
+        return 1;
+    }
+    if (!b)
+        return 1;
+    BitarrayChunk c;
+    uint16_t v = (uint16_t)low;
+    c.key = key;
+    if (!bitarray_chunk_from_array(&c, &v, 1))
+        return 0;
+    if (!bitarray_sparse_insert(sp, p, &c)) {
+        bitarray_chunk_free(&c);
+        return 0;
+    }
+    return 1;
+}
+
+static size_t bitarray_sparse_count(const BitarraySparse *sp)
+{
+    size_t c = 0;
+    for (size_t k = 0; k < sp->n; ++k)
+        c += sp->chunks[k].card;
+    return c;
+}
+
+/* out = a OP b. out must be empty, all three of the same size. returns 0 if
+   out of memory, whatever out holds then still has to be freed */
+static int bitarray_sparse_op(BitarraySparse *out, const BitarraySparse *a,
+    const BitarraySparse *b, int op)
+{
+    WORD *scratch = (WORD *)malloc(BITARRAY_SCRATCH_BYTES);
+    if (scratch == NULL)
+        return 0;
+    size_t i = 0, j = 0;
+    int ok = 1;
+    while (ok && (i < a->n || j < b->n)) {
+        const BitarrayChunk *x = i < a->n ? &a->chunks[i] : NULL;
+        const BitarrayChunk *y = j < b->n ? &b->chunks[j] : NULL;
+        BitarrayChunk c;
+        c.card = 0;
+        c.data = NULL;
+        if (y == NULL || (x != NULL && x->key < y->key)) {
+            ++i;
+            if (op != BITARRAY_SPARSE_AND)
+                ok = bitarray_chunk_copy(&c, x);
+        } else if (x == NULL || y->key < x->key) {
+            ++j;
+            if (op != BITARRAY_SPARSE_AND)
+                ok = bitarray_chunk_copy(&c, y);
+        } else {
+            ++i, ++j;
+            ok = bitarray_chunk_op(&c, x, y, op, scratch);
+        }
+        if (ok && c.card > 0 && !(ok = bitarray_sparse_insert(out, out->n, &c)))
+            bitarray_chunk_free(&c);
+    }
+    free(scratch);
+    return ok;
+}
+
+/* whether the two hold the same bits. returns -1 if out of memory */
+static int bitarray_sparse_equal(const BitarraySparse *a, const BitarraySparse *b)
+{
+    if (a->size != b->size || a->n != b->n)
+        return 0;
+    WORD *scratch = NULL;
+    int eq = 1;
+    for (size_t k = 0; eq && k < a->n; ++k) {
+        const BitarrayChunk *x = &a->chunks[k], *y = &b->chunks[k];
+        if (x->key != y->key || x->card != y->card) {
+            eq = 0;
+        } else if (x->type != y->type && scratch == NULL
+            && (scratch = (WORD *)malloc(BITARRAY_SCRATCH_BYTES)) == NULL) {
+            return -1;
+        } else {
+            eq = bitarray_chunk_equal(x, y, scratch);
+        }
+    }
+    free(scratch);
+    return eq;
+}
+
+/* rebuilds every chunk in its smallest container. a bitmap or array that
+   became a few long ranges one bit at a time is not noticed otherwise */
+static void bitarray_sparse_optimize(BitarraySparse *sp)
+{
+    for (size_t k = 0; k < sp->n; ++k)
+        bitarray_chunk_shrink(&sp->chunks[k]);
+}
+
+/* writes the bits of sp to ba, which is of the same size and all 0 */
+static void bitarray_sparse_to_dense(const BitarraySparse *sp, Bitarray *ba)
+{
+    size_t nwords = WORDS_FOR_BITS(ba->size);
+    for (size_t k = 0; k < sp->n; ++k) {
+        const BitarrayChunk *c = &sp->chunks[k];
+        const uint16_t *v = (const uint16_t *)c->data;
+        WORD *w = ba->values + c->key * BITARRAY_CHUNK_WORDS;
+        /* the last chunk may be cut short, its missing bits are all 0 */
+        size_t room = nwords - c->key * BITARRAY_CHUNK_WORDS;
+        if (c->type == BITARRAY_BITMAP) {
+            memcpy(w, c->data, (room < BITARRAY_CHUNK_WORDS ? room
+                : BITARRAY_CHUNK_WORDS) * sizeof(WORD));
+        } else if (c->type == BITARRAY_ARRAY) {
+            for (size_t j = 0; j < c->n; ++j)
+                w[I_WORD(v[j])] |= I_BIT(v[j]);
+        } else {
+            for (size_t j = 0; j < c->n; ++j)
+                bitarray_words_fill(w, v[2 * j], (size_t)v[2 * j + 1] + 1);
+        }
+    }
+}
+
+/* fills the empty sp, of the same size as ba, with the bits of ba. returns
+   0 if out of memory, whatever sp holds then still has to be freed */
+static int bitarray_sparse_from_dense(BitarraySparse *sp, Bitarray *ba)
+{
+    size_t nwords = WORDS_FOR_BITS(ba->size);
+    WORD *tail = NULL;
+    for (size_t key = 0; key * BITARRAY_CHUNK_WORDS < nwords; ++key) {
+        const WORD *w = ba->values + key * BITARRAY_CHUNK_WORDS;
+        size_t room = nwords - key * BITARRAY_CHUNK_WORDS;
+        size_t nw = room < BITARRAY_CHUNK_WORDS ? room : BITARRAY_CHUNK_WORDS;
+        size_t card = bitarray_kernels.popcount(w, nw);
+        if (card == 0)
+            continue;
+        if (nw < BITARRAY_CHUNK_WORDS) {
+            /* the last chunk is padded to a full bitmap */
+            if ((tail = (WORD *)calloc(BITARRAY_CHUNK_WORDS, sizeof(WORD))) == NULL)
+                return 0;
+            memcpy(tail, w, nw * sizeof(WORD));
+            w = tail;
+        }
+        BitarrayChunk c;
+        c.key = key;
+        c.data = NULL;
+        if (!bitarray_chunk_from_bitmap(&c, w, card)
+            || !bitarray_sparse_insert(sp, sp->n, &c)) {
+            bitarray_chunk_free(&c);
+            free(tail);
+            return 0;
+        }
+    }
+    free(tail);
+    return 1;
+}
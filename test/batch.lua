@@ -9,7 +9,7 @@ local function checkerror(exprf)
     if pcall(exprf) then error('test failed', 2) end
 end
 
-print(('%s\ncompiled with block size: %d'):format(Bitarray.__version, Bitarray._blocksize))
+print(('%s\ncompiled with block size: %d, kernel: %s'):format(Bitarray.__version, Bitarray._blocksize, Bitarray._kernel))
 
 -- array creation and set/get bit
 do
@@ -111,6 +111,24 @@ do
         a:set(1, true):set(3, true):set(4, true):set(44, true)
         b:set(50, true):set(48, true):set(47, true):set(7, true):reverse()
         check(a == b)
+    local function slow(x, i, j)
+        local y = Bitarray.copyfrom(x)
+        for k = i, j do y[k] = x[i + j - k] end
+        return y
+    end
+    for _, n in ipairs{1, 31, 32, 33, 63, 64, 65, 200, 1000} do
+        local c = Bitarray.new(n)
+        for k = 1, n do c[k] = (k * 7 + math.floor(k / 3)) % 5 < 2 end
+        local d = Bitarray.copyfrom(c):reverse()
+            check(d == slow(c, 1, n) and d:count() == c:count())
+            check(d:reverse() == c)
+        for i = 1, n, 13 do
+            for j = i, n, 17 do
+                check(Bitarray.copyfrom(c):reverse(i, j) == slow(c, i, j))
+            end
+        end
+        check(Bitarray.copyfrom(c):reverse(n) == c)
+    end
 end
 
 -- slice, concat, rep and from_bitarray
@@ -158,6 +176,33 @@ do
     local b = Bitarray.new(16):from_binarystring('11001100'):from_binarystring('11111111', 9)
         check(b:at_uint16() == 0xCCFF)
         checkerror(function() b:from_binarystring('0x11') end)
+    -- long strings go through the vector paths, bad chars anywhere are caught
+    local t = {}
+    for i = 1, 1000 do t[i] = (i * i + 3 * i) % 7 < 3 and '1' or '0' end
+    local s = table.concat(t)
+    local c = Bitarray.new(1003):from_binarystring(s, 3)
+    for i = 1, 1000 do check(c[i + 2] == (t[i] == '1')) end
+        check(not c[1] and not c[2] and not c[1003])
+        check(c:to_binarystring(3, 1002) == s)
+        check(c:to_binarystring() == '00' .. s .. '0')
+        check(Bitarray.new(1000):from_binarystring(s):to_binarystring() == s)
+    for _, k in ipairs{1, 16, 31, 64, 100, 999} do
+        for _, ch in ipairs{'2', '/', ' ', '\0', '\255'} do
+            local bad = s:sub(1, k - 1) .. ch .. s:sub(k + 1)
+            checkerror(function() c:from_binarystring(bad) end)
+        end
+    end
+        check(c:to_binarystring(3, 1002) == s)
+    for i = 1, 1003, 37 do
+        for j = i, 1003, 53 do
+            local r = {}
+            for k = i, j do r[#r + 1] = c[k] and '1' or '0' end
+            check(c:to_binarystring(i, j) == table.concat(r))
+        end
+    end
+    local big = Bitarray.new(100003):fill(true)
+        check(big:to_binarystring() == string.rep('1', 100003))
+        check(big:to_binarystring(2) == string.rep('1', 100002))
 end
 
 -- bitwise
@@ -197,4 +242,982 @@ do
         for i = 16, 32 do check(not f[i]) end
 end
 
+-- shifts across word boundaries
+do
+    local a = Bitarray.new(200)
+    for i = 1, 200, 3 do a[i] = true end
+    a[200] = true
+    for _, s in ipairs{1, 7, 31, 32, 33, 63, 64, 65, 100, 199, 200, 201} do
+        local l = a:shiftleft(s)
+        local r = a:shiftright(s)
+            for i = 1, 200 do
+                check(l[i] == (i + s <= 200 and a[i + s]))
+                check(r[i] == (i - s >= 1 and a[i - s]))
+            end
+            check(Bitarray.copyfrom(a):shiftleft_inplace(s) == l)
+            check(Bitarray.copyfrom(a):shiftright_inplace(s) == r)
+            check(Bitarray.copyfrom(a):shiftleft_inplace(-s) == r)
+        -- tail bits must stay 0 after the shift
+        r:resize(256)
+            for i = 201, 256 do check(not r[i]) end
+    end
+end
+
+-- unaligned block copies and move
+do
+    local a = Bitarray.new(300)
+    for i = 1, 300 do a[i] = i % 3 == 0 or i % 7 == 0 end
+    for _, r in ipairs{{1, 300}, {2, 65}, {33, 96}, {5, 6}, {40, 299}, {64, 64}} do
+        local i, j = r[1], r[2]
+        local b = a:slice(i, j)
+            check(#b == j - i + 1)
+            for k = 1, #b do check(b[k] == a[i + k - 1]) end
+        for _, t in ipairs{1, 3, 32, 33, 70} do
+            local c = Bitarray.new(#b + t + 40):from_bitarray(b, t)
+                for k = 1, #c do
+                    check(c[k] == (k >= t and k < t + #b and b[k - t + 1]))
+                end
+        end
+    end
+    -- overlapping moves in both directions
+    for _, m in ipairs{{1, 200, 5}, {5, 204, 1}, {10, 290, 11}, {33, 132, 1}, {1, 100, 65}} do
+        local i, j, t = m[1], m[2], m[3]
+        local b = Bitarray.copyfrom(a):move(i, j, t)
+            for k = 1, 300 do
+                if k >= t and k <= t + j - i then
+                    check(b[k] == a[k - t + i])
+                else
+                    check(b[k] == a[k])
+                end
+            end
+    end
+    checkerror(function() a:move(1, 10, 292) end)
+    local c = a:slice(3, 69)
+        check(c:rep(7) == c..c..c..c..c..c..c)
+end
+
+-- in-place and destination-passing bitwise
+do
+    local a = Bitarray.new(100)
+    local b = Bitarray.new(100)
+    for i = 1, 100, 3 do a[i] = true end
+    for i = 1, 100, 5 do b[i] = true end
+        check(Bitarray.copyfrom(a):iand(b) == a:band(b))
+        check(Bitarray.copyfrom(a):ior(b) == a:bor(b))
+        check(Bitarray.copyfrom(a):ixor(b) == a:bxor(b))
+        check(Bitarray.copyfrom(a):iandnot(b) == a:band(b:bnot()))
+        check(Bitarray.copyfrom(a):inot() == a:bnot())
+        checkerror(function() Bitarray.copyfrom(a):iand(Bitarray.new(99)) end)
+    local r = Bitarray.new(100)
+        check(Bitarray.band_into(r, a, b) == a:band(b))
+        check(Bitarray.bor_into(r, a, b) == a:bor(b))
+        check(Bitarray.bxor_into(r, a, b) == a:bxor(b))
+        check(Bitarray.bandnot_into(r, a, b) == a:band(b:bnot()))
+        check(Bitarray.bnot_into(r, a) == a:bnot())
+        checkerror(function() Bitarray.band_into(Bitarray.new(99), a, b) end)
+        checkerror(function() Bitarray.band_into(r, a, Bitarray.new(99)) end)
+    -- destination may alias an operand, tail stays 0
+    local c = Bitarray.copyfrom(a)
+        Bitarray.bnot_into(c, c)
+        check(c == a:bnot())
+        c:resize(128)
+        for i = 101, 128 do check(not c[i]) end
+end
+
+-- indices at or above 2^32 must not wrap around. the array takes 512 MiB,
+-- skip if the platform cannot allocate it
+do
+    -- math.floor gives an integer subtype in 5.3, which __index requires
+    local big = math.floor(2^32)
+    local n = big + 100
+    local ok, a = pcall(Bitarray.new, n)
+    if ok and a then
+        check(#a == n)
+        a[n] = true
+        a[big + 1] = true
+        check(a[n] and a[big + 1])
+        check(not a[1] and not a[101] and not a[n - 1] and not a[big])
+        a:flip(big + 1)
+        check(not a[big + 1] and not a[1])
+    end
+end
+
+-- count, rank and select
+do
+    local a = Bitarray.new(8):from_uint8(0x2D)
+        check(a:count() == 4 and a:count(1, 4) == 1)
+        check(a:rank(0) == 0 and a:rank(5) == 2 and a:rank(8) == 4)
+        check(a:select(2) == 5 and a:select(4) == 8 and a:select(5) == nil)
+    -- big enough to go through the vectorised popcount and many superblocks
+    local n = 70000
+    local b = Bitarray.new(n)
+    for i = 1, n do b[i] = i % 3 == 0 or i % 11 == 0 or (i > 30000 and i < 33000) end
+    local ones, total = {}, 0
+    for i = 1, n do if b[i] then total = total + 1; ones[total] = i end end
+        check(b:count() == total)
+        check(b:count(2, n - 1) == total - (b[n] and 1 or 0))
+        check(b:count(65, 66) == (b[65] and 1 or 0) + (b[66] and 1 or 0))
+        local c = 0
+        for i = 1, n do
+            if b[i] then c = c + 1 end
+            if i % 97 == 0 or i == n then check(b:rank(i) == c) end
+        end
+        for k = 1, total, 37 do check(b:select(k) == ones[k]) end
+        check(b:select(total) == ones[total] and b:select(total + 1) == nil)
+        checkerror(function() b:rank(n + 1) end)
+        checkerror(function() b:select(0) end)
+    -- the directory must follow mutations
+        b:set(1, true)
+        check(b:rank(1) == 1 and b:count() == total + 1 and b:select(1) == 1)
+        b:fill(false)
+        check(b:rank(n) == 0 and b:select(1) == nil)
+        b:flip()
+        check(b:rank(n) == n and b:select(n) == n)
+        b:iandnot(b)
+        check(b:count() == 0 and b:rank(n) == 0)
+end
+
+-- find_first, find_next, find_prev and ones
+do
+    local a = Bitarray.new(100):set(3, true):set(50, true)
+        check(a:find_first() == 3 and a:find_first(false) == 1)
+        check(a:find_next(3) == 50 and a:find_next(50) == nil and a:find_next(0) == 3)
+        check(a:find_prev(50) == 3 and a:find_prev(101) == 50 and a:find_prev(3) == nil)
+        check(a:find_next(2, false) == 4 and a:find_prev(4, false) == 2)
+        checkerror(function() a:find_next(101) end)
+        checkerror(function() a:find_prev(0) end)
+    local got = {}
+    for i in a:ones() do got[#got + 1] = i end
+        check(#got == 2 and got[1] == 3 and got[2] == 50)
+    -- sparse pattern over many words, compared with a plain scan
+    local n = 1000
+    local b = Bitarray.new(n)
+    for i = 1, n do b[i] = i % 97 == 1 or i == 640 or i == n end
+    local c = 0
+    for i in b:ones() do
+        c = c + 1
+        check(b[i])
+    end
+        check(c == b:count())
+    for i = 0, n do
+        local nxt, nxt0 = nil, nil
+        for k = i + 1, n do if b[k] then nxt = k break end end
+        for k = i + 1, n do if not b[k] then nxt0 = k break end end
+        check(b:find_next(i) == nxt and b:find_next(i, false) == nxt0)
+        local prv, prv0 = nil, nil
+        for k = i, 1, -1 do if b[k] then prv = k break end end
+        for k = i, 1, -1 do if not b[k] then prv0 = k break end end
+        check(b:find_prev(i + 1) == prv and b:find_prev(i + 1, false) == prv0)
+    end
+    -- unused tail bits must not be reported as zeros
+    local d = Bitarray.new(70):fill(true)
+        check(d:find_first(false) == nil and d:find_prev(71, false) == nil)
+        for i in Bitarray.new(70):ones() do check(false) end
+end
+
+-- from_bytes and to_bytes
+do
+    local a = Bitarray.from_bytes('\45')
+        check(a == Bitarray.new(8):from_uint8(0x2D))
+        check(Bitarray.from_bytes('\45', 'lsb') == Bitarray.new(8):from_binarystring('10110100'))
+        checkerror(function() Bitarray.from_bytes('') end)
+        checkerror(function() Bitarray.from_bytes('a', 'middle') end)
+    -- long enough to go through the vectorised bit reversal
+    local t = {}
+    for i = 0, 299 do t[#t + 1] = string.char((i * 37 + 11) % 256) end
+    local s = table.concat(t)
+    local b = Bitarray.from_bytes(s)
+    local c = Bitarray.from_bytes(s, 'lsb')
+        check(#b == 2400)
+        for i = 1, #s do
+            check(b:at_uint8(i * 8 - 7) == s:byte(i))
+            check(c:slice(i * 8 - 7, i * 8):reverse():at_uint8() == s:byte(i))
+        end
+        check(b:to_bytes() == s and c:to_bytes(nil, nil, 'lsb') == s)
+        check(b:to_bytes(9, 16) == s:sub(2, 2) and b:to_bytes(2393) == s:sub(300))
+    -- unaligned ranges and padding of the last byte
+    local d = Bitarray.new(12):from_binarystring('001011011111')
+        check(d:to_bytes() == '\45\240')
+        check(d:to_bytes(3, 10) == '\183')
+        check(d:to_bytes(1, 3, 'lsb') == '\4')
+    for i = 1, 200, 7 do
+        local j = math.min(i + 100, #b)
+        check(Bitarray.from_bytes(b:to_bytes(i, j)):slice(1, j - i + 1) == b:slice(i, j))
+        check(Bitarray.from_bytes(b:to_bytes(i, j, 'lsb'), 'lsb'):slice(1, j - i + 1) == b:slice(i, j))
+    end
+end
+
+-- at/from uints at unaligned positions and arbitrary width bit fields
+do
+    local n = 300
+    local a = Bitarray.new(n)
+    for i = 1, n do a[i] = (i * 7) % 5 < 2 end
+    local function slow(i, w)
+        local v = 0
+        for k = i, i + w - 1 do v = v * 2 + (a[k] and 1 or 0) end
+        return v
+    end
+    for i = 1, n - 40, 13 do
+        check(a:at_uint8(i) == slow(i, 8) and a:at_uint16(i) == slow(i, 16))
+        check(a:at_uint32(i) == slow(i, 32))
+        for _, w in ipairs{1, 5, 17, 31, 33, 40} do check(a:get_bits(i, w) == slow(i, w)) end
+    end
+    -- 64-bit values only survive the round trip with 5.3 integers
+    if _VERSION >= 'Lua 5.3' then
+        for i = 1, n - 64, 29 do
+            local b = Bitarray.new(n)
+            b:from_uint64(a:at_uint64(i), i)
+            check(b:slice(i, i + 63) == a:slice(i, i + 63))
+            check(b:count() == a:count(i, i + 63))
+        end
+    end
+    local b = Bitarray.new(n):fill(true)
+    for _, w in ipairs{1, 3, 8, 13, 32, 45} do
+        for i = 1, n - w, 11 do
+            local c = Bitarray.copyfrom(b):set_bits(i, w, 0x5A5A5A5A5A5A)
+            check(c:get_bits(i, w) == 0x5A5A5A5A5A5A % 2^w)
+            check(c:count() == n - w + c:count(i, i + w - 1))
+        end
+    end
+    local c = Bitarray.new(8):set_bits(2, 3, 5)
+        check(c == Bitarray.new(8):from_binarystring('01010000'))
+        check(Bitarray.new(16):from_uint16(0xABCD):get_bits(5, 7) == 94)
+        checkerror(function() c:get_bits(1, 65) end)
+        checkerror(function() c:get_bits(1, 0) end)
+        checkerror(function() c:get_bits(2, 8) end)
+        checkerror(function() c:set_bits(8, 2, 1) end)
+end
+
+-- sparse arrays
+do
+    local n = 300000
+    local sp = Bitarray.sparse(n)
+        check(#sp == n and sp:count() == 0 and not sp[1] and not sp[n])
+        check(sp:to_bitarray() == Bitarray.new(n))
+        checkerror(function() return sp[0] end)
+        checkerror(function() return sp[n + 1] end)
+    -- a few bits, a dense chunk and a few ranges, checked against a Bitarray
+    local ba = Bitarray.new(n)
+    local function both(i, b) sp[i] = b; ba[i] = b end
+    for i = 1, n, 9973 do both(i, true) end
+    for i = 65537, 65537 + 9000 do both(i, i % 3 ~= 0) end
+    for i = 140000, 150000 do both(i, true) end
+    for i = 200000, 200200 do both(i, true) end
+    for i = 200050, 200060 do both(i, false) end
+        check(sp:count() == ba:count() and sp:to_bitarray() == ba)
+        check(ba:to_sparse() == sp and ba:to_sparse():count() == ba:count())
+    local a, b, r = sp:containers()
+        check(a == 3 and b == 1 and r == 1)
+    for i = 1, n, 7 do check(sp[i] == ba[i]) end
+    -- clearing turns the bitmap back into a list
+    for i = 65537, 65537 + 9000 do both(i, false) end
+        check(sp:to_bitarray() == ba)
+    a, b, r = sp:containers()
+        check(a == 4 and b == 0 and r == 1)
+    -- a list that fills up becomes whichever is smaller
+    local c = Bitarray.sparse(n)
+    for i = 1, 5000 do c[i] = true end
+        check(select(3, c:containers()) == 1 and c:count() == 5000)
+    for i = 1, 5000, 2 do c[i] = false end
+        check(c:to_bitarray() == Bitarray.new(n):from_binarystring(string.rep('01', 2500)))
+        check(select(1, c:containers()) == 1)
+    local d = Bitarray.sparse(n):set(5, true):set(6, true):set(7, true)
+        check(select(1, d:containers()) == 1 and select(3, d:optimize():containers()) == 1)
+    d[6] = false; d[5] = false; d[7] = false
+        check(d:count() == 0 and d:containers() == 0)
+    -- operators against the dense results
+    local e, eb = Bitarray.sparse(n), Bitarray.new(n)
+    for i = 3, n, 17 do e[i] = true; eb[i] = true end
+    for i = 140500, 145000 do e[i] = true; eb[i] = true end
+    for _, x in ipairs{{sp, ba}, {c, c:to_bitarray()}, {d, d:to_bitarray()}} do
+        check(x[1]:band(e):to_bitarray() == x[2]:band(eb))
+        check(x[1]:bor(e):to_bitarray() == x[2]:bor(eb))
+        check(x[1]:bxor(e):to_bitarray() == x[2]:bxor(eb))
+        check(e:bxor(x[1]):bxor(x[1]) == e)
+        check(x[1]:band(x[1]) == x[1] and x[1]:bxor(x[1]):count() == 0)
+    end
+        checkerror(function() return sp:band(Bitarray.sparse(n + 1)) end)
+        check(sp ~= c and sp ~= Bitarray.sparse(n + 1))
+        check(tostring(Bitarray.sparse(3):set(2, true)) == 'Sparse[0,1,0]')
+    -- the length costs nothing
+    local huge = Bitarray.sparse(math.floor(2^40))
+        huge[math.floor(2^40)] = true
+        huge[1] = true
+        check(huge:count() == 2 and huge[math.floor(2^40)] and not huge[2])
+end
+
+-- storage accounting
+do
+    collectgarbage()
+    collectgarbage()
+    local s0, kb0 = Bitarray.memstats(), collectgarbage('count')
+    local n = 2^20
+    local a = Bitarray.new(n)
+    local s1 = Bitarray.memstats()
+        check(s1.arrays == s0.arrays + 1 and s1.bytes == s0.bytes + n / 8)
+        check(s1.allocations == s0.allocations + 1 and s1.peak >= s1.bytes)
+    -- the words are part of the userdata, the collector sees them
+        check(collectgarbage('count') - kb0 >= n / 8 / 1024)
+    -- shrinking keeps the words in place, growing moves them out
+        a[n] = true
+        a:resize(n / 2)
+        check(Bitarray.memstats().bytes == s0.bytes + n / 16)
+        check(Bitarray.memstats().allocations == s1.allocations)
+        a[1] = true
+        a:resize(n * 2)
+        check(a[1] and not a[n / 2] and a:count() == 1)
+        check(Bitarray.memstats().bytes == s0.bytes + n / 4)
+        check(Bitarray.memstats().allocations == s1.allocations + 1)
+    -- shared words are counted once, until the last array goes
+    local b = Bitarray.new(64)
+    local c = Bitarray.attach(b:share())
+        check(c == b and Bitarray.memstats().arrays == s0.arrays + 3)
+        check(Bitarray.memstats().bytes == s0.bytes + n / 4 + 8)
+        b[3] = true
+        check(c[3])
+    a, b = nil, nil
+    collectgarbage()
+    collectgarbage()
+        check(Bitarray.memstats().arrays == s0.arrays + 1)
+        check(Bitarray.memstats().bytes == s0.bytes + 8)
+    c = nil
+    collectgarbage()
+    collectgarbage()
+    local s2 = Bitarray.memstats()
+        check(s2.arrays == s0.arrays and s2.bytes == s0.bytes)
+        check(s2.peak >= s0.bytes + n / 4 + 8)
+end
+
+-- worker pool
+do
+    local function sample(n, seed)
+        math.randomseed(seed)
+        local a = Bitarray.new(n)
+        for _ = 1, math.floor(n / 3) do a[math.random(1, n)] = true end
+        return a
+    end
+    local sizes = {1, 64, 1000, 4096 * 8 + 1, 100003}
+    local expect = {}
+    for i, n in ipairs(sizes) do
+        local a, b = sample(n, i), sample(n, i + 100)
+        expect[i] = { a:band(b), a:bor(b), a:bxor(b), a:bnot(), a:count(), a:count(math.min(2, n), n) }
+    end
+    -- the pool keeps 1 thread where threads are not available
+    local threads = Bitarray.set_threads(4)
+        check(threads == 4 or threads == 1)
+    local old = Bitarray.set_parallel_threshold(0)
+        check(old == 4 * 2^20 and Bitarray.set_parallel_threshold(0) == 0)
+    for i, n in ipairs(sizes) do
+        local a, b = sample(n, i), sample(n, i + 100)
+        local e = expect[i]
+            check(a:band(b) == e[1] and a:bor(b) == e[2] and a:bxor(b) == e[3])
+            check(a:bnot() == e[4] and a:count() == e[5] and a:count(math.min(2, n), n) == e[6])
+            check(Bitarray.copyfrom(a) == a and a ~= e[4])
+        local c = Bitarray.new(n)
+            check(Bitarray.band_into(c, a, b) == e[1] and c:inot() == e[1]:bnot())
+            check(c:fill(true):count() == n and c:fill(false):count() == 0)
+            check(a:rep(3):count() == 3 * e[5])
+    end
+        check(Bitarray.set_threads(1) == 1)
+        check(Bitarray.set_parallel_threshold(old) == 0)
+        check(Bitarray.set_threads(0) >= 1 and Bitarray.set_threads(1) == 1)
+        checkerror(function() Bitarray.set_threads(-1) end)
+        checkerror(function() Bitarray.set_parallel_threshold(-1) end)
+end
+
+-- shared arrays and atomic operations
+do
+    local n = 1000
+    local a = Bitarray.new(n)
+    a[3] = true
+    local h = a:share()
+        check(type(h) == 'number' and a:share() == h)
+    local b = Bitarray.attach(h)
+        check(b == a and #b == n and b[3])
+        b[5] = true
+        check(a[5] and a:count() == 2 and a:rank(10) == 2)
+        b[7] = true
+        check(a:rank(10) == 3 and a:select(3) == 7)
+        check(a:test_and_set(10) == false and b:test_and_set(10) == true and a[10])
+        check(b:test_and_clear(10) == true and a:test_and_clear(10) == false and not a[10])
+        check(a:count_relaxed() == a:count() and a:count_relaxed(4, 6) == 1)
+        checkerror(function() a:test_and_set(n + 1) end)
+        checkerror(function() b:resize(10) end)
+    -- most significant bit first, like from_uintN
+    local w = Bitarray._blocksize * 8
+        check(a:fetch_or_word(2, 1) == 0 and a[2 * w] and a:fetch_or_word(2, 2) == 1)
+        check(a:fetch_or_word(2, 0) == 3 and a[2 * w - 1] and a:count(w + 1, 2 * w) == 2)
+    -- bits past the end are left alone
+    local last = math.ceil(n / w)
+        check(a:fetch_or_word(last, 3) == 0 and a:count(n - 7, n) == 0)
+        check(a:fetch_or_word(last, 0) == 0)
+        checkerror(function() a:fetch_or_word(last + 1, 0) end)
+    if _VERSION >= 'Lua 5.3' and w == 64 then
+        local c = Bitarray.new(64)
+            check(c:fetch_or_word(1, 0x8000000000000001) == 0 and c[1] and c[64])
+    end
+    -- the bits live as long as one array uses them
+    a = nil
+    collectgarbage()
+        check(b[3] and Bitarray.attach(h) == b)
+    b = nil
+    collectgarbage()
+    local r, msg = Bitarray.attach(h)
+        check(r == nil and type(msg) == 'string')
+        check(Bitarray.attach(0) == nil)
+end
+
+-- bloom filters
+do
+    local f = Bitarray.bloom(10000, 7)
+        check(#f == 10240 and f:len() == 10240 and f:hashes() == 7)
+        check(tostring(f) == 'Bloom[m=10240,k=7]')
+        check(f:fill_ratio() == 0 and not f:contains('a') and not f:contains(1))
+        check(f:add('a') == f and f:contains('a') and not f:contains('b'))
+        check(f:to_bitarray():count() <= 7 and f:to_bitarray():count() >= 1)
+    -- every bit of a key lies in one 512 bit block
+    local bits = {}
+    for i in f:to_bitarray():ones() do bits[#bits + 1] = i end
+        check(math.floor((bits[1] - 1) / 512) == math.floor((bits[#bits] - 1) / 512))
+    -- numbers are keys by value, strings are different keys
+        f:add(42)
+        check(f:contains(42) and f:contains(42.0) and not f:contains('42'))
+        f:add(0.5)
+        check(f:contains(0.5) and f:contains(1 / 2))
+    local keys, others = {}, {}
+    for i = 1, 1000 do
+        keys[i] = 'key' .. i
+        others[i] = 'other' .. i
+    end
+        check(f:add_many(keys) == f)
+    local found = f:contains_many(keys)
+        check(#found == 1000)
+    for i = 1, 1000 do check(found[i] == true) end
+    -- about 1% false positives at 10 bits per key
+    local fp = 0
+    for _, v in ipairs(f:contains_many(others)) do
+        if v then fp = fp + 1 end
+    end
+        check(fp < 50)
+    local ratio, n = f:fill_ratio()
+        check(ratio > 0.3 and ratio < 0.7 and n > 900 and n < 1100)
+        check(#f:contains_many({}) == 0)
+        checkerror(function() f:add({}) end)
+        checkerror(function() f:add_many({ 'a', true }) end)
+        checkerror(function() f:contains_many('a') end)
+        checkerror(function() Bitarray.bloom(100, 0) end)
+        checkerror(function() Bitarray.bloom(100, 65) end)
+        checkerror(function() Bitarray.bloom(0, 3) end)
+    -- union and intersection
+    local a, b = Bitarray.bloom(4096, 4), Bitarray.bloom(4096, 4)
+        a:add_many({ 1, 2, 3 })
+        b:add_many({ 3, 4, 5 })
+    local u, i = a:bor(b), a:band(b)
+        check(u:contains(1) and u:contains(5) and i:contains(3))
+        check(u:to_bitarray() == (a:to_bitarray():bor(b:to_bitarray())))
+        check(i:to_bitarray() == (a:to_bitarray():band(b:to_bitarray())))
+        checkerror(function() a:bor(Bitarray.bloom(8192, 4)) end)
+        checkerror(function() a:band(Bitarray.bloom(4096, 5)) end)
+    if _VERSION >= 'Lua 5.3' then
+        local mt = getmetatable(a)
+        check(mt.__bor(a, b):to_bitarray() == u:to_bitarray())
+        check(mt.__band(a, b):to_bitarray() == i:to_bitarray())
+    end
+end
+
+-- lazy expressions
+do
+    local function sample(n, seed)
+        math.randomseed(seed)
+        local a = Bitarray.new(n)
+        for _ = 1, math.floor(n / 3) do a[math.random(1, n)] = true end
+        return a
+    end
+    for _, n in ipairs{1, 63, 64, 1000, 256 * 64 + 5, 100003} do
+        local a, b, c, d, e = sample(n, 1), sample(n, 2), sample(n, 3), sample(n, 4), sample(n, 5)
+        local want = a:band(b):bor(c:bxor(d):band(e:bnot()))
+        local x = Bitarray.expr(a):band(b):bor(Bitarray.expr(c):bxor(d):bandnot(e))
+            check(#x == n and x:eval() == want and x:count() == want:count())
+        -- not sets the unused bits of the last word, which must not count
+        local nx = x:bnot()
+            check(nx:eval() == want:bnot() and nx:count() == n - want:count())
+            check(Bitarray.expr(a):eval() == a and Bitarray.expr(a):count() == a:count())
+            check(Bitarray.expr(a):bnot():bnot():eval() == a)
+        -- deep on the right side needs more buffers
+        local r = Bitarray.expr(e)
+        for _, v in ipairs{ d, c, b, a } do r = Bitarray.expr(v):bxor(r:bnot()) end
+            check(r:eval() == a:bxor(b:bxor(c:bxor(d:bxor(e:bnot()):bnot()):bnot()):bnot()))
+        -- into a given array, which may be one of the operands
+        local dst = Bitarray.new(n)
+            check(x:eval(dst) == dst and dst == want)
+        local a2 = Bitarray.copyfrom(a)
+            check(Bitarray.expr(a2):band(b):eval(a2) == a2 and a2 == a:band(b))
+        -- arrays are read at evaluation
+        local y = Bitarray.expr(a):bor(b)
+            a:flip(1)
+            check(y:eval() == a:bor(b))
+            a:flip(1)
+        if _VERSION >= 'Lua 5.3' then
+            local mt = getmetatable(x)
+                check(mt.__band(mt.__bor(Bitarray.expr(a), b), c):eval() == a:bor(b):band(c))
+                check(mt.__bnot(Bitarray.expr(a), Bitarray.expr(a)):eval() == a:bnot())
+        end
+    end
+    local a = Bitarray.new(100)
+        checkerror(function() Bitarray.expr(a):band(Bitarray.new(101)) end)
+        checkerror(function() Bitarray.expr(a):band(Bitarray.expr(Bitarray.new(99))) end)
+        checkerror(function() Bitarray.expr(a):band(1) end)
+        checkerror(function() Bitarray.expr(a):eval(Bitarray.new(99)) end)
+        checkerror(function() Bitarray.expr(1) end)
+        check(tostring(Bitarray.expr(a):bor(a)) == 'Expr[m=100,arrays=2]')
+    local grown = Bitarray.expr(a):bnot()
+        a:resize(200)
+        checkerror(function() grown:eval() end)
+    -- over the worker pool
+    local n = 300007
+    local p, q, s = sample(n, 6), sample(n, 7), sample(n, 8)
+    local want = p:bxor(q):band(s:bnot())
+    local old = Bitarray.set_parallel_threshold(0)
+    Bitarray.set_threads(3)
+    local z = Bitarray.expr(p):bxor(q):bandnot(s)
+        check(z:eval() == want and z:count() == want:count())
+        check(z:bnot():count() == n - want:count())
+    Bitarray.set_threads(1)
+    Bitarray.set_parallel_threshold(old)
+end
+
+-- n-ary reductions
+do
+    local function sample(n, seed)
+        math.randomseed(seed)
+        local a = Bitarray.new(n)
+        for _ = 1, math.floor(n / 2) do a[math.random(1, n)] = true end
+        return a
+    end
+    local function check_all(list, n)
+        local x, y, z = list[1], list[1], list[1]
+        for i = 2, #list do x, y, z = x:band(list[i]), y:bor(list[i]), z:bxor(list[i]) end
+            check(Bitarray.and_all(list) == x and Bitarray.or_all(list) == y)
+            check(Bitarray.xor_all(list) == z)
+        -- count of every bit position, the slow way
+        local counts = {}
+        for i = 1, n do
+            local c = 0
+            for _, a in ipairs(list) do if a[i] then c = c + 1 end end
+            counts[i] = c
+        end
+        for k = 0, #list + 1 do
+            local r = Bitarray.at_least(list, k)
+            local ok = #r == n
+            for i = 1, n do ok = ok and r[i] == (counts[i] >= k) end
+                check(ok)
+        end
+            check(Bitarray.at_least(list, 1) == y and Bitarray.at_least(list, #list) == x)
+    end
+    for _, n in ipairs{1, 70, 256 * 64 + 3} do
+        for _, m in ipairs{1, 2, 3, 8, 17} do
+            local list = {}
+            for i = 1, m do list[i] = sample(n, n + i) end
+            check_all(list, n)
+        end
+    end
+    local list = { sample(1000, 1), sample(1000, 2), sample(1000, 3) }
+    local want = Bitarray.at_least(list, 2)
+    -- into a given array, which may be one of the list
+    local dst = Bitarray.new(1000)
+        check(Bitarray.at_least(list, 2, dst) == dst and dst == want)
+        check(Bitarray.or_all(list, dst) == dst and dst == list[1]:bor(list[2]):bor(list[3]))
+    local x = Bitarray.copyfrom(list[2])
+    local copy = { list[1], x, list[3] }
+        check(Bitarray.at_least(copy, 2, x) == x and x == want)
+        x = Bitarray.copyfrom(list[2])
+        copy[2] = x
+        check(Bitarray.xor_all(copy, x) == x and x == list[1]:bxor(list[2]):bxor(list[3]))
+        checkerror(function() Bitarray.and_all({}) end)
+        checkerror(function() Bitarray.and_all({ list[1], Bitarray.new(999) }) end)
+        checkerror(function() Bitarray.or_all({ list[1], 1 }) end)
+        checkerror(function() Bitarray.at_least(list, 2, Bitarray.new(10)) end)
+        checkerror(function() Bitarray.at_least(list) end)
+    -- over the worker pool
+    local n = 300007
+    local big = {}
+    for i = 1, 5 do big[i] = sample(n, 10 + i) end
+    local expect = { Bitarray.and_all(big), Bitarray.xor_all(big), Bitarray.at_least(big, 3) }
+    local old = Bitarray.set_parallel_threshold(0)
+    Bitarray.set_threads(3)
+        check(Bitarray.and_all(big) == expect[1] and Bitarray.xor_all(big) == expect[2])
+        check(Bitarray.at_least(big, 3) == expect[3])
+    Bitarray.set_threads(1)
+    Bitarray.set_parallel_threshold(old)
+end
+
+-- batch access and ranges
+do
+    -- against a bit by bit reference, with ranges inside one word, across a
+    -- word boundary and over many words
+    local n = 300
+    local a, ref = Bitarray.new(n), {}
+    for i = 1, n do ref[i] = i % 3 == 0 end
+    for i = 1, n do a[i] = ref[i] end
+    local function same()
+        for i = 1, n do if a[i] ~= ref[i] then return false end end
+        return true
+    end
+    for _, r in ipairs{ { 1, 1 }, { 3, 9 }, { 60, 70 }, { 64, 65 }, { 5, 200 }, { 1, n }, { 129, 192 } } do
+        local i, j = r[1], r[2]
+        local c = 0
+        for k = i, j do if ref[k] then c = c + 1 end end
+            check(a:count_range(i, j) == c)
+            check(a:flip_range(i, j) == a)
+        for k = i, j do ref[k] = not ref[k] end
+            check(same())
+            check(a:fill_range(i, j, true) == a)
+        for k = i, j do ref[k] = true end
+            check(same())
+            check(a:fill_range(i, j, false) == a)
+        for k = i, j do ref[k] = false end
+            check(same())
+            check(a:count_range(i, j) == 0)
+    end
+    -- the unused bits stay 0
+    local b = Bitarray.new(70):flip_range(1, 70)
+        check(b:count() == 70 and b == Bitarray.new(70):fill(true))
+        checkerror(function() a:fill_range(0, 3, true) end)
+        checkerror(function() a:fill_range(5, 4, true) end)
+        checkerror(function() a:flip_range(1, n + 1) end)
+        checkerror(function() a:count_range(1) end)
+
+    local c = Bitarray.new(10)
+        check(c:set_many({ 1, 4, 9 }) == c and c:to_binarystring() == '1001000010')
+        check(c:set_many({ 4, 9 }, false):to_binarystring() == '1000000000')
+        check(c:set_many({}):count() == 1)
+    local got = c:set_many({ 2, 3 }):get_many({ 1, 2, 3, 4, 10 })
+        check(#got == 5 and got[1] and got[2] and got[3] and not got[4] and not got[5])
+        check(#c:get_many({}) == 0)
+        checkerror(function() c:set_many({ 1, 11 }) end)
+        checkerror(function() c:set_many({ 'x' }) end)
+        checkerror(function() c:get_many({ 0 }) end)
+        checkerror(function() c:get_many(1) end)
+end
+
+-- views
+do
+    local n = 1000
+    local a = Bitarray.new(n)
+    for i = 1, n do a[i] = i % 7 == 0 or i % 11 == 0 end
+    local v = a:view(129, 512)
+        check(#v == 384 and v == a:slice(129, 512))
+        check(v:count() == a:count(129, 512) and v:find_first() == a:find_next(128) - 128)
+        check(v:at_uint8(1) == a:at_uint8(129) and v:rank(100) == a:count(129, 228))
+        check(v:band(a:slice(129, 512):bnot()):count() == 0)
+    -- the tail of the array may end a view
+    local t = a:view(961)
+        check(#t == 40 and t == a:slice(961, n) and a:view() == a)
+    -- other ranges are copied
+        check(a:view(2, 65) == a:slice(2, 65) and a:view(65, 100) == a:slice(65, 100))
+    -- whichever is written first gets a copy, the other keeps the old bits
+    local old = a:slice()
+    local w = a:view(1, 256)
+        w:fill(true)
+        check(w:count() == 256 and a == old)
+        a:flip_range(129, 512)
+        check(v == old:slice(129, 512) and a:slice(129, 512) == old:slice(129, 512):bnot())
+    -- views of views, and views outliving the array
+    local vv = v:view(65, 128)
+        check(vv == old:slice(193, 256))
+    a = nil
+    collectgarbage()
+        vv[1] = not vv[1]
+        check(vv ~= old:slice(193, 256) and v == old:slice(129, 512))
+        check(t:resize(64) == t and t:count(1, 40) == old:count(961, n))
+    -- views take no storage of their own until written to
+    local b = Bitarray.new(2^16)
+    local first = b:view(1, 64)
+    collectgarbage()
+    collectgarbage()
+    local s = Bitarray.memstats()
+    local views = {}
+    for i = 1, 64 do views[i] = b:view((i - 1) * 1024 + 1, i * 1024) end
+        check(Bitarray.memstats().bytes == s.bytes and Bitarray.memstats().arrays == s.arrays + 64)
+        views[3]:set_many({ 1, 2 })
+        check(Bitarray.memstats().bytes == s.bytes + 128 and b:count() == 0)
+    -- a write to the large array gives the small views their own copies
+        b:fill(true)
+        check(views[64]:count() == 0 and views[3]:count() == 2 and b:count() == 2^16)
+        check(first:count() == 0)
+    -- lists and destinations sharing words
+    local c = Bitarray.new(128):fill_range(1, 64, true)
+    local cv = c:view()
+        check(Bitarray.or_all({ cv, c:view():bnot() }, c) == c and c:count() == 128)
+        check(cv:count() == 64)
+end
+
+-- copy-on-write copies
+do
+    -- small arrays are copied, larger ones share their words, in a file for
+    -- the largest where the system allows it
+    for _, n in ipairs{ 100, 65539, 4194309 } do
+        local a = Bitarray.new(n)
+        for i = 1, n, 997 do a[i] = true end
+        local want = a:count()
+        local c = Bitarray.copyfrom(a)
+            check(c == a and #c == n and c:count() == want)
+            check(a:shiftleft(0) == a and a:shiftright(0) == a)
+            c[2] = true
+            check(not a[2] and c:count() == want + 1)
+            a:fill_range(1, 64, false)
+            check(c[1] and c[2] and a:count() == want - 1)
+        -- views and copies of copies
+        local d = Bitarray.copyfrom(c)
+        local m = math.min(n, 4096)
+        local v = d:view(1, m)
+            d:flip()
+            check(v == c:slice(1, m) and d == c:bnot())
+        local e = Bitarray.copyfrom(v)
+            v[3] = true
+            check(not e[3] and v[3] and v:count() == e:count() + 1)
+        -- the copy outlives the original and can do what any array can
+        a = nil
+        collectgarbage()
+            check(c:count() == want + 1 and c:resize(n + 64) == c and c:count() == want + 1)
+            check(Bitarray.load(d:dump()) == d)
+        local h = Bitarray.copyfrom(d)
+        local h2 = Bitarray.attach(h:share())
+            h2[n] = not h2[n]
+            check(h[n] ~= d[n])
+    end
+    collectgarbage()
+    local s = Bitarray.memstats()
+    local a = Bitarray.new(2^20)
+    local copies = {}
+    for i = 1, 16 do copies[i] = Bitarray.copyfrom(a) end
+        check(Bitarray.memstats().bytes == s.bytes + 2^17)
+    -- large enough to go to a file where there is one, which takes its words
+    -- off the heap bytes, and so are the pages written
+    local b = Bitarray.new(2^21)
+    local before = Bitarray.memstats().bytes
+    local c = Bitarray.copyfrom(b)
+    local after = Bitarray.memstats().bytes
+        check(after == before or after == before - 2^18)
+        c[1] = true
+        check(Bitarray.memstats().bytes == (after == before and after + 2^18 or after))
+        check(c[1] and not b[1])
+    c = nil
+    collectgarbage()
+        check(Bitarray.memstats().bytes == after)
+    b = nil
+    collectgarbage()
+        check(Bitarray.memstats().bytes == s.bytes + 2^17)
+end
+
+-- serialization
+do
+    local function le(v, k)
+        local t = {}
+        for i = 1, k do
+            t[i] = string.char(v % 256)
+            v = math.floor(v / 256)
+        end
+        return table.concat(t)
+    end
+    for _, n in ipairs{1, 7, 8, 63, 64, 65, 1000, 40000} do
+        local a = Bitarray.new(n)
+        for i = 1, n, 7 do a[i] = true end
+        a[n] = true
+        local s = a:dump()
+            check(#s == 16 + math.ceil(n / 8 / Bitarray._blocksize) * Bitarray._blocksize + 4)
+            check(s:sub(1, 4) == '\137BIT' and s:sub(9, 16) == le(n, 8))
+            check(Bitarray.load(s) == a and Bitarray.load(a:dump(false)) == a)
+            check(#a:dump(false) == #s - 4)
+        -- every flipped bit is caught by the checksum
+        for _, k in ipairs{1, 5, 9, 17, #s - 2} do
+            local bad = s:sub(1, k - 1) .. string.char((s:byte(k) + 1) % 256) .. s:sub(k + 1)
+            local r, msg = Bitarray.load(bad)
+                check(r == nil and type(msg) == 'string')
+        end
+            check(Bitarray.load(s:sub(1, -2)) == nil and Bitarray.load(s .. '\0') == nil)
+        -- the same array stored with 32 and 64 bit words in either byte order
+        for _, ws in ipairs{4, 8} do
+            local bytes = a:to_bytes(1, n, 'lsb')
+            bytes = bytes .. string.rep('\0', (ws - #bytes % ws) % ws)
+            for _, big in ipairs{false, true} do
+                local payload = bytes
+                if big then
+                    local t = {}
+                    for i = 1, #bytes, ws do t[#t+1] = bytes:sub(i, i + ws - 1):reverse() end
+                    payload = table.concat(t)
+                end
+                local h = '\137BIT\1\0' .. string.char(ws, big and 1 or 0) .. le(n, 8)
+                    check(Bitarray.load(h .. payload) == a)
+            end
+        end
+    end
+        check(Bitarray.load('') == nil and Bitarray.load('\137BIT\2\0\8\0' .. le(8, 8) .. le(0, 8)) == nil)
+        check(Bitarray.load('\137BIT\1\0\8\0' .. le(0, 8)) == nil)
+        check(Bitarray.load('\137BIT\1\0\3\0' .. le(8, 4)) == nil)
+    -- unused bits of the payload are cleared
+    local r = Bitarray.load('\137BIT\1\0\4\0' .. le(3, 8) .. '\255\255\255\255')
+        check(r:count() == 3 and r == Bitarray.new(3):fill(true))
+        checkerror(function() Bitarray.load() end)
+    -- several arrays streamed through one file
+    local f = io.tmpfile()
+    local a, b = Bitarray.new(100000):fill(true), Bitarray.new(3):set(2, true)
+        check(a:save(f) == a and b:save(f, false) == b)
+        f:write('tail')
+        f:seek('set')
+        check(Bitarray.read(f) == a and Bitarray.read(f) == b and f:read('*a') == 'tail')
+    local r2, msg = Bitarray.read(f)
+        check(r2 == nil and type(msg) == 'string')
+        f:close()
+    -- headers of arrays no block can hold are refused before allocating
+    for _, size in ipairs{string.rep('\255', 8), string.rep('\0', 7) .. '\128'} do
+        f = io.tmpfile()
+        f:write('\137BIT\1\0\8\0' .. size .. string.rep('\0', 64))
+        f:seek('set')
+        local r3, msg3 = Bitarray.read(f)
+            check(r3 == nil and msg3 == 'array too large for this platform')
+            f:close()
+    end
+        checkerror(function() Bitarray.read(f) end)
+        checkerror(function() a:save(f) end)
+        checkerror(function() a:save('file') end)
+end
+
+-- compressed serialization
+do
+    -- runs of random length and content, with some noisy stretches
+    local function runs(n, seed)
+        math.randomseed(seed)
+        local a = Bitarray.new(n)
+        local i = 1
+        while i <= n do
+            local len = math.random(1, 3) == 1 and math.random(1, 70) or math.random(1, 5000)
+            local kind = math.random(1, 3)
+            for j = i, math.min(n, i + len - 1) do
+                a[j] = kind == 1 or (kind == 3 and math.random(1, 2) == 1)
+            end
+            i = i + len
+        end
+        return a
+    end
+    for _, n in ipairs{1, 63, 64, 65, 128, 1000, 70000} do
+        local a, b = runs(n, n), runs(n, n + 1)
+        for _, codec in ipairs{'ewah', 'rle', 'raw'} do
+            local blob = a:compress(codec)
+                check(Bitarray.decompress(blob) == a and Bitarray.load(blob) == a)
+                check(Bitarray.load(a:compress(codec, false)) == a)
+            local r, msg = Bitarray.load(blob:sub(1, -2))
+                check(r == nil and type(msg) == 'string')
+        end
+        local x, y = a:compress(), b:compress()
+            check(Bitarray.decompress(Bitarray.ewah_and(x, y)) == a:band(b))
+            check(Bitarray.decompress(Bitarray.ewah_or(x, y)) == a:bor(b))
+            check(Bitarray.decompress(Bitarray.ewah_xor(x, y)) == a:bxor(b))
+            check(Bitarray.decompress(Bitarray.ewah_and(x, a:compress('ewah', false))) == a)
+        local ones = Bitarray.new(n):fill(true)
+            check(Bitarray.decompress(Bitarray.ewah_xor(x, ones:compress())) == a:bnot())
+            check(Bitarray.decompress(Bitarray.ewah_or(ones:compress(), y)) == ones)
+    end
+    -- long runs compress to a few words
+    local big = Bitarray.new(1000000):set(5, true)
+        check(#big:compress() == 44 and #big:compress('rle') < 44)
+    local c = big:compress('ewah', false)
+        check(#c == 40 and Bitarray.decompress(c) == big)
+    -- corrupt streams are refused, also without a checksum
+    local r = Bitarray.decompress(c:sub(1, 32) .. string.rep('\255', 8))
+        check(r == nil)
+        check(Bitarray.decompress(big:compress('rle', false) .. '\0') == nil)
+        check(Bitarray.decompress(big:compress('rle', false):sub(1, -2)) == nil)
+    -- a size no block can hold, with one rle token of 2^58 zero words and
+    -- one ewah marker, is refused before anything is allocated
+    local huge = string.rep('\255', 8)
+    local rle = '\137BIT\1\2\8\0' .. huge .. '\128\128\128\128\128\128\128\128\16'
+    local ewah = '\137BIT\1\4\8\0' .. huge .. '\254\255\255\255\1\0\0\0'
+    for _, blob in ipairs{rle, ewah} do
+        local r3, msg3 = Bitarray.load(blob)
+            check(r3 == nil and msg3 == 'array too large for this platform')
+            check(Bitarray.decompress(blob) == nil)
+    end
+    local other = Bitarray.new(999999):compress()
+    local r2, msg = Bitarray.ewah_and(big:compress(), other)
+        check(r2 == nil and type(msg) == 'string')
+        check(Bitarray.ewah_and(big:compress(), big:compress('rle')) == nil)
+        check(Bitarray.ewah_or(big:compress(), big:dump()) == nil)
+        checkerror(function() big:compress('zip') end)
+        checkerror(function() Bitarray.ewah_and(big:compress()) end)
+    -- compressed arrays do not stream through files
+    local f = io.tmpfile()
+        f:write(big:compress())
+        f:seek('set')
+        check(Bitarray.read(f) == nil)
+        f:close()
+end
+
+-- file mappings
+if package.config:sub(1, 1) == '/' then
+    local path = os.tmpname()
+    local n = 1000
+    local a = Bitarray.mmap(path, n)
+    local bytes = 16 + math.ceil(n / 8 / Bitarray._blocksize) * Bitarray._blocksize
+    local function filesize()
+        local f = io.open(path, 'rb')
+        local sz = f:seek('end')
+        f:close()
+        return sz
+    end
+        check(#a == n and a:count() == 0 and filesize() == bytes)
+    for i = 1, n, 3 do a[i] = true end
+        check(a:sync() == a)
+    local ref = Bitarray.copyfrom(a)
+    -- another mapping of the same file sees the bits, also before the sync
+    local b = Bitarray.mmap(path, n, 'readonly')
+        check(b == ref and b:count() == ref:count() and b:rank(500) == ref:rank(500))
+        a[2] = true
+        check(b[2])
+        a[2] = false
+        checkerror(function() b[1] = false end)
+        checkerror(function() b:fill(false) end)
+        checkerror(function() b:reverse() end)
+        checkerror(function() Bitarray.bnot_into(b, a) end)
+        checkerror(function() b:resize(10) end)
+        checkerror(function() a:resize(10) end)
+        check(b:bnot():count() == n - ref:count())
+    -- private changes are not written back
+    local c = Bitarray.mmap(path, n, 'private')
+        c:fill(true)
+        check(c:count() == n and a == ref and b == ref)
+    -- the size is taken from the file, a given one has to match
+        check(Bitarray.mmap(path) == ref and Bitarray.mmap(path, nil, 'private') == ref)
+        check(Bitarray.mmap(path, 10, 'readonly') == nil and Bitarray.mmap(path, 10) == nil)
+    -- saved files can be mapped, and mapped ones read
+    local f = io.open(path, 'rb')
+    local d = Bitarray.read(f)
+        f:close()
+        check(d == ref)
+    d:set(n, true)
+    f = io.open(path, 'wb')
+        check(d:save(f) == d)
+        f:close()
+        check(Bitarray.mmap(path, n, 'readonly') == d and filesize() == bytes + 4)
+    -- a shared mapping drops the checksum, which goes stale
+    local e = Bitarray.mmap(path)
+        e[1] = true
+        d[1] = true
+        f = io.open(path, 'rb')
+        check(Bitarray.read(f) == d)
+        f:close()
+    local r, msg = Bitarray.mmap(path .. '/nonexistent', 8)
+        check(r == nil and type(msg) == 'string')
+        f = io.open(path, 'wb')
+        f:write('not a bitarray at all')
+        f:close()
+        check(Bitarray.mmap(path, 8) == nil and Bitarray.mmap(path, nil, 'readonly') == nil)
+        checkerror(function() Bitarray.mmap(path, 8, 'rw') end)
+    os.remove(path)
+        check(Bitarray.mmap(path) == nil and Bitarray.mmap(path, nil, 'private') == nil)
+    a, b, c, d, e = nil, nil, nil, nil, nil
+    collectgarbage()
+    os.remove(path)
+end
+
 print('all tests passed!')